@@ -0,0 +1,116 @@
+/*
+ * Reader microbenchmark: parses 100k-element multi-bulk replies with each
+ * CRLF/integer kernel available on this CPU.
+ *
+ *   make CFLAGS="-DLINUX -O2" && make -f Makefile.bench && ./bench
+ */
+#ifdef LINUX
+ #include "ccfmacros.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ccds.h"
+#include "libredis.h"
+
+#define ELEMENTS 100000
+#define ROUNDS 200
+
+static const char *level_name[] = {"scalar", "sse2", "avx2"};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* HGETALL-like reply: field names and values of mixed sizes */
+static cds build_bulk_reply(void) {
+    cds s = cdsnew(NULL);
+    char tmp[256];
+    int i, len;
+
+    len = sprintf(tmp, "*%d\r\n", ELEMENTS);
+    s = cdscatlen(s, tmp, len);
+    for (i = 0; i < ELEMENTS; i++) {
+        if (i % 2)
+            len = sprintf(tmp, "$%d\r\n%0*d\r\n", 8+i%120, 8+i%120, i);
+        else
+            len = sprintf(tmp, "$%d\r\nfield:%08d\r\n", 14, i);
+        s = cdscatlen(s, tmp, len);
+    }
+    return s;
+}
+
+/* ZRANGE/ZCOUNT-like reply: an array of integers */
+static cds build_integer_reply(void) {
+    cds s = cdsnew(NULL);
+    char tmp[64];
+    int i, len;
+
+    len = sprintf(tmp, "*%d\r\n", ELEMENTS);
+    s = cdscatlen(s, tmp, len);
+    for (i = 0; i < ELEMENTS; i++) {
+        len = sprintf(tmp, ":%lld\r\n", (long long)i*7919*104729);
+        s = cdscatlen(s, tmp, len);
+    }
+    return s;
+}
+
+/* Parse data once with the given kernel, returns ns per element. */
+static double parse_once(redis_reader *r, cds data, int level) {
+    redis_reply *reply;
+    double start;
+
+    redis_set_simd(level);
+    /* zero-copy terminates strings in place, so feed a fresh copy */
+    redis_reader_feed(r, data, cdslen(data));
+    start = now();
+    reply = redis_get_reply(r);
+    start = now()-start;
+    if (reply == NULL || reply->elements != ELEMENTS) {
+        fprintf(stderr, "parse failed: %s\n", r->errstr);
+        exit(1);
+    }
+    return start*1e9/ELEMENTS;
+}
+
+/* Rounds of the kernels are interleaved and the best one is kept, which is
+ * what is left once scheduling noise is gone. */
+static void run(const char *name, cds data, int zerocopy, int max) {
+    redis_reader *r = redis_create_reader();
+    double t, best[REDIS_SIMD_AVX2+1];
+    int i, level;
+
+    redis_reader_set_zerocopy(r, zerocopy);
+    for (i = 0; i < ROUNDS; i++) {
+        for (level = REDIS_SIMD_NONE; level <= max; level++) {
+            t = parse_once(r, data, level);
+            if (i == 0 || t < best[level]) best[level] = t;
+        }
+    }
+    printf("%-10s", name);
+    for (level = REDIS_SIMD_NONE; level <= max; level++)
+        printf(" %8s %6.2f ns/elem", level_name[level], best[level]);
+    printf("  (%.2fx)\n", best[REDIS_SIMD_NONE]/best[max]);
+    redis_free_reader(r);
+}
+
+int main(int argc, char **argv) {
+    cds bulk = build_bulk_reply();
+    cds integer = build_integer_reply();
+    int max;
+
+    ((void)argc);
+    ((void)argv);
+
+    max = redis_set_simd(REDIS_SIMD_AVX2);
+    run("bulk", bulk, 0, max);
+    run("bulk-zc", bulk, 1, max);
+    run("integer", integer, 0, max);
+
+    cdsfree(bulk);
+    cdsfree(integer);
+    return 0;
+}
@@ -65,6 +65,16 @@ cds cdsmakeroom(cds s, size_t addlen) {
 	return ds->buf;
 }
 
+/* Account for incr bytes written straight into the room made by
+ * cdsmakeroom(). */
+void cdsincrlen(cds s, size_t incr) {
+	cds_t *ds = (void *)(s-sizeof(cds_t));
+
+	ds->len += incr;
+	ds->free -= incr;
+	s[ds->len] = 0;
+}
+
 cds cdscatlen(cds s, const void *t, size_t len) {
 	cds_t *ds;
 	size_t curlen = cdslen(s);	
@@ -105,6 +115,22 @@ cds cdscopy(cds s, char *t) {
     return cdscopylen(s, t, strlen(t)); 
 }
 
+/* Keep only the bytes in [start, end), moved to the front of the string. */
+void cdsrange(cds s, size_t start, size_t end) {
+	cds_t *ds = (void *)(s-sizeof(cds_t));
+	size_t total = ds->len + ds->free;
+
+	if (end > ds->len) end = ds->len;
+	if (start >= end) {
+		cdsclear(s);
+		return;
+	}
+	if (start) memmove(s, s+start, end-start);
+	ds->len = end-start;
+	ds->free = total-ds->len;
+	s[ds->len] = 0;
+}
+
 int cdscmp(const cds s1, const cds s2) {
 	size_t l1, l2, l3;
 
@@ -33,10 +33,12 @@ cds cdsdup(const cds s);
 void cdsfree(cds s);
 void cdsclear(cds s);
 cds cdsmakeroom(cds s, size_t addlen);
+void cdsincrlen(cds s, size_t incr);
 cds cdscatlen(cds s, const void *t, size_t len);
 cds cdscat(cds s, const char *t);
 cds cdscopylen(cds s, char *t, size_t len);
 cds cdscopy(cds s, char *t);
+void cdsrange(cds s, size_t start, size_t end);
 int cdscmp(const cds s1, const cds s2);
 cds cdscatvprintf(cds s, const char *fmt, va_list ap);
 
@@ -3,24 +3,48 @@
  * Description: The source file of ceventloop
  */
 
+#ifdef LINUX
+ #include "ccfmacros.h"
+#endif
 #include <time.h>
-#include <sys/time.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
 #include "ccel.h"
+#include "ccpoll.c"
 #ifdef LINUX
+ #include <sys/eventfd.h>
  #include "ccepoll.c"
+ #define el_api_native el_api_epoll
+ #if defined(__has_include)
+  #if __has_include(<linux/io_uring.h>)
+   #define EL_HAVE_URING
+   #include "ccuring.c"
+  #endif
+ #endif
 #else
- #include "ccselect.c"
+ #define el_api_native el_api_sys_poll
 #endif
 
 
+static int cel_init_wakeup(st_event_loop *el);
+static void cel_wakeup(st_event_loop *el);
+static void cel_close_wakeup(st_event_loop *el);
+static void cel_process_posts(st_event_loop *el);
+
 st_event_loop *cel_create_event_loop(int setsize) {
+	return cel_create_event_loop_api(setsize, EL_API_NATIVE);
+}
+
+st_event_loop *cel_create_event_loop_api(int setsize, int api) {
 	st_event_loop *el;
 
 	if ((el = malloc(sizeof(st_event_loop))) == NULL) goto err;	
 	memset(el, 0, sizeof(st_event_loop));
+	el->wakefd[0] = el->wakefd[1] = -1;
 	if ((el->events = malloc(sizeof(st_el_file_event)*setsize)) == NULL) goto err;
 	if ((el->event_data = malloc(sizeof(st_el_event_data)*setsize)) == NULL) goto err;
 	memset(el->events, 0, sizeof(st_el_file_event)*setsize);
@@ -28,12 +52,43 @@ st_event_loop *cel_create_event_loop(int setsize) {
 	el->setsize = setsize;
 	el->maxfd = -1;
 	el->stop = 0;
-	el->lasttime = time(NULL);
-	if (el_api_create(el) == -1) goto err;
+	el->timer_free = -1;
+#ifdef EL_HAVE_URING
+	if (api == EL_API_AUTO || api == EL_API_URING) {
+		el->api = &el_api_uring;
+		if (el->api->create(el) == -1) {
+			if (api == EL_API_URING) goto err;
+			el->api = NULL;
+		}
+	}
+#else
+	if (api == EL_API_URING) goto err;
+#endif
+#ifdef LINUX
+	if (api == EL_API_EPOLL_ET) {
+		el->api = &el_api_epoll_edge;
+		if (el->api->create(el) == -1) goto err;
+	}
+#else
+	if (api == EL_API_EPOLL_ET) goto err;
+#endif
+	if (api == EL_API_POLL) {
+		el->api = &el_api_sys_poll;
+		if (el->api->create(el) == -1) goto err;
+	}
+	if (el->api == NULL) {
+		el->api = &el_api_native;
+		if (el->api->create(el) == -1) goto err;
+	}
+	if (cel_init_wakeup(el) == EL_ERR) {
+		el->api->free(el);
+		goto err;
+	}
 	return el;	
 
 err:
 	if (el) {
+		cel_close_wakeup(el);
 		if (el->events) free(el->events);
 		if (el->event_data) free(el->event_data);
 		free(el);
@@ -43,23 +98,55 @@ err:
 
 void cel_delete_event_loop(st_event_loop *el) {
 	if (!el) return;
-	el_api_free(el);
+	/* let the posters release what they handed over */
+	cel_process_posts(el);
+	cel_close_wakeup(el);
+	el->api->free(el);
 	free(el->events);
 	free(el->event_data);
+	free(el->timers);
+	free(el->timer_heap);
 	free(el);
 }
 
+const char *cel_get_api_name(st_event_loop *el) {
+	return el->api->name;
+}
+
+/* May be called from any thread, the loop wakes up to notice. */
 void cel_stop(st_event_loop *el) {
-	el->stop = 1;
+	__atomic_store_n(&el->stop, 1, __ATOMIC_RELEASE);
+	cel_wakeup(el);
+}
+
+/* Grow the tables indexed by fd so that setsize fds fit. */
+static int cel_resize(st_event_loop *el, int setsize) {
+	st_el_file_event *events;
+	st_el_event_data *event_data;
+
+	if (el->api->resize(el, setsize) == -1) return EL_ERR;
+	if ((events = realloc(el->events, sizeof(st_el_file_event)*setsize)) == NULL) 
+		return EL_ERR;
+	el->events = events;
+	if ((event_data = realloc(el->event_data, sizeof(st_el_event_data)*setsize)) == NULL) 
+		return EL_ERR;
+	el->event_data = event_data;
+	memset(el->events+el->setsize, 0, sizeof(st_el_file_event)*(setsize-el->setsize));
+	memset(el->event_data+el->setsize, 0, sizeof(st_el_event_data)*(setsize-el->setsize));
+	el->setsize = setsize;
+	return EL_OK;
 }
 
 int cel_add_file_event(st_event_loop *el, int fd, int mask, el_file_proc *proc, void *clientdata) {
 	if (fd >= el->setsize) {
-		return EL_ERR;
+		int setsize = el->setsize*2;
+		if (setsize <= fd) setsize = fd+1;
+		if (cel_resize(el, setsize) == EL_ERR)
+			return EL_ERR;
 	}
 
 	st_el_file_event *fe = &el->events[fd];
-	if (el_api_add_event(el, fd, mask) == -1) 
+	if (el->api->add_event(el, fd, mask) == -1) 
 		return EL_ERR;
 	fe->mask |= mask;
 	if (mask & EL_READABLE) fe->rfileproc = proc;
@@ -75,7 +162,7 @@ int cel_del_file_event(st_event_loop *el, int fd, int mask) {
 	st_el_file_event *fe = &el->events[fd];
 	if (fe->mask == EL_NONE) return EL_ERR;
 
-	if (el_api_del_event(el, fd, mask) == -1) 
+	if (el->api->del_event(el, fd, mask) == -1) 
 		return EL_ERR;
 	fe->mask = fe->mask & (~mask);
 	if (fd == el->maxfd) {
@@ -96,110 +183,128 @@ int cel_get_file_event(st_event_loop *el, int fd) {
 	return el->events[fd].mask;
 }
 
-static void cel_get_time(long *seconds, long *milliseconds) {
-	struct timeval tv;
+static long long cel_get_time(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static int cel_timer_before(st_event_loop *el, int a, int b) {
+	return el->timers[el->timer_heap[a]].when < el->timers[el->timer_heap[b]].when;
+}
+
+static void cel_timer_swap(st_event_loop *el, int a, int b) {
+	int slot = el->timer_heap[a];
+
+	el->timer_heap[a] = el->timer_heap[b];
+	el->timer_heap[b] = slot;
+	el->timers[el->timer_heap[a]].heap = a;
+	el->timers[el->timer_heap[b]].heap = b;
+}
+
+/* restore the heap order around index i after its key changed */
+static void cel_timer_fix(st_event_loop *el, int i) {
+	int child;
 
-	gettimeofday(&tv, NULL);
-	*seconds = tv.tv_sec;
-	*milliseconds = tv.tv_usec/1000;	
+	while (i > 0 && cel_timer_before(el, i, (i-1)/2)) {
+		cel_timer_swap(el, i, (i-1)/2);
+		i = (i-1)/2;
+	}
+	while ((child = 2*i+1) < el->ntimers) {
+		if (child+1 < el->ntimers && cel_timer_before(el, child+1, child))
+			child++;
+		if (!cel_timer_before(el, child, i))
+			break;
+		cel_timer_swap(el, i, child);
+		i = child;
+	}
 }
 
-static void cel_add_milliseconds_to_now(long milliseconds, long *sec, long *ms) {
-	long cur_sec, cur_ms, when_sec, when_ms;
+static int cel_timer_grow(st_event_loop *el) {
+	int slots = el->timer_slots ? el->timer_slots*2 : 16, i;
+	st_el_timer_event *timers;
+	int *heap;
 
-	cel_get_time(&cur_sec, &cur_ms);	
-	when_sec = cur_sec + milliseconds/1000;
-	when_ms = cur_ms + milliseconds%1000;
-	if (when_ms >= 1000) {
-		when_sec++;
-		when_ms -= 1000;
+	if (slots > EL_TIMER_SLOT_MASK+1) slots = EL_TIMER_SLOT_MASK+1;
+	if (slots == el->timer_slots) return EL_ERR;
+	if ((timers = realloc(el->timers, sizeof(st_el_timer_event)*slots)) == NULL)
+		return EL_ERR;
+	el->timers = timers;
+	if ((heap = realloc(el->timer_heap, sizeof(int)*slots)) == NULL)
+		return EL_ERR;
+	el->timer_heap = heap;
+	for (i = slots-1; i >= el->timer_slots; i--) {
+		timers[i].id = i;
+		timers[i].heap = -1;
+		timers[i].next = el->timer_free;
+		el->timer_free = i;
 	}
-	*sec = when_sec;
-	*ms = when_ms;
+	el->timer_slots = slots;
+	return EL_OK;
 }
 
 int cel_add_timer_event(st_event_loop *el, int milliseconds, el_timer_proc *proc, void *clientdata) {
-	int id = el->next_timer_id++;
 	st_el_timer_event *te;
+	int slot;
 
-	te = malloc(sizeof(st_el_timer_event));
-	if (te == NULL) return EL_ERR;
-	te->id = id;
-	cel_add_milliseconds_to_now(milliseconds, &te->when_sec, &te->when_ms);
+	if (el->timer_free == -1 && cel_timer_grow(el) == EL_ERR)
+		return EL_ERR;
+	slot = el->timer_free;
+	te = &el->timers[slot];
+	el->timer_free = te->next;
+	te->when = cel_get_time() + milliseconds*1000000LL;
 	te->timerproc = proc;
 	te->clientdata = clientdata;
-	te->next = el->timer_event_head;
-	el->timer_event_head = te;
-	return id;
+	te->heap = el->ntimers;
+	el->timer_heap[el->ntimers++] = slot;
+	cel_timer_fix(el, te->heap);
+	return te->id;
 }
 
 int cel_del_timer_event(st_event_loop *el, int id) {
-	st_el_timer_event *te, *p = NULL;
-
-	te = el->timer_event_head;
-	while (te) {
-		if (te->id == id) {
-			if (p == NULL) 
-				el->timer_event_head = te->next;
-			else
-				p->next = te->next;
-			free(te);
-			return EL_OK;
-		}
-		p = te;
-		te = te->next;
-	}
-	return EL_ERR;
-}
+	int slot = id & EL_TIMER_SLOT_MASK, i;
+	st_el_timer_event *te;
 
-static st_el_timer_event *cel_search_nearest_timer(st_event_loop *el) {
-	st_el_timer_event *te = el->timer_event_head;
-    st_el_timer_event *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te; 
-        te = te->next;
-    }
-    return nearest;
+	if (id < 0 || slot >= el->timer_slots) return EL_ERR;
+	te = &el->timers[slot];
+	if (te->id != id || te->heap == -1) return EL_ERR;
+	i = te->heap;
+	if (i != --el->ntimers) {
+		cel_timer_swap(el, i, el->ntimers);
+		cel_timer_fix(el, i);
+	}
+	/* a new generation keeps the old id from matching the reused slot */
+	te->id = (int)(((unsigned)te->id + EL_TIMER_SLOT_MASK+1) & INT_MAX);
+	te->heap = -1;
+	te->next = el->timer_free;
+	el->timer_free = slot;
+	return EL_OK;
 }
 
 /* timer event */
 static int cel_process_timer_event(st_event_loop *el) {
 	int processed = 0;
-	st_el_timer_event *te;
-	time_t now = time(NULL);
+	long long now = cel_get_time();
 
-	if (now < el->lasttime) {
-		te = el->timer_event_head;
-		while (te) {
-			te->when_sec = 0;
-			te = te->next;
-		}
-	}
-	el->lasttime = now;
-	te = el->timer_event_head;
-
-	while (te) {
-		long now_sec, now_ms;
-
-		cel_get_time(&now_sec, &now_ms);
-		if (now_sec > te->when_sec || 
-				(now_sec == te->when_sec && now_ms >= te->when_ms)) {
-			int retval;
-
-			retval = te->timerproc(el, te->id, te->clientdata);
-			processed++;
-			if (retval != EL_NOMORE) {
-				cel_add_milliseconds_to_now(retval, &te->when_sec, &te->when_ms);			
-			} else {
-				cel_del_timer_event(el, te->id);	
-				te = el->timer_event_head;
-			}
+	while (el->ntimers > 0) {
+		st_el_timer_event *te = &el->timers[el->timer_heap[0]];
+		int id = te->id, slot = el->timer_heap[0], retval;
+
+		if (te->when > now) break;
+		retval = te->timerproc(el, id, te->clientdata);
+		processed++;
+		/* the proc may have deleted it or added timers */
+		te = &el->timers[slot];
+		if (te->id != id || te->heap == -1) continue;
+		if (retval == EL_NOMORE) {
+			cel_del_timer_event(el, id);
+		} else {
+			te->when = cel_get_time() + retval*1000000LL;
+			/* never run twice within one pass */
+			if (te->when <= now) te->when = now+1;
+			cel_timer_fix(el, te->heap);
 		}
-		te = te->next;
 	}
 
 	return processed;	
@@ -213,21 +318,16 @@ int cel_process_event(st_event_loop *el, int flags) {
 	if (!(flags & EL_FILE_EVENTS) && !(flags & EL_TIMER_EVENTS)) return 0;
 
 	if (el->maxfd != -1 || (flags & EL_TIMER_EVENTS)) {
-		st_el_timer_event *te = NULL;
-
-		if (flags & EL_TIMER_EVENTS) 
-			te = cel_search_nearest_timer(el);
-		if (te) {
-			long now_sec, now_ms;
-			cel_get_time(&now_sec, &now_ms);
-			ms = (te->when_sec - now_sec) * 1000;
-			ms += te->when_ms - now_ms;
-			if (ms < 0) ms = 0;
+		if ((flags & EL_TIMER_EVENTS) && el->ntimers > 0) {
+			long long ns = el->timers[el->timer_heap[0]].when - cel_get_time();
+
+			/* round up, waking early would only spin */
+			ms = ns > 0 ? (long)((ns+999999)/1000000) : 0;
 		}
 	}
 
 	int i, numevents;
-	numevents = el_api_poll(el, ms);
+	numevents = el->api->poll(el, ms);
 	for (i = 0; i < numevents; i++) {
 		st_el_file_event *fe = &el->events[el->event_data[i].fd];			
 		int mask = el->event_data[i].mask;
@@ -237,6 +337,8 @@ int cel_process_event(st_event_loop *el, int flags) {
 		if (fe->mask & mask & EL_READABLE) {
 			fe->rfileproc(el, fd, fe->clientdata, mask);
 			read = 1;
+			/* the proc may have grown the table */
+			fe = &el->events[fd];
 		}
 		if (fe->mask & mask & EL_WRITABLE) {
 			if (!read || fe->rfileproc != fe->wfileproc) 
@@ -252,10 +354,129 @@ int cel_process_event(st_event_loop *el, int flags) {
 	return processed;
 }
 
+void cel_init_hook(st_el_hook *hook, el_hook_proc *proc, void *clientdata) {
+	hook->proc = proc;
+	hook->clientdata = clientdata;
+	hook->scheduled = 0;
+	hook->next = NULL;
+}
+
+/* Run hook once before the loop sleeps again. Scheduling a hook that is
+ * already pending does nothing, so it is O(1) and allocation free. */
+void cel_schedule_hook(st_event_loop *el, st_el_hook *hook) {
+	if (hook->scheduled) return;
+	hook->scheduled = 1;
+	hook->next = el->hook_head;
+	el->hook_head = hook;
+}
+
+void cel_cancel_hook(st_event_loop *el, st_el_hook *hook) {
+	st_el_hook **p = &el->hook_head;
+
+	if (!hook->scheduled) return;
+	while (*p && *p != hook)
+		p = &(*p)->next;
+	if (*p) *p = hook->next;
+	hook->scheduled = 0;
+}
+
+/* hooks scheduled while running are run too */
+static void cel_process_hooks(st_event_loop *el) {
+	st_el_hook *hook;
+
+	while ((hook = el->hook_head) != NULL) {
+		el->hook_head = hook->next;
+		hook->scheduled = 0;
+		hook->proc(el, hook->clientdata);
+	}
+}
+
+static void cel_wakeup_event(st_event_loop *el, int fd, void *clientdata, int mask) {
+	char buf[64];
+
+	(void)clientdata;
+	(void)mask;
+	/* drain before taking the queue, a post after this wakes us again */
+	while (read(fd, buf, sizeof(buf)) > 0);
+	cel_process_posts(el);
+}
+
+static int cel_init_wakeup(st_event_loop *el) {
+#ifdef LINUX
+	if ((el->wakefd[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1)
+		return EL_ERR;
+	el->wakefd[1] = el->wakefd[0];
+#else
+	if (pipe(el->wakefd) == -1) {
+		el->wakefd[0] = el->wakefd[1] = -1;
+		return EL_ERR;
+	}
+	if (fcntl(el->wakefd[0], F_SETFL, O_NONBLOCK) == -1 ||
+			fcntl(el->wakefd[1], F_SETFL, O_NONBLOCK) == -1)
+		return EL_ERR;
+#endif
+	return cel_add_file_event(el, el->wakefd[0], EL_READABLE, cel_wakeup_event, NULL);
+}
+
+static void cel_wakeup(st_event_loop *el) {
+	unsigned long long one = 1;
+	ssize_t n;
+
+	/* a full pipe or eventfd is already pending, which is enough */
+	do {
+		n = write(el->wakefd[1], &one, sizeof(one));
+	} while (n == -1 && errno == EINTR);
+}
+
+static void cel_close_wakeup(st_event_loop *el) {
+	if (el->wakefd[0] != -1) close(el->wakefd[0]);
+	if (el->wakefd[1] != -1 && el->wakefd[1] != el->wakefd[0]) close(el->wakefd[1]);
+	el->wakefd[0] = el->wakefd[1] = -1;
+}
+
+/* Run proc(el, arg) on the thread running the loop. Safe to call from any
+ * thread; the queue is a lock-free stack and only the post onto an empty
+ * one has to wake the loop. */
+int cel_post(st_event_loop *el, el_post_proc *proc, void *arg) {
+	st_el_post *post, *head;
+
+	if ((post = malloc(sizeof(st_el_post))) == NULL)
+		return EL_ERR;
+	post->proc = proc;
+	post->arg = arg;
+	head = __atomic_load_n(&el->post_head, __ATOMIC_RELAXED);
+	do {
+		post->next = head;
+	} while (!__atomic_compare_exchange_n(&el->post_head, &head, post, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	if (head == NULL)
+		cel_wakeup(el);
+	return EL_OK;
+}
+
+static void cel_process_posts(st_event_loop *el) {
+	st_el_post *post, *next, *list = NULL;
+
+	post = __atomic_exchange_n(&el->post_head, NULL, __ATOMIC_ACQUIRE);
+	/* newest first, turn it back into posting order */
+	while (post) {
+		next = post->next;
+		post->next = list;
+		list = post;
+		post = next;
+	}
+	for (post = list; post; post = next) {
+		next = post->next;
+		post->proc(el, post->arg);
+		free(post);
+	}
+}
+
 void cel_main(st_event_loop *el) {
-	while (!el->stop) {
+	while (!__atomic_load_n(&el->stop, __ATOMIC_ACQUIRE)) {
 		if (el->before_sleep)
 			el->before_sleep(el);
+		cel_process_hooks(el);
 		cel_process_event(el, EL_ALL_EVENTS);
 	}
 }
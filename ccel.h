@@ -19,12 +19,21 @@
 
 #define EL_NOMORE -1
 
+/* backend of cel_create_event_loop_api() */
+#define EL_API_AUTO 0		/* io_uring when the kernel has it, else the native one */
+#define EL_API_NATIVE 1		/* epoll on linux, poll elsewhere */
+#define EL_API_URING 2
+#define EL_API_EPOLL_ET 3	/* edge-triggered epoll, procs must drain their fd */
+#define EL_API_POLL 4		/* poll() on any platform */
+
 
 struct st_event_loop;
 
 typedef void el_file_proc(struct st_event_loop *el, int fd, void *clentdata, int mask);
 typedef int el_timer_proc(struct st_event_loop *el, int id, void *clentdata);
 typedef void el_before_sleep_proc(struct st_event_loop *el);
+typedef void el_hook_proc(struct st_event_loop *el, void *clientdata);
+typedef void el_post_proc(struct st_event_loop *el, void *arg);
 
 typedef struct st_el_file_event {
 	int mask;           /* read|write */
@@ -33,15 +42,47 @@ typedef struct st_el_file_event {
 	void *clientdata;
 } st_el_file_event;
 
+/* timers live in a slot table and are ordered by a binary min-heap of
+ * slot numbers; a timer id is its slot plus a generation, so a stale id
+ * never cancels the timer that reused the slot */
+#define EL_TIMER_SLOT_BITS 20
+#define EL_TIMER_SLOT_MASK ((1<<EL_TIMER_SLOT_BITS)-1)
+
 typedef struct st_el_timer_event {
 	int id;
-	long when_sec;
-	long when_ms;
+	int heap;			/* index in the heap, -1 when the slot is free */
+	long long when;		/* CLOCK_MONOTONIC, nanoseconds */
 	el_timer_proc *timerproc;
 	void *clientdata;
-	struct st_el_timer_event *next;
+	int next;			/* next free slot */
 } st_el_timer_event;
 
+/* one-shot call before the loop next sleeps, embedded in its owner */
+typedef struct st_el_hook {
+	el_hook_proc *proc;
+	void *clientdata;
+	int scheduled;
+	struct st_el_hook *next;
+} st_el_hook;
+
+/* a call handed to the loop from another thread */
+typedef struct st_el_post {
+	el_post_proc *proc;
+	void *arg;
+	struct st_el_post *next;
+} st_el_post;
+
+/* the multiplexing backend, one per ccepoll.c, ccpoll.c, ccuring.c */
+typedef struct st_el_api {
+	const char *name;
+	int (*create)(struct st_event_loop *el);
+	void (*free)(struct st_event_loop *el);
+	int (*resize)(struct st_event_loop *el, int setsize);
+	int (*add_event)(struct st_event_loop *el, int fd, int mask);
+	int (*del_event)(struct st_event_loop *el, int fd, int delmask);
+	int (*poll)(struct st_event_loop *el, int timeout);
+} st_el_api;
+
 typedef struct st_el_event_data {
 	int fd;
 	int mask;
@@ -51,17 +92,25 @@ typedef struct st_event_loop {
 	int stop;
 	int maxfd;
 	int setsize;
-	int next_timer_id;
-	time_t lasttime;
 	st_el_file_event *events;		
 	st_el_event_data *event_data;
-	st_el_timer_event *timer_event_head;
+	st_el_timer_event *timers;
+	int timer_slots;
+	int timer_free;
+	int *timer_heap;
+	int ntimers;
 	void *apidata;
+	const st_el_api *api;
 	el_before_sleep_proc *before_sleep;
+	st_el_hook *hook_head;
+	st_el_post *post_head;		/* pushed to by any thread */
+	int wakefd[2];				/* eventfd, or a pipe elsewhere */
 } st_event_loop;
 
 /* Function prototypes */
 st_event_loop *cel_create_event_loop(int setsize);
+st_event_loop *cel_create_event_loop_api(int setsize, int api);
+const char *cel_get_api_name(st_event_loop *el);
 void cel_delete_event_loop(st_event_loop *el);
 void cel_stop(st_event_loop *el);
 
@@ -74,6 +123,12 @@ int cel_del_timer_event(st_event_loop *el, int id);
 
 void cel_set_before_sleep_proc(st_event_loop *el, el_before_sleep_proc *proc);
 
+void cel_init_hook(st_el_hook *hook, el_hook_proc *proc, void *clientdata);
+void cel_schedule_hook(st_event_loop *el, st_el_hook *hook);
+void cel_cancel_hook(st_event_loop *el, st_el_hook *hook);
+
+int cel_post(st_event_loop *el, el_post_proc *proc, void *arg);
+
 void cel_main(st_event_loop *el);
 
 #endif /* __C_EVENTLOOP_H__ */
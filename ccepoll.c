@@ -5,9 +5,20 @@
 
 #include <sys/epoll.h>
 
+/* In edge-triggered mode every fd is registered once for both directions
+ * and the interest mask lives only in el->events, so toggling write
+ * interest costs no epoll_ctl(). An edge for a direction nobody listens to
+ * is remembered in ready[] and handed out once interest is added. Procs
+ * must drain their fd, reading or writing until EAGAIN. */
+#define EL_EPOLL_QUEUED 4
+
 typedef struct st_el_api_state {
 	int epfd;
 	struct epoll_event *events;
+	int edge;
+	unsigned char *ready;	/* edge mode: EL_READABLE|EL_WRITABLE|EL_EPOLL_QUEUED */
+	int *queued;			/* edge mode: fds with an event to hand out */
+	int nqueued;
 } st_el_api_state;
 
 static int el_api_create(st_event_loop *el) {
@@ -35,19 +46,68 @@ static void el_api_free(st_event_loop *el) {
 
 	close(state->epfd);
 	free(state->events);
+	free(state->ready);
+	free(state->queued);
 	free(state);
 }
 
+static int el_api_create_edge(st_event_loop *el) {
+	st_el_api_state *state;
+
+	if (el_api_create(el) == -1) return -1;
+	state = el->apidata;
+	state->edge = 1;
+	state->ready = calloc(el->setsize, 1);
+	state->queued = malloc(sizeof(int)*el->setsize);
+	if (!state->ready || !state->queued) {
+		el_api_free(el);
+		return -1;
+	}
+	return 0;
+}
+
+static int el_api_resize(st_event_loop *el, int setsize) {
+	st_el_api_state *state = el->apidata;
+	struct epoll_event *events;
+	unsigned char *ready;
+	int *queued;
+
+	events = realloc(state->events, sizeof(struct epoll_event)*setsize);
+	if (!events) return -1;
+	state->events = events;
+	if (state->edge) {
+		if ((ready = realloc(state->ready, setsize)) == NULL) return -1;
+		state->ready = ready;
+		memset(ready+el->setsize, 0, setsize-el->setsize);
+		if ((queued = realloc(state->queued, sizeof(int)*setsize)) == NULL) return -1;
+		state->queued = queued;
+	}
+	return 0;
+}
+
 static int el_api_add_event(st_event_loop *el, int fd, int mask) {
-	int op;
+	int op, old = el->events[fd].mask;
 	struct epoll_event ee;
 	st_el_api_state *state = el->apidata;
 
-	op = (el->events[fd].mask == EL_NONE) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	mask |= old;
+	if (mask == old) return 0;
+	if (state->edge && old != EL_NONE) {
+		/* already registered for both, hand out a missed edge */
+		if ((state->ready[fd] & mask & ~old) && !(state->ready[fd] & EL_EPOLL_QUEUED)) {
+			state->ready[fd] |= EL_EPOLL_QUEUED;
+			state->queued[state->nqueued++] = fd;
+		}
+		return 0;
+	}
+	op = (old == EL_NONE) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
 	ee.events = 0;
-	mask |= el->events[fd].mask;
-	if (mask & EL_READABLE) ee.events |= EPOLLIN;
-	if (mask & EL_WRITABLE) ee.events |= EPOLLOUT;
+	if (state->edge) {
+		ee.events = EPOLLIN|EPOLLOUT|EPOLLET;
+	} else {
+		if (mask & EL_READABLE) ee.events |= EPOLLIN;
+		if (mask & EL_WRITABLE) ee.events |= EPOLLOUT;
+	}
 	ee.data.u64 = 0;
 	ee.data.fd = fd;
 	if (epoll_ctl(state->epfd, op, fd, &ee) == -1) return -1;
@@ -62,42 +122,93 @@ static int el_api_del_event(st_event_loop *el, int fd, int delmask) {
 	int mask = el->events[fd].mask & (~delmask);
 	int ret;
 
+	if (mask == el->events[fd].mask) return 0;
 	ee.events = 0;
 	if (mask & EL_READABLE) ee.events |= EPOLLIN;
 	if (mask & EL_WRITABLE) ee.events |= EPOLLOUT;
 	ee.data.u64 = 0;
 	ee.data.fd = fd;
 	if (mask != EL_NONE) {
+		if (state->edge) return 0;
 		ret = epoll_ctl(state->epfd, EPOLL_CTL_MOD, fd, &ee);	
 	} else {
+		/* the fd may be closed and reused, forget its edges */
+		if (state->edge) state->ready[fd] &= EL_EPOLL_QUEUED;
 		ret = epoll_ctl(state->epfd, EPOLL_CTL_DEL, fd, &ee);
 	}
 
 	return ret;
 }
 
+/* edge mode: hand out the directions of fd that are ready and wanted */
+static int el_api_take_ready(st_event_loop *el, int fd, int numevents) {
+	st_el_api_state *state = el->apidata;
+	int mask = state->ready[fd] & el->events[fd].mask;
+
+	if (mask == EL_NONE) return numevents;
+	state->ready[fd] &= ~mask;
+	el->event_data[numevents].fd = fd;
+	el->event_data[numevents].mask = mask;
+	return numevents+1;
+}
+
 static int el_api_poll(st_event_loop *el, int timeout) {
-	int retval, numevents = 0;
+	int retval = 0, numevents = 0;
 	st_el_api_state *state = el->apidata;
 	
-	retval = epoll_wait(state->epfd, state->events, el->setsize, timeout);
+	if (state->nqueued > 0) timeout = 0;
+	/* queued fds may show up twice, leave room for them in event_data */
+	if (el->setsize-state->nqueued > 0)
+		retval = epoll_wait(state->epfd, state->events, el->setsize-state->nqueued, timeout);
 	if (retval > 0) {
 		int i, mask;
 		struct epoll_event *e;
-		numevents = retval;
-		for (i = 0; i < numevents; i++) {
+		for (i = 0; i < retval; i++) {
 			mask = 0;
 			e = state->events+i;
 			if (e->events & EPOLLIN) mask |= EL_READABLE;
 			if (e->events & EPOLLOUT) mask |= EL_WRITABLE;
 			if (e->events & EPOLLERR) mask |= EL_WRITABLE;
 			if (e->events & EPOLLHUP) mask |= EL_WRITABLE;
-			el->event_data[i].fd = e->data.fd;
-			el->event_data[i].mask = mask;
+			if (state->edge) {
+				state->ready[e->data.fd] |= mask;
+				numevents = el_api_take_ready(el, e->data.fd, numevents);
+				continue;
+			}
+			el->event_data[numevents].fd = e->data.fd;
+			el->event_data[numevents].mask = mask;
+			numevents++;
+		}
+	}
+	if (state->edge) {
+		int i, fd;
+		/* whatever the wait above handed out already is cleared */
+		for (i = 0; i < state->nqueued; i++) {
+			fd = state->queued[i];
+			state->ready[fd] &= ~EL_EPOLL_QUEUED;
+			numevents = el_api_take_ready(el, fd, numevents);
 		}
+		state->nqueued = 0;
 	}
 	return numevents;
 }
 
-
-
+static const st_el_api el_api_epoll = {
+	"epoll",
+	el_api_create,
+	el_api_free,
+	el_api_resize,
+	el_api_add_event,
+	el_api_del_event,
+	el_api_poll
+};
+
+static const st_el_api el_api_epoll_edge = {
+	"epoll-et",
+	el_api_create_edge,
+	el_api_free,
+	el_api_resize,
+	el_api_add_event,
+	el_api_del_event,
+	el_api_poll
+};
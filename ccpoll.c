@@ -0,0 +1,128 @@
+/*
+ * Description: posix poll
+ *
+ * Unlike select there is no FD_SETSIZE limit: the pollfd array holds only
+ * the registered fds, and index[] finds the entry of an fd.
+ */
+
+#include <poll.h>
+#include <string.h>
+
+typedef struct st_el_poll_state {
+	struct pollfd *pfds;
+	int npfds;
+	int *index;		/* fd -> entry in pfds, -1 when not registered */
+} st_el_poll_state;
+
+static int el_poll_create(st_event_loop *el) {
+	st_el_poll_state *state;
+	int i;
+
+	if ((state = malloc(sizeof(st_el_poll_state))) == NULL)
+		return -1;
+	memset(state, 0, sizeof(st_el_poll_state));
+	state->pfds = malloc(sizeof(struct pollfd)*el->setsize);
+	state->index = malloc(sizeof(int)*el->setsize);
+	if (!state->pfds || !state->index) {
+		free(state->pfds);
+		free(state->index);
+		free(state);
+		return -1;
+	}
+	for (i = 0; i < el->setsize; i++)
+		state->index[i] = -1;
+	el->apidata = state;
+	return 0;
+}
+
+static void el_poll_free(st_event_loop *el) {
+	st_el_poll_state *state = el->apidata;
+
+	free(state->pfds);
+	free(state->index);
+	free(state);
+}
+
+static int el_poll_resize(st_event_loop *el, int setsize) {
+	st_el_poll_state *state = el->apidata;
+	struct pollfd *pfds;
+	int *index, i;
+
+	if ((pfds = realloc(state->pfds, sizeof(struct pollfd)*setsize)) == NULL)
+		return -1;
+	state->pfds = pfds;
+	if ((index = realloc(state->index, sizeof(int)*setsize)) == NULL)
+		return -1;
+	state->index = index;
+	for (i = el->setsize; i < setsize; i++)
+		index[i] = -1;
+	return 0;
+}
+
+static int el_poll_add_event(st_event_loop *el, int fd, int mask) {
+	st_el_poll_state *state = el->apidata;
+	struct pollfd *p;
+
+	if (state->index[fd] == -1) {
+		state->index[fd] = state->npfds++;
+		p = &state->pfds[state->index[fd]];
+		p->fd = fd;
+		p->events = 0;
+		p->revents = 0;
+	}
+	p = &state->pfds[state->index[fd]];
+	if (mask & EL_READABLE) p->events |= POLLIN;
+	if (mask & EL_WRITABLE) p->events |= POLLOUT;
+	return 0;
+}
+
+static int el_poll_del_event(st_event_loop *el, int fd, int delmask) {
+	st_el_poll_state *state = el->apidata;
+	int i = state->index[fd];
+	struct pollfd *p;
+
+	if (i == -1) return 0;
+	p = &state->pfds[i];
+	if (delmask & EL_READABLE) p->events &= ~POLLIN;
+	if (delmask & EL_WRITABLE) p->events &= ~POLLOUT;
+	if (p->events == 0) {
+		/* move the last entry into the hole */
+		state->index[fd] = -1;
+		if (i != --state->npfds) {
+			*p = state->pfds[state->npfds];
+			state->index[p->fd] = i;
+		}
+	}
+	return 0;
+}
+
+static int el_poll_wait(st_event_loop *el, int timeout) {
+	st_el_poll_state *state = el->apidata;
+	int retval, i, mask, numevents = 0;
+	struct pollfd *p;
+
+	retval = poll(state->pfds, state->npfds, timeout);
+	for (i = 0; i < state->npfds && numevents < retval; i++) {
+		p = &state->pfds[i];
+		if (p->revents == 0) continue;
+		mask = 0;
+		if (p->revents & POLLIN) mask |= EL_READABLE;
+		if (p->revents & POLLOUT) mask |= EL_WRITABLE;
+		/* let whoever listens run into the error */
+		if (p->revents & (POLLERR|POLLHUP|POLLNVAL)) mask |= EL_READABLE|EL_WRITABLE;
+		el->event_data[numevents].fd = p->fd;
+		el->event_data[numevents].mask = mask;
+		numevents++;
+	}
+	return numevents;
+}
+
+static const st_el_api el_api_sys_poll = {
+	"poll",
+	el_poll_create,
+	el_poll_free,
+	el_poll_resize,
+	el_poll_add_event,
+	el_poll_del_event,
+	el_poll_wait
+};
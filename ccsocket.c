@@ -13,9 +13,10 @@
 #include <fcntl.h>
 #include <time.h>
 #include <sys/stat.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #ifdef SUNOS
  #include <sys/sockio.h>
 #endif
@@ -109,40 +110,30 @@ int csocket_non_block(char *err, int fd) {
 	return csocket_set_block(err, fd, 1);
 }
 
+/* Wait until fd is ready for flags, at most timeout ms when it is > 0.
+ * poll() has no FD_SETSIZE limit on the fd. An error or hangup makes fd
+ * ready for every direction asked for. */
 int csocket_selectid(int fd, int timeout, int flags) {
-	fd_set wset,rset;
-    fd_set *pw, *pr;
-    struct timeval tval, *ptval = NULL;
+	struct pollfd pfd;
 	int res;
 
-    pw = pr = NULL;
-	if (timeout > 0) {
-		tval.tv_sec = timeout/1000;
-		tval.tv_usec = (timeout%1000)*1000;
-		ptval = &tval;
-	}
-    if (flags & FD_WRITE) {
-        FD_ZERO(&wset);
-        FD_SET(fd, &wset);
-        pw = &wset;
-    }
-    if (flags & FD_READ) {
-        FD_ZERO(&rset);
-        FD_SET(fd, &rset);
-        pr = &rset;
-    }
-
-	if ((res = select(fd+1, pr, pw, NULL, ptval)) <= 0 ) {
-        return RET_ERR;
-    }
+	pfd.fd = fd;
+	pfd.events = 0;
+	pfd.revents = 0;
+	if (flags & FD_WRITE) pfd.events |= POLLOUT;
+	if (flags & FD_READ) pfd.events |= POLLIN;
+
+	if ((res = poll(&pfd, 1, timeout > 0 ? timeout : -1)) <= 0) {
+		return RET_ERR;
+	}
 	res = 0;
-    if ((flags & FD_WRITE) && FD_ISSET(fd, &wset)) {
-        res |= FD_WRITE;
-    }
-    if ((flags & FD_READ) && FD_ISSET(fd, &rset)) {
-        res |= FD_READ;
-    }
-    return res;
+	if ((flags & FD_WRITE) && (pfd.revents & (POLLOUT|POLLERR|POLLHUP))) {
+		res |= FD_WRITE;
+	}
+	if ((flags & FD_READ) && (pfd.revents & (POLLIN|POLLERR|POLLHUP))) {
+		res |= FD_READ;
+	}
+	return res;
 }
 
 /* send */
@@ -241,6 +232,51 @@ error:
 	return RET_ERR;
 }
 
+/* Start a connect without waiting for it. The socket is non-blocking; once
+ * it is writable, csocket_get_error() tells whether the connect succeeded. */
+int csocket_tcp_connect_nonblock(char *err, char *ip, int port) {
+	int s = 0;
+	struct sockaddr_in svr_addr;
+
+	if ((s = csocket_create(err, SOCK_STREAM)) == RET_ERR)
+		return RET_ERR;	
+	if (csocket_non_block(err, s) == RET_ERR)
+		goto error;			
+
+	memset(&svr_addr, 0, sizeof(struct sockaddr_in));
+	svr_addr.sin_family = AF_INET;
+	svr_addr.sin_addr.s_addr = inet_addr(ip);
+	svr_addr.sin_port = htons(port);
+
+	if (connect(s, (struct sockaddr *)&svr_addr, sizeof(struct sockaddr_in)) == -1 &&
+			errno != EINPROGRESS) {
+		cperror(err, "socket connect failed, %s:%d, %s", ip, port, __ERRMSG__);	
+		goto error;	
+	}
+	return s;
+
+error:
+	if (s) close(s);
+	return RET_ERR;
+}
+
+/* The pending error of a socket, e.g. of a connect that completed. */
+int csocket_get_error(char *err, int sockid) {
+	int val = 0;
+	socklen_t len = sizeof(val);
+
+	if (getsockopt(sockid, SOL_SOCKET, SO_ERROR, &val, &len) == -1) {
+		cperror(err, "getsockopt SO_ERROR failed, %s", __ERRMSG__);
+		return RET_ERR;
+	}
+	if (val) {
+		errno = val;
+		cperror(err, "socket error, %s", __ERRMSG__);
+		return RET_ERR;
+	}
+	return RET_OK;
+}
+
 static int _csocket_udp_connect(char *err, char *addr, int port, int type) {
 	int s = 0;
 	struct sockaddr_in svr_addr;
@@ -447,6 +483,87 @@ int csocket_tcp6server(char *err, char *bindaddr, int port, int backlog) {
 	return _csocket_server(err, bindaddr, port, AF_INET6, SOCK_STREAM, backlog);
 }
 
+static int csocket_unix_addr(char *err, char *path, struct sockaddr_un *sa) {
+	if (strlen(path) >= sizeof(sa->sun_path)) {
+		cperror(err, "unix socket path too long, %s", path);
+		return RET_ERR;
+	}
+	memset(sa, 0, sizeof(struct sockaddr_un));
+	sa->sun_family = AF_UNIX;
+	strcpy(sa->sun_path, path);
+	return RET_OK;
+}
+
+/* perm: mode of the socket file, 0 to leave it to the umask */
+int csocket_unix_server(char *err, char *path, mode_t perm, int backlog) {
+	int s;
+	struct sockaddr_un sa;
+
+	if (csocket_unix_addr(err, path, &sa) == RET_ERR)
+		return RET_ERR;
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		cperror(err, "socket create failed, %s", __ERRMSG__);
+		return RET_ERR;
+	}
+	if (csocket_listen(err, s, (struct sockaddr *)&sa, sizeof(sa), SOCK_STREAM, backlog) == RET_ERR)
+		goto error;
+	if (perm && chmod(sa.sun_path, perm) == -1) {
+		cperror(err, "chmod failed, %s, %s", path, __ERRMSG__);
+		goto error;
+	}
+	return s;
+
+error:
+	close(s);
+	return RET_ERR;
+}
+
+static int _csocket_unix_connect(char *err, char *path, int non_block, unsigned int timeout) {
+	int s;
+	struct sockaddr_un sa;
+
+	if (csocket_unix_addr(err, path, &sa) == RET_ERR)
+		return RET_ERR;
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		cperror(err, "socket create failed, %s", __ERRMSG__);
+		return RET_ERR;
+	}
+	if ((non_block || timeout) && csocket_non_block(err, s) == RET_ERR)
+		goto error;
+
+	/* a full backlog fails with EAGAIN, there is nothing to wait for */
+	if (connect(s, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		if (errno != EINPROGRESS) {
+			cperror(err, "socket connect failed, %s, %s", path, __ERRMSG__);	
+			goto error;	
+		}
+		if (!non_block) {
+			if (csocket_selectid(s, timeout, FD_WRITE) == RET_ERR) {
+				cperror(err, "socket connect timeout, %s", path);	
+				goto error;
+			}
+			if (csocket_get_error(err, s) == RET_ERR)
+				goto error;
+		}
+	}
+	if (!non_block && timeout && csocket_block(err, s) == RET_ERR)
+		goto error;	
+	return s;
+
+error:
+	close(s);
+	return RET_ERR;
+}
+
+int csocket_unix_connect(char *err, char *path, unsigned int timeout) {
+	return _csocket_unix_connect(err, path, 0, timeout);
+}
+
+/* like csocket_tcp_connect_nonblock() */
+int csocket_unix_connect_nonblock(char *err, char *path) {
+	return _csocket_unix_connect(err, path, 1, 0);
+}
+
 int csocket_tcpaccept(char *err, int sockid, char *ip, size_t iplen, int *port) {
 	int fd;
 	struct sockaddr_storage sa;
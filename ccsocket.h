@@ -8,6 +8,7 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/types.h>
 
 #define FD_WRITE 1
 #define FD_READ 2
@@ -20,6 +21,11 @@ int csocket_tcpserver(char *err, char *bindaddr, int port, int backlog);
 int csocket_tcp6server(char *err, char *bindaddr, int port, int backlog);
 int csocket_tcpaccept(char *err, int sockid, char *ip, size_t iplen, int *prot);
 int csocket_tcp_connect(char *err, char *addr, int port, unsigned int timeout);
+int csocket_tcp_connect_nonblock(char *err, char *addr, int port);
+int csocket_get_error(char *err, int sockid);
+int csocket_unix_server(char *err, char *path, mode_t perm, int backlog);
+int csocket_unix_connect(char *err, char *path, unsigned int timeout);
+int csocket_unix_connect_nonblock(char *err, char *path);
 int csocket_udpserver(char *err, char *bindaddr, int port);
 int csocket_udp6server(char *err, char *bindaddr, int port);
 int csocket_udp_connect(char *err, char *addr, int port);
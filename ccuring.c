@@ -0,0 +1,278 @@
+/*
+ * Description: linux io_uring
+ *
+ * Readiness is watched with one-shot poll requests. A poll is re-armed
+ * before the next wait once its completion was handed out, so events stay
+ * level triggered like with epoll, and arming, cancelling and waiting all
+ * go to the kernel with a single io_uring_enter() per iteration.
+ */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <poll.h>
+#include <errno.h>
+
+#ifndef __NR_io_uring_setup
+ #define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+ #define __NR_io_uring_enter 426
+#endif
+
+#define EL_URING_ENTRIES 256
+/* user_data of requests whose completion is of no interest */
+#define EL_URING_IGNORE (~0ULL)
+
+typedef struct st_el_uring_fd {
+	unsigned int gen;	/* tells completions of cancelled polls apart */
+	int armed;		/* mask of the poll in flight */
+	int dirty;		/* queued to be armed */
+} st_el_uring_fd;
+
+typedef struct st_el_uring_state {
+	int ring_fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	st_el_uring_fd *fds;
+	int *dirty;
+	int ndirty;
+} st_el_uring_state;
+
+static int el_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static void el_uring_release(st_el_uring_state *state) {
+	if (state->sqes) munmap(state->sqes, state->sqes_size);
+	if (state->cq_ring && state->cq_ring != state->sq_ring) munmap(state->cq_ring, state->cq_ring_size);
+	if (state->sq_ring) munmap(state->sq_ring, state->sq_ring_size);
+	if (state->ring_fd != -1) close(state->ring_fd);
+	free(state->fds);
+	free(state->dirty);
+	free(state);
+}
+
+static int el_uring_create(st_event_loop *el) {
+	st_el_uring_state *state;
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	if ((state = calloc(1, sizeof(st_el_uring_state))) == NULL)
+		return -1;
+	state->ring_fd = -1;
+	memset(&p, 0, sizeof(p));
+	state->ring_fd = (int)syscall(__NR_io_uring_setup, EL_URING_ENTRIES, &p);
+	if (state->ring_fd < 0) goto err;
+	/* the wait timeout is passed to io_uring_enter(), and completions
+	 * beyond the cq ring must be kept, not dropped */
+	if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP))
+		goto err;
+
+	state->sq_ring_size = p.sq_off.array+p.sq_entries*sizeof(unsigned);
+	state->cq_ring_size = p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (state->cq_ring_size > state->sq_ring_size)
+			state->sq_ring_size = state->cq_ring_size;
+		state->cq_ring_size = state->sq_ring_size;
+	}
+	state->sq_ring = mmap(NULL, state->sq_ring_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, state->ring_fd, IORING_OFF_SQ_RING);
+	if (state->sq_ring == MAP_FAILED) {
+		state->sq_ring = NULL;
+		goto err;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		state->cq_ring = state->sq_ring;
+	} else {
+		state->cq_ring = mmap(NULL, state->cq_ring_size, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_POPULATE, state->ring_fd, IORING_OFF_CQ_RING);
+		if (state->cq_ring == MAP_FAILED) {
+			state->cq_ring = NULL;
+			goto err;
+		}
+	}
+	state->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+	state->sqes = mmap(NULL, state->sqes_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, state->ring_fd, IORING_OFF_SQES);
+	if (state->sqes == MAP_FAILED) {
+		state->sqes = NULL;
+		goto err;
+	}
+
+	sq = state->sq_ring;
+	cq = state->cq_ring;
+	state->sq_head = (unsigned *)(sq+p.sq_off.head);
+	state->sq_tail = (unsigned *)(sq+p.sq_off.tail);
+	state->sq_mask = (unsigned *)(sq+p.sq_off.ring_mask);
+	state->sq_array = (unsigned *)(sq+p.sq_off.array);
+	state->sq_entries = p.sq_entries;
+	state->cq_head = (unsigned *)(cq+p.cq_off.head);
+	state->cq_tail = (unsigned *)(cq+p.cq_off.tail);
+	state->cq_mask = (unsigned *)(cq+p.cq_off.ring_mask);
+	state->cqes = (struct io_uring_cqe *)(cq+p.cq_off.cqes);
+
+	state->fds = calloc(el->setsize, sizeof(st_el_uring_fd));
+	state->dirty = malloc(sizeof(int)*el->setsize);
+	if (!state->fds || !state->dirty) goto err;
+	el->apidata = state;
+	return 0;
+
+err:
+	el_uring_release(state);
+	return -1;
+}
+
+static void el_uring_free(st_event_loop *el) {
+	el_uring_release(el->apidata);
+}
+
+static int el_uring_resize(st_event_loop *el, int setsize) {
+	st_el_uring_state *state = el->apidata;
+	st_el_uring_fd *fds;
+	int *dirty;
+
+	if ((fds = realloc(state->fds, sizeof(st_el_uring_fd)*setsize)) == NULL)
+		return -1;
+	state->fds = fds;
+	memset(fds+el->setsize, 0, sizeof(st_el_uring_fd)*(setsize-el->setsize));
+	if ((dirty = realloc(state->dirty, sizeof(int)*setsize)) == NULL)
+		return -1;
+	state->dirty = dirty;
+	return 0;
+}
+
+/* Queue a request; the kernel sees it with the next io_uring_enter(). */
+static int el_uring_queue(st_el_uring_state *state, int opcode, int fd, unsigned events,
+		unsigned long long addr, unsigned long long user_data) {
+	unsigned tail = *state->sq_tail, idx;
+	struct io_uring_sqe *sqe;
+
+	if (tail-__atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE) == state->sq_entries) {
+		/* ring full, hand the queued requests over first */
+		if (el_uring_enter(state->ring_fd, state->sq_entries, 0, 0, NULL, 0) < 0)
+			return -1;
+	}
+	idx = tail & *state->sq_mask;
+	sqe = &state->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = addr;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	events = (events << 16) | (events >> 16);
+#endif
+	sqe->poll32_events = events;
+	sqe->user_data = user_data;
+	state->sq_array[idx] = idx;
+	__atomic_store_n(state->sq_tail, tail+1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void el_uring_mark_dirty(st_el_uring_state *state, int fd) {
+	if (state->fds[fd].dirty) return;
+	state->fds[fd].dirty = 1;
+	state->dirty[state->ndirty++] = fd;
+}
+
+/* Bring the poll of fd in line with mask: a poll in flight for another mask
+ * is cancelled, and fd is armed again before the next wait. */
+static void el_uring_update(st_event_loop *el, int fd, int mask) {
+	st_el_uring_state *state = el->apidata;
+	st_el_uring_fd *f = &state->fds[fd];
+
+	if (f->armed != EL_NONE && f->armed != mask) {
+		el_uring_queue(state, IORING_OP_POLL_REMOVE, -1, 0,
+				((unsigned long long)fd << 32) | f->gen, EL_URING_IGNORE);
+		f->gen++;
+		f->armed = EL_NONE;
+	}
+	if (mask != EL_NONE && f->armed == EL_NONE)
+		el_uring_mark_dirty(state, fd);
+}
+
+static int el_uring_add_event(st_event_loop *el, int fd, int mask) {
+	el_uring_update(el, fd, el->events[fd].mask | mask);
+	return 0;
+}
+
+static int el_uring_del_event(st_event_loop *el, int fd, int delmask) {
+	el_uring_update(el, fd, el->events[fd].mask & (~delmask));
+	return 0;
+}
+
+static int el_uring_poll(st_event_loop *el, int timeout) {
+	st_el_uring_state *state = el->apidata;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail, min_complete = 1, events;
+	int i, fd, mask, numevents = 0;
+
+	for (i = 0; i < state->ndirty; i++) {
+		fd = state->dirty[i];
+		state->fds[fd].dirty = 0;
+		mask = el->events[fd].mask;
+		if (mask == EL_NONE || state->fds[fd].armed != EL_NONE) continue;
+		events = 0;
+		if (mask & EL_READABLE) events |= POLLIN;
+		if (mask & EL_WRITABLE) events |= POLLOUT;
+		if (el_uring_queue(state, IORING_OP_POLL_ADD, fd, events, 0,
+					((unsigned long long)fd << 32) | state->fds[fd].gen) == 0)
+			state->fds[fd].armed = mask;
+	}
+	state->ndirty = 0;
+
+	memset(&arg, 0, sizeof(arg));
+	if (timeout >= 0) {
+		ts.tv_sec = timeout/1000;
+		ts.tv_nsec = (long long)(timeout%1000)*1000000;
+		arg.ts = (unsigned long long)(uintptr_t)&ts;
+		if (timeout == 0) min_complete = 0;
+	}
+	/* submit and wait; ETIME and EINTR just mean nothing happened */
+	el_uring_enter(state->ring_fd, *state->sq_tail-__atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE),
+			min_complete, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+	head = *state->cq_head;
+	tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &state->cqes[head & *state->cq_mask];
+		if (cqe->user_data == EL_URING_IGNORE) continue;
+		fd = (int)(cqe->user_data >> 32);
+		if (fd >= el->setsize || state->fds[fd].gen != (unsigned)cqe->user_data)
+			continue;
+		state->fds[fd].armed = EL_NONE;
+		el_uring_mark_dirty(state, fd);
+		mask = 0;
+		if (cqe->res < 0) {
+			/* let the procs run into the error themselves */
+			mask = el->events[fd].mask;
+		} else {
+			if (cqe->res & POLLIN) mask |= EL_READABLE;
+			if (cqe->res & (POLLOUT|POLLERR|POLLHUP)) mask |= EL_WRITABLE;
+		}
+		if (mask == 0) continue;
+		el->event_data[numevents].fd = fd;
+		el->event_data[numevents].mask = mask;
+		numevents++;
+	}
+	__atomic_store_n(state->cq_head, head, __ATOMIC_RELEASE);
+	return numevents;
+}
+
+static const st_el_api el_api_uring = {
+	"io_uring",
+	el_uring_create,
+	el_uring_free,
+	el_uring_resize,
+	el_uring_add_event,
+	el_uring_del_event,
+	el_uring_poll
+};
@@ -0,0 +1,1807 @@
+/*
+ * Non-interactive checks of libredis, no redis server is needed:
+ *
+ *   make && make -f Makefile.test && ./check
+ */
+#ifdef LINUX
+ #include "ccfmacros.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "ccds.h"
+#include "ccel.h"
+#include "ccsocket.h"
+#include "libredis.h"
+
+static int nchecks, nfailed;
+
+#define CHECK(cond) do { \
+    nchecks++; \
+    if (!(cond)) { \
+        nfailed++; \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while (0)
+
+/* A reply tree as text, so trees from different readers compare. */
+static cds check_dump(cds s, redis_reply *reply) {
+    char hdr[32];
+    size_t i;
+
+    switch (reply->type) {
+        case REDIS_REPLY_STRING:
+            snprintf(hdr, sizeof(hdr), "$%d:", reply->len);
+            s = cdscat(s, hdr);
+            return cdscatlen(s, reply->str, reply->len);
+        case REDIS_REPLY_STATUS:
+            s = cdscat(s, "+");
+            return cdscatlen(s, reply->str, reply->len);
+        case REDIS_REPLY_ERROR:
+            s = cdscat(s, "-");
+            return cdscatlen(s, reply->str, reply->len);
+        case REDIS_REPLY_INTEGER:
+            snprintf(hdr, sizeof(hdr), ":%lld", reply->integer);
+            return cdscat(s, hdr);
+        case REDIS_REPLY_NIL:
+            return cdscat(s, "_");
+        case REDIS_REPLY_ARRAY:
+            snprintf(hdr, sizeof(hdr), "*%d[", (int)reply->elements);
+            s = cdscat(s, hdr);
+            for (i = 0; i < reply->elements; i++)
+                s = check_dump(s, &reply->element[i]);
+            return cdscat(s, "]");
+    }
+    return cdscat(s, "?");
+}
+
+/* Feed stream step bytes at a time, draining after each feed, and dump
+ * every reply that comes out. */
+static cds check_parse(const char *stream, size_t len, size_t step, int zerocopy, int *nreply) {
+    redis_reader *r = redis_create_reader();
+    redis_reply *reply;
+    cds s = cdsnew(NULL);
+    size_t i, n;
+
+    redis_reader_set_zerocopy(r, zerocopy);
+    *nreply = 0;
+    for (i = 0; i < len; i += n) {
+        n = len-i < step ? len-i : step;
+        redis_reader_feed(r, stream+i, n);
+        while ((reply = redis_get_reply(r)) != NULL) {
+            s = check_dump(s, reply);
+            s = cdscat(s, "\n");
+            (*nreply)++;
+        }
+        if (r->err != 0 && r->err != REDIS_ERR_EOF) {
+            s = cdscat(s, r->errstr);
+            s = cdscat(s, "\n");
+        }
+    }
+    redis_free_reader(r);
+    return s;
+}
+
+/* replies cut anywhere resume where they stopped */
+static void check_parser_resume(void) {
+    static const char stream[] =
+        "*3\r\n$3\r\nfoo\r\n*2\r\n:42\r\n$-1\r\n+OK\r\n"
+        "-ERR wrong type\r\n"
+        "$0\r\n\r\n"
+        "*0\r\n"
+        "*-1\r\n"
+        ":-7\r\n"
+        "*2\r\n*1\r\n*1\r\n$5\r\nde\r\np\r\n$13\r\nbinary\0\r\ndata\r\n"
+        "+PONG\r\n";
+    static const char want[] =
+        "*3[$3:foo*2[:42_]+OK]\n"
+        "-ERR wrong type\n"
+        "$0:\n"
+        "*0[]\n"
+        "_\n"
+        ":-7\n"
+        "*2[*1[*1[$5:de\r\np]]$13:binary\0\r\ndata]\n"
+        "+PONG\n";
+    static const size_t steps[] = {1, 2, 3, 7, sizeof(stream)};
+    cds s;
+    int i, zerocopy, nreply;
+
+    for (zerocopy = 0; zerocopy <= 1; zerocopy++) {
+        for (i = 0; i < (int)(sizeof(steps)/sizeof(steps[0])); i++) {
+            s = check_parse(stream, sizeof(stream)-1, steps[i], zerocopy, &nreply);
+            CHECK(nreply == 8);
+            CHECK(cdslen(s) == sizeof(want)-1 && memcmp(s, want, cdslen(s)) == 0);
+            cdsfree(s);
+        }
+    }
+}
+
+/* Parse stream in one go and tell whether the reader calls it a protocol
+ * error. */
+static int check_protocol_error(const char *stream) {
+    redis_reader *r = redis_create_reader();
+    redis_reply *reply;
+    int err;
+
+    redis_reader_feed(r, stream, strlen(stream));
+    reply = redis_get_reply(r);
+    err = reply == NULL && r->err == REDIS_ERR_PROTOCOL;
+    redis_free_reader(r);
+    return err;
+}
+
+/* lengths, counts and integers are digits only and fit a long long */
+static void check_bad_numbers(void) {
+    CHECK(check_protocol_error("$9223372036854775808\r\n"));
+    CHECK(check_protocol_error("$-2x\r\n"));
+    CHECK(check_protocol_error("*+\r\n"));
+    CHECK(check_protocol_error("*\r\n"));
+    CHECK(check_protocol_error(":12345678901234567890\r\n"));
+    CHECK(check_protocol_error(":1234 5678\r\n"));
+    CHECK(!check_protocol_error(":9223372036854775807\r\n"));
+    CHECK(!check_protocol_error(":-9223372036854775808\r\n"));
+    CHECK(!check_protocol_error("$-1\r\n"));
+}
+
+/* a CRLF anywhere around the 16 and 32 byte blocks of the vector kernels is
+ * found, a lone \r is not taken for one, and every kernel decodes integers
+ * of any length alike */
+static void check_simd(void) {
+    static const int levels[] = {REDIS_SIMD_NONE, REDIS_SIMD_SSE2, REDIS_SIMD_AVX2};
+    redis_reader *r;
+    redis_reply *reply;
+    char line[128], want[32];
+    long long v;
+    int i, k, n, bad;
+
+    for (i = 0; i < 3; i++) {
+        redis_set_simd(levels[i]);
+        r = redis_create_reader();
+        bad = 0;
+        for (k = 0; k < 100; k++) {
+            line[0] = '+';
+            memset(line+1, 'x', k);
+            if (k > 2)
+                line[1+k/2] = '\r';
+            memcpy(line+1+k, "\r\n", 2);
+            redis_reader_feed(r, line, k+3);
+            reply = redis_get_reply(r);
+            if (reply == NULL || reply->type != REDIS_REPLY_STATUS || reply->len != k ||
+                    memcmp(reply->str, line+1, k) != 0)
+                bad++;
+        }
+        CHECK(bad == 0);
+        bad = 0;
+        for (k = 1, v = 0; k <= 19; k++) {
+            v = v*10+(k == 1 ? 7 : k%10);
+            n = snprintf(line, sizeof(line), ":%lld\r\n:-%lld\r\n", v, v);
+            redis_reader_feed(r, line, n);
+            snprintf(want, sizeof(want), "%lld", v);
+            reply = redis_get_reply(r);
+            if (reply == NULL || reply->type != REDIS_REPLY_INTEGER || reply->integer != v)
+                bad++;
+            reply = redis_get_reply(r);
+            if (reply == NULL || reply->type != REDIS_REPLY_INTEGER || reply->integer != -v)
+                bad++;
+            if ((int)strlen(want) != k)
+                bad++;
+        }
+        CHECK(bad == 0);
+        redis_free_reader(r);
+    }
+    redis_set_simd(REDIS_SIMD_AVX2);
+}
+
+/* a reader that never runs dry does not keep what it already parsed */
+static void check_reader_reclaim(void) {
+    static const char msg[] = "*3\r\n$7\r\nmessage\r\n$2\r\nc1\r\n$5\r\nhello\r\n";
+    redis_reader *r;
+    redis_reply *reply;
+    size_t i, n, maxlen;
+    int zerocopy, nreply;
+
+    for (zerocopy = 0; zerocopy <= 1; zerocopy++) {
+        r = redis_create_reader();
+        redis_reader_set_zerocopy(r, zerocopy);
+        maxlen = nreply = 0;
+        /* 7 bytes at a time so replies always straddle a feed */
+        for (i = 0; i < 10000; i++) {
+            for (n = 0; n < sizeof(msg)-1; n += 7) {
+                redis_reader_feed(r, msg+n, sizeof(msg)-1-n < 7 ? sizeof(msg)-1-n : 7);
+                while ((reply = redis_get_reply(r)) != NULL)
+                    nreply++;
+                if (r->len > maxlen)
+                    maxlen = r->len;
+            }
+        }
+        CHECK(nreply == 10000);
+        CHECK(maxlen < 4*sizeof(msg));
+        redis_free_reader(r);
+    }
+}
+
+/* A blocking context and the server end of its connection, for checks
+ * that drive both sides by hand. */
+static redis_context *check_pair(int *sfd) {
+    redis_context *c;
+    char err[128];
+    int lfd, port;
+
+    if ((lfd = csocket_tcpserver(err, "127.0.0.1", 0, 1)) == -1) {
+        fprintf(stderr, "pair: %s\n", err);
+        return NULL;
+    }
+    csocket_get_sockname(err, lfd, NULL, 0, &port);
+    *sfd = -1;
+    c = redis_connect("127.0.0.1", port);
+    if (c != NULL && !c->err)
+        *sfd = csocket_tcpaccept(err, lfd, NULL, 0, NULL);
+    close(lfd);
+    if (c == NULL || c->err || *sfd == -1) {
+        if (c) redis_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* Read exactly len bytes or fail. */
+static int check_read_all(int fd, char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = read(fd, buf, len)) <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* a large reply is read in place in one go, the read size following it */
+#define BIG_REPLY (100*1000)
+
+static void check_read_big(void) {
+    redis_context *c;
+    redis_reader *r;
+    redis_reply *reply;
+    static const char cmd[] = "*2\r\n$3\r\nGET\r\n$3\r\nbig\r\n";
+    char *payload, hdr[32];
+    int sfd, n;
+
+    if ((c = check_pair(&sfd)) == NULL) {
+        CHECK(0);
+        return;
+    }
+    r = redis_create_reader();
+    payload = malloc(BIG_REPLY);
+    for (n = 0; n < BIG_REPLY; n++)
+        payload[n] = 'a'+n%26;
+    redis_append_command(c, "GET big");
+    CHECK(redis_exec_command(c, r) == 0);
+    CHECK(check_read_all(sfd, hdr, sizeof(cmd)-1) == 0 && memcmp(hdr, cmd, sizeof(cmd)-1) == 0);
+
+    /* the whole reply is there before the client reads */
+    n = snprintf(hdr, sizeof(hdr), "$%d\r\n", BIG_REPLY);
+    CHECK(write(sfd, hdr, n) == n);
+    CHECK(write(sfd, payload, BIG_REPLY) == BIG_REPLY);
+    CHECK(write(sfd, "\r\n", 2) == 2);
+    reply = redis_get_reply(r);
+    CHECK(reply != NULL && reply->type == REDIS_REPLY_STRING);
+    CHECK(reply != NULL && reply->len == BIG_REPLY && memcmp(reply->str, payload, BIG_REPLY) == 0);
+    CHECK(r->readcount == 1);
+    CHECK(r->readsize > REDIS_READER_READ_SIZE);
+
+    free(payload);
+    redis_free_reader(r);
+    redis_free(c);
+    close(sfd);
+}
+
+/* large arguments go out with writev from the caller's memory, in order */
+#define BIG_ARG (50*1000)
+
+static void check_write_big(void) {
+    redis_context *c;
+    redis_reader *r;
+    const char *argv[5];
+    size_t argvlen[5];
+    char *big1, *big2, *got;
+    cds want;
+    size_t len;
+    int sfd, i;
+
+    if ((c = check_pair(&sfd)) == NULL) {
+        CHECK(0);
+        return;
+    }
+    r = redis_create_reader();
+    big1 = malloc(BIG_ARG);
+    big2 = malloc(BIG_ARG);
+    for (i = 0; i < BIG_ARG; i++) {
+        big1[i] = 'a'+i%26;
+        big2[i] = 'A'+i%26;
+    }
+    argv[0] = "MSET", argvlen[0] = 4;
+    argv[1] = "k1", argvlen[1] = 2;
+    argv[2] = big1, argvlen[2] = BIG_ARG;
+    argv[3] = "k2", argvlen[3] = 2;
+    argv[4] = big2, argvlen[4] = BIG_ARG;
+    CHECK(redis_append_command_argv(c, 5, argv, argvlen) == 0);
+    CHECK(c->nref == 2);
+    CHECK(cdslen(c->obuf) < 100);
+    CHECK(redis_append_command(c, "GET k1") == 0);
+
+    want = cdsnew("*5\r\n$4\r\nMSET\r\n$2\r\nk1\r\n$50000\r\n");
+    want = cdscatlen(want, big1, BIG_ARG);
+    want = cdscat(want, "\r\n$2\r\nk2\r\n$50000\r\n");
+    want = cdscatlen(want, big2, BIG_ARG);
+    want = cdscat(want, "\r\n*2\r\n$3\r\nGET\r\n$2\r\nk1\r\n");
+    len = cdslen(want);
+    CHECK(redis_exec_command(c, r) == 0);
+    got = malloc(len);
+    CHECK(check_read_all(sfd, got, len) == 0 && memcmp(got, want, len) == 0);
+
+    free(got);
+    cdsfree(want);
+    free(big1);
+    free(big2);
+    redis_free_reader(r);
+    redis_free(c);
+    close(sfd);
+}
+
+/* A context that is never connected, only its obuf is looked at. */
+static void check_context_init(redis_context *c) {
+    memset(c, 0, sizeof(*c));
+    c->pipe = -1;
+    c->obuf = cdsnew(NULL);
+}
+
+static void check_context_free(redis_context *c) {
+    cdsfree(c->obuf);
+    free(c->refs);
+}
+
+/* The command in f, the only one there, has to be encoded byte for byte
+ * like the argc arguments given to the argv encoder. */
+static int check_same_argv(redis_context *f, int argc, const char **argv, const size_t *argvlen) {
+    redis_context a;
+    int same;
+
+    check_context_init(&a);
+    same = redis_append_command_argv(&a, argc, argv, argvlen) == 0 &&
+        cdslen(a.obuf) == cdslen(f->obuf) && memcmp(a.obuf, f->obuf, cdslen(a.obuf)) == 0;
+    check_context_free(&a);
+    cdsclear(f->obuf);
+    return same;
+}
+
+/* the single-pass format encoder against the argv one */
+static void check_format(void) {
+    static const char bin[] = "a\0b\r\nc";
+    redis_context c;
+    const char *argv[4];
+    size_t argvlen[4];
+
+    check_context_init(&c);
+    argv[0] = "SET", argv[1] = "key", argv[2] = "value";
+    CHECK(redis_append_command(&c, "SET key value") == 0);
+    CHECK(check_same_argv(&c, 3, argv, NULL));
+    CHECK(redis_append_command(&c, "SET %s %s", "key", "value") == 0);
+    CHECK(check_same_argv(&c, 3, argv, NULL));
+    CHECK(redis_append_command(&c, "  SET   key %s  ", "value") == 0);
+    CHECK(check_same_argv(&c, 3, argv, NULL));
+
+    argv[1] = "k", argvlen[0] = 3, argvlen[1] = 1;
+    argv[2] = bin, argvlen[2] = sizeof(bin)-1;
+    CHECK(redis_append_command(&c, "SET %b %b", "k", (size_t)1, bin, sizeof(bin)-1) == 0);
+    CHECK(check_same_argv(&c, 3, argv, argvlen));
+    argv[2] = "", argvlen[2] = 0;
+    CHECK(redis_append_command(&c, "SET k %s", "") == 0);
+    CHECK(check_same_argv(&c, 3, argv, argvlen));
+    CHECK(redis_append_command(&c, "SET k %b", "", (size_t)0) == 0);
+    CHECK(check_same_argv(&c, 3, argv, argvlen));
+
+    argv[0] = "INCRBY", argv[1] = "counter", argv[2] = "-42";
+    CHECK(redis_append_command(&c, "INCRBY counter %d", -42) == 0);
+    CHECK(check_same_argv(&c, 3, argv, NULL));
+    argv[2] = "4294967295";
+    CHECK(redis_append_command(&c, "INCRBY counter %u", 4294967295u) == 0);
+    CHECK(check_same_argv(&c, 3, argv, NULL));
+    argv[2] = "-9223372036854775808";
+    CHECK(redis_append_command(&c, "INCRBY counter %lld", (-9223372036854775807LL)-1) == 0);
+    CHECK(check_same_argv(&c, 3, argv, NULL));
+    argv[2] = "-3";
+    CHECK(redis_append_command(&c, "INCRBY counter %hd", -3) == 0);
+    CHECK(check_same_argv(&c, 3, argv, NULL));
+    argv[2] = "0012";
+    CHECK(redis_append_command(&c, "INCRBY counter %04d", 12) == 0);
+    CHECK(check_same_argv(&c, 3, argv, NULL));
+
+    argv[0] = "SET", argv[1] = "user:u1:7", argv[2] = "100%";
+    CHECK(redis_append_command(&c, "SET user:%s:%u 100%%", "u1", 7u) == 0);
+    CHECK(check_same_argv(&c, 3, argv, NULL));
+    argv[2] = "3.14";
+    CHECK(redis_append_command(&c, "SET user:u1:%d %.2f", 7, 3.14159) == 0);
+    CHECK(check_same_argv(&c, 3, argv, NULL));
+    argv[2] = "hello world";
+    CHECK(redis_append_command(&c, "SET user:u1:7 'hello world'") == 0);
+    CHECK(check_same_argv(&c, 3, argv, NULL));
+
+    argv[0] = "PING";
+    CHECK(redis_append_command(&c, "PING") == 0);
+    CHECK(check_same_argv(&c, 1, argv, NULL));
+    CHECK(redis_append_command(&c, "") != 0);
+    CHECK(redis_append_command(&c, "SET k %q", 1) != 0);
+    CHECK(cdslen(c.obuf) == 0);
+    check_context_free(&c);
+}
+
+/* Both contexts hold the same bytes; they are emptied for the next case. */
+static int check_same_obuf(redis_context *a, redis_context *b) {
+    int same = cdslen(a->obuf) == cdslen(b->obuf) && memcmp(a->obuf, b->obuf, cdslen(a->obuf)) == 0;
+
+    cdsclear(a->obuf);
+    cdsclear(b->obuf);
+    return same;
+}
+
+/* a compiled template encodes like the format it was compiled from */
+static void check_template(void) {
+    static const char bin[] = "a\0b\r\nc";
+    redis_template *tpl;
+    redis_context f, t;
+    int i;
+
+    check_context_init(&f);
+    check_context_init(&t);
+
+    tpl = redis_compile_command("SET key value");
+    CHECK(tpl != NULL && redis_append_template(&t, tpl) == 0);
+    redis_append_command(&f, "SET key value");
+    CHECK(check_same_obuf(&f, &t));
+    redis_free_template(tpl);
+
+    tpl = redis_compile_command("HSET user:%s:%u name %b");
+    CHECK(tpl != NULL);
+    for (i = 0; tpl && i < 3; i++) {
+        CHECK(redis_append_template(&t, tpl, "u1", (unsigned)i, bin, sizeof(bin)-1) == 0);
+        redis_append_command(&f, "HSET user:%s:%u name %b", "u1", (unsigned)i, bin, sizeof(bin)-1);
+    }
+    CHECK(check_same_obuf(&f, &t));
+    redis_free_template(tpl);
+
+    tpl = redis_compile_command("ZADD z %lld %.2f 'a b' 100%% %hd %04d %s");
+    CHECK(tpl != NULL && redis_append_template(&t, tpl, -9000000000LL, 2.5, -3, 12, "") == 0);
+    redis_append_command(&f, "ZADD z %lld %.2f 'a b' 100%% %hd %04d %s", -9000000000LL, 2.5, -3, 12, "");
+    CHECK(check_same_obuf(&f, &t));
+    redis_free_template(tpl);
+
+    CHECK(redis_compile_command("") == NULL);
+    CHECK(redis_compile_command("SET k %q") == NULL);
+    check_context_free(&f);
+    check_context_free(&t);
+}
+
+/* A redis faked inside the loop under test, on a loopback port. Replies
+ * queue in out and are written drip bytes per tick, so they reach the
+ * client cut anywhere. While paused it leaves what is sent to it in the
+ * socket. CLIENT ID answers the index of the connection, QUIT closes it
+ * once the +OK is out. An answer hook may take a command first. */
+#define CHECK_MAX_CONN 16
+
+typedef struct check_conn {
+    struct check_server *s;
+    int fd;
+    redis_reader *r;
+    cds out;
+    int quit;
+    int state;              /* for the answer hook */
+} check_conn;
+
+/* 1 when the hook took q, queueing its answer, if any, in cn->out */
+typedef int check_answer(check_conn *cn, redis_reply *q);
+
+typedef struct check_server {
+    st_event_loop *el;
+    int lfd;
+    int port;
+    check_conn conn[CHECK_MAX_CONN];
+    int nconn;
+    int paused;
+    int quiet;              /* takes commands without answering */
+    cds in;                 /* every byte received */
+    size_t drip;            /* bytes written per tick, 0 for all at once */
+    int tick;
+    int ncmd;
+    int nread;              /* reads that brought commands */
+    check_answer *answer;
+} check_server;
+
+static void check_server_read(struct st_event_loop *el, int fd, void *clientdata, int mask) {
+    check_conn *cn = (check_conn *)clientdata;
+    check_server *s = cn->s;
+    redis_reply *q, *a;
+    char buf[4096], hdr[32];
+    ssize_t n;
+    int i;
+
+    (void)mask;
+    if ((n = read(fd, buf, sizeof(buf))) <= 0) {
+        cel_del_file_event(el, fd, EL_READABLE);
+        return;
+    }
+    s->nread++;
+    s->in = cdscatlen(s->in, buf, n);
+    if (s->quiet)
+        return;
+    redis_reader_feed(cn->r, buf, n);
+    while (cn->r->pos < cn->r->len && (q = redis_get_reply(cn->r)) != NULL) {
+        s->ncmd++;
+        if (s->answer && s->answer(cn, q)) {
+            continue;
+        } else if (strcasecmp(q->element[0].str, "subscribe") == 0) {
+            for (i = 1; i < (int)q->elements; i++) {
+                a = &q->element[i];
+                n = snprintf(hdr, sizeof(hdr), "*3\r\n$9\r\nsubscribe\r\n$%d\r\n", a->len);
+                cn->out = cdscatlen(cn->out, hdr, n);
+                cn->out = cdscatlen(cn->out, a->str, a->len);
+                n = snprintf(hdr, sizeof(hdr), "\r\n:%d\r\n", i);
+                cn->out = cdscatlen(cn->out, hdr, n);
+            }
+        } else if (strcasecmp(q->element[0].str, "echo") == 0) {
+            a = &q->element[1];
+            n = snprintf(hdr, sizeof(hdr), "$%d\r\n", a->len);
+            cn->out = cdscatlen(cn->out, hdr, n);
+            cn->out = cdscatlen(cn->out, a->str, a->len);
+            cn->out = cdscatlen(cn->out, "\r\n", 2);
+        } else if (strcasecmp(q->element[0].str, "client") == 0 && q->elements == 2 &&
+                strcasecmp(q->element[1].str, "id") == 0) {
+            n = snprintf(hdr, sizeof(hdr), ":%d\r\n", (int)(cn-s->conn));
+            cn->out = cdscatlen(cn->out, hdr, n);
+        } else if (strcasecmp(q->element[0].str, "quit") == 0) {
+            cn->out = cdscat(cn->out, "+OK\r\n");
+            cn->quit = 1;
+        } else {
+            cn->out = cdscat(cn->out, "-ERR unknown command\r\n");
+        }
+    }
+}
+
+static void check_server_accept(struct st_event_loop *el, int fd, void *clientdata, int mask) {
+    check_server *s = (check_server *)clientdata;
+    check_conn *cn;
+    char err[128];
+    int cfd;
+
+    (void)mask;
+    if ((cfd = csocket_tcpaccept(err, fd, NULL, 0, NULL)) == -1)
+        return;
+    if (s->nconn == CHECK_MAX_CONN) {
+        close(cfd);
+        return;
+    }
+    cn = &s->conn[s->nconn++];
+    cn->s = s;
+    cn->fd = cfd;
+    cn->r = redis_create_reader();
+    cn->out = cdsnew(NULL);
+    cn->quit = 0;
+    cn->state = 0;
+    if (!s->paused)
+        cel_add_file_event(el, cn->fd, EL_READABLE, check_server_read, cn);
+}
+
+static void check_server_resume(check_server *s) {
+    int i;
+
+    s->paused = 0;
+    for (i = 0; i < s->nconn; i++)
+        cel_add_file_event(s->el, s->conn[i].fd, EL_READABLE, check_server_read, &s->conn[i]);
+}
+
+static int check_server_tick(struct st_event_loop *el, int id, void *clientdata) {
+    check_server *s = (check_server *)clientdata;
+    check_conn *cn;
+    size_t len;
+    ssize_t n;
+    int i;
+
+    (void)id;
+    for (i = 0; i < s->nconn; i++) {
+        cn = &s->conn[i];
+        if (cn->fd == -1 || (len = cdslen(cn->out)) == 0)
+            continue;
+        if (s->drip && len > s->drip)
+            len = s->drip;
+        if ((n = write(cn->fd, cn->out, len)) > 0)
+            cdsrange(cn->out, n, -1);
+        if (cn->quit && cdslen(cn->out) == 0) {
+            cel_del_file_event(el, cn->fd, EL_READABLE|EL_WRITABLE);
+            close(cn->fd);
+            cn->fd = -1;
+        }
+    }
+    return 1;
+}
+
+/* Listen on a free port; connect to s->port, then check_server_attach(). */
+static int check_server_start(check_server *s, size_t drip) {
+    char err[128];
+
+    memset(s, 0, sizeof(*s));
+    s->drip = drip;
+    if ((s->lfd = csocket_tcpserver(err, "127.0.0.1", 0, 16)) == -1) {
+        fprintf(stderr, "server: %s\n", err);
+        return -1;
+    }
+    csocket_get_sockname(err, s->lfd, NULL, 0, &s->port);
+    s->in = cdsnew(NULL);
+    return 0;
+}
+
+static void check_server_attach(check_server *s, st_event_loop *el) {
+    s->el = el;
+    cel_add_file_event(el, s->lfd, EL_READABLE, check_server_accept, s);
+    s->tick = cel_add_timer_event(el, 1, check_server_tick, s);
+}
+
+static void check_server_stop(check_server *s) {
+    int i;
+
+    if (s->el) {
+        cel_del_timer_event(s->el, s->tick);
+        cel_del_file_event(s->el, s->lfd, EL_READABLE);
+    }
+    for (i = 0; i < s->nconn; i++) {
+        if (s->conn[i].fd != -1) {
+            if (s->el) cel_del_file_event(s->el, s->conn[i].fd, EL_READABLE|EL_WRITABLE);
+            close(s->conn[i].fd);
+        }
+        redis_free_reader(s->conn[i].r);
+        cdsfree(s->conn[i].out);
+    }
+    close(s->lfd);
+    cdsfree(s->in);
+}
+
+/* the server of the check running, for callbacks that stop its loop */
+static check_server *current;
+
+static int check_deadline(struct st_event_loop *el, int id, void *clientdata) {
+    (void)id;
+    *(int *)clientdata = 1;
+    cel_stop(el);
+    return EL_NOMORE;
+}
+
+/* commands beyond the high-water mark are refused; what a small socket
+ * buffer does not take is written from wpos as it drains */
+#define WRITE_HWM (64*1024)
+static redis_async_context *write_ac;
+static redis_context write_want;
+static size_t write_total;
+static int write_full, write_partial, write_armed, write_done, write_disarmed, write_again;
+
+static int write_fill(struct st_event_loop *el, int id, void *clientdata) {
+    redis_context *c = write_ac->c;
+    char value[1000];
+    int i;
+
+    (void)el;
+    (void)id;
+    (void)clientdata;
+    memset(value, 'v', sizeof(value)-1);
+    value[sizeof(value)-1] = '\0';
+    for (i = 0; redis_append_command(c, "SET key:%d %s", i, value) == 0; i++)
+        redis_append_command(&write_want, "SET key:%d %s", i, value);
+    write_full = c->err == REDIS_ERR_FULL && i > 0;
+    write_total = redis_write_pending(c);
+    redis_async_exec_command(write_ac);
+    return EL_NOMORE;
+}
+
+static int write_watch(struct st_event_loop *el, int id, void *clientdata) {
+    redis_context *c = write_ac->c;
+
+    (void)id;
+    (void)clientdata;
+    if (current->paused) {
+        /* as soon as the first write went out, let the server read */
+        if (write_total > 0 && redis_write_pending(c) < write_total) {
+            write_partial = c->wpos > 0 && redis_write_pending(c) > 0;
+            write_armed = (cel_get_file_event(el, c->fd) & EL_WRITABLE) != 0;
+            check_server_resume(current);
+        }
+        return 1;
+    }
+    if (cdslen(current->in) == cdslen(write_want.obuf)) {
+        write_done = redis_write_pending(c) == 0;
+        write_disarmed = (cel_get_file_event(el, c->fd) & EL_WRITABLE) == 0;
+        write_again = redis_append_command(c, "PING") == 0;
+        cel_stop(el);
+        return EL_NOMORE;
+    }
+    return 1;
+}
+
+static void check_write_resume(void) {
+    check_server s;
+    char err[REDIS_ERRBUF_SIZE];
+    int timeout = 0;
+
+    if (check_server_start(&s, 0) == -1) {
+        CHECK(0);
+        return;
+    }
+    current = &s;
+    s.paused = 1;
+    s.quiet = 1;
+    csocket_set_recvbuffer(err, s.lfd, 4096);
+    write_ac = redis_async_connect(err, "127.0.0.1", s.port, NULL);
+    CHECK(write_ac != NULL);
+    if (write_ac == NULL) goto end;
+    csocket_set_sendbuffer(err, write_ac->c->fd, 4096);
+    redis_set_write_hwm(write_ac->c, WRITE_HWM);
+    check_context_init(&write_want);
+    check_server_attach(&s, write_ac->el);
+    cel_add_timer_event(write_ac->el, 1, write_fill, NULL);
+    cel_add_timer_event(write_ac->el, 1, write_watch, NULL);
+    cel_add_timer_event(write_ac->el, 5000, check_deadline, &timeout);
+    redis_async_run(write_ac);
+    CHECK(!timeout);
+    CHECK(write_full);
+    CHECK(write_partial);
+    CHECK(write_armed);
+    CHECK(write_done);
+    CHECK(write_disarmed);
+    CHECK(write_again);
+    CHECK(cdslen(s.in) == cdslen(write_want.obuf) && memcmp(s.in, write_want.obuf, cdslen(s.in)) == 0);
+    check_context_free(&write_want);
+    check_server_stop(&s);
+    redis_async_free(write_ac);
+    return;
+
+end:
+    check_server_stop(&s);
+}
+
+/* pushed messages through fn_read, each arriving with its own event */
+static int pubsub_messages, pubsub_reconnects;
+
+static void pubsub_read(redis_async_context *ac) {
+    redis_reply *reply;
+
+    /* drained the usual way, the last call finds no data */
+    while ((reply = redis_async_get_reply(ac)) != NULL) {
+        if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3 &&
+                strcmp(reply->element[0].str, "message") == 0)
+            pubsub_messages++;
+    }
+    if (pubsub_messages == 5)
+        cel_stop(current->el);
+}
+
+static void pubsub_reconnect(redis_async_context *ac) {
+    (void)ac;
+    pubsub_reconnects++;
+}
+
+static int pubsub_publish(struct st_event_loop *el, int id, void *clientdata) {
+    static const char msg[] = "*3\r\n$7\r\nmessage\r\n$2\r\nc1\r\n$5\r\nhello\r\n";
+    check_server *s = (check_server *)clientdata;
+    static int sent;
+
+    (void)el;
+    (void)id;
+    if (s->nconn == 0 || s->ncmd == 0)
+        return 5;
+    s->conn[0].out = cdscatlen(s->conn[0].out, msg, sizeof(msg)-1);
+    return ++sent == 5 ? EL_NOMORE : 5;
+}
+
+static void check_pubsub(void) {
+    redis_async_context *ac;
+    check_server s;
+    char err[REDIS_ERRBUF_SIZE];
+    int timeout = 0;
+
+    if (check_server_start(&s, 0) == -1) {
+        CHECK(0);
+        return;
+    }
+    current = &s;
+    ac = redis_async_connect(err, "127.0.0.1", s.port, NULL);
+    CHECK(ac != NULL);
+    if (ac == NULL) {
+        check_server_stop(&s);
+        return;
+    }
+    redis_async_set_read_callback(ac, pubsub_read);
+    redis_async_set_reconnect_callback(ac, pubsub_reconnect);
+    check_server_attach(&s, ac->el);
+    redis_async_append_command(ac, "subscribe c1");
+    redis_async_exec_command(ac);
+    cel_add_timer_event(ac->el, 5, pubsub_publish, &s);
+    cel_add_timer_event(ac->el, 2000, check_deadline, &timeout);
+    redis_async_run(ac);
+    CHECK(!timeout);
+    CHECK(pubsub_messages == 5);
+    CHECK(ac->status == 1);
+    CHECK(pubsub_reconnects == 0);
+    check_server_stop(&s);
+    redis_async_free(ac);
+}
+
+/* replies cut at arbitrary points still complete callbacks in order */
+#define FIFO_COMMANDS 200
+static int fifo_next, fifo_bad;
+
+static void fifo_reply(redis_async_context *ac, redis_reply *reply, void *privdata) {
+    char want[16];
+    int i = (int)(long)privdata;
+
+    (void)ac;
+    snprintf(want, sizeof(want), "v%d", i);
+    if (i != fifo_next || reply == NULL || reply->type != REDIS_REPLY_STRING || strcmp(reply->str, want) != 0)
+        fifo_bad++;
+    if (++fifo_next == FIFO_COMMANDS)
+        cel_stop(current->el);
+}
+
+static int fifo_send(struct st_event_loop *el, int id, void *clientdata) {
+    redis_async_context *ac = (redis_async_context *)clientdata;
+    int i;
+
+    (void)el;
+    (void)id;
+    for (i = 0; i < FIFO_COMMANDS; i++)
+        redis_async_command(ac, fifo_reply, (void *)(long)i, "ECHO v%d", i);
+    return EL_NOMORE;
+}
+
+static void check_fifo(void) {
+    redis_async_context *ac;
+    check_server s;
+    char err[REDIS_ERRBUF_SIZE];
+    int timeout = 0;
+
+    if (check_server_start(&s, 13) == -1) {
+        CHECK(0);
+        return;
+    }
+    current = &s;
+    ac = redis_async_connect(err, "127.0.0.1", s.port, NULL);
+    CHECK(ac != NULL);
+    if (ac == NULL) {
+        check_server_stop(&s);
+        return;
+    }
+    check_server_attach(&s, ac->el);
+    cel_add_timer_event(ac->el, 1, fifo_send, ac);
+    cel_add_timer_event(ac->el, 5000, check_deadline, &timeout);
+    redis_async_run(ac);
+    CHECK(!timeout);
+    CHECK(fifo_next == FIFO_COMMANDS);
+    CHECK(fifo_bad == 0);
+    CHECK(ac->status == 1);
+    check_server_stop(&s);
+    redis_async_free(ac);
+}
+
+/* commands of one loop iteration leave in one write */
+#define PIPELINE_COMMANDS 100
+static int pipeline_replies, pipeline_held;
+
+static void pipeline_reply(redis_async_context *ac, redis_reply *reply, void *privdata) {
+    (void)ac;
+    (void)privdata;
+    if (reply != NULL && reply->type == REDIS_REPLY_STRING && ++pipeline_replies == PIPELINE_COMMANDS)
+        cel_stop(current->el);
+}
+
+static int pipeline_send(struct st_event_loop *el, int id, void *clientdata) {
+    redis_async_context *ac = (redis_async_context *)clientdata;
+    int i;
+
+    (void)el;
+    (void)id;
+    for (i = 0; i < PIPELINE_COMMANDS; i++)
+        redis_async_command(ac, pipeline_reply, NULL, "ECHO %d", i);
+    /* nothing leaves before the loop gets to sleep */
+    pipeline_held = ac->c->wpos == 0 && redis_write_pending(ac->c) == cdslen(ac->c->obuf) &&
+        cdslen(ac->c->obuf) > 0;
+    return EL_NOMORE;
+}
+
+static void check_pipeline(void) {
+    redis_async_context *ac;
+    check_server s;
+    char err[REDIS_ERRBUF_SIZE];
+    int timeout = 0;
+
+    if (check_server_start(&s, 0) == -1) {
+        CHECK(0);
+        return;
+    }
+    current = &s;
+    ac = redis_async_connect(err, "127.0.0.1", s.port, NULL);
+    CHECK(ac != NULL);
+    if (ac == NULL) {
+        check_server_stop(&s);
+        return;
+    }
+    check_server_attach(&s, ac->el);
+    cel_add_timer_event(ac->el, 1, pipeline_send, ac);
+    cel_add_timer_event(ac->el, 5000, check_deadline, &timeout);
+    redis_async_run(ac);
+    CHECK(!timeout);
+    CHECK(pipeline_held);
+    CHECK(pipeline_replies == PIPELINE_COMMANDS);
+    CHECK(s.ncmd == PIPELINE_COMMANDS);
+    CHECK(s.nread == 1);
+    check_server_stop(&s);
+    redis_async_free(ac);
+}
+
+/* A fake server in a thread of its own, for clients running their own
+ * loops. */
+static void *check_server_thread(void *arg) {
+    check_server *s = (check_server *)arg;
+
+    cel_main(s->el);
+    return NULL;
+}
+
+static int check_server_spawn(check_server *s, pthread_t *tid) {
+    st_event_loop *el;
+
+    if (check_server_start(s, 0) == -1)
+        return -1;
+    if ((el = cel_create_event_loop(64)) == NULL) {
+        check_server_stop(s);
+        return -1;
+    }
+    check_server_attach(s, el);
+    if (pthread_create(tid, NULL, check_server_thread, s) != 0) {
+        check_server_stop(s);
+        cel_delete_event_loop(el);
+        return -1;
+    }
+    return 0;
+}
+
+static void check_server_join(check_server *s, pthread_t tid) {
+    st_event_loop *el = s->el;
+
+    cel_stop(el);
+    pthread_join(tid, NULL);
+    check_server_stop(s);
+    cel_delete_event_loop(el);
+}
+
+/* futures submitted from several threads each get their own reply */
+#define ENGINE_THREADS 4
+#define ENGINE_COMMANDS 200
+static redis_engine *engine;
+static int engine_bad[ENGINE_THREADS];
+
+static void *engine_client(void *arg) {
+    redis_future *f[ENGINE_COMMANDS];
+    redis_reply *reply;
+    char want[32];
+    int t = (int)(long)arg, i;
+
+    for (i = 0; i < ENGINE_COMMANDS; i++)
+        f[i] = redis_engine_command_future(engine, "ECHO t%d-%d", t, i);
+    for (i = 0; i < ENGINE_COMMANDS; i++) {
+        if (f[i] == NULL) {
+            engine_bad[t]++;
+            continue;
+        }
+        reply = redis_future_wait(f[i]);
+        snprintf(want, sizeof(want), "t%d-%d", t, i);
+        if (reply == NULL || reply->type != REDIS_REPLY_STRING || strcmp(reply->str, want) != 0)
+            engine_bad[t]++;
+        redis_future_free(f[i]);
+    }
+    return NULL;
+}
+
+static void check_engine(void) {
+    pthread_t stid, tid[ENGINE_THREADS];
+    check_server s;
+    char err[REDIS_ERRBUF_SIZE];
+    int i, port, bad = 0;
+
+    if (check_server_spawn(&s, &stid) == -1) {
+        CHECK(0);
+        return;
+    }
+    engine = redis_engine_create(err, 2, 2, "127.0.0.1", s.port, NULL);
+    CHECK(engine != NULL);
+    if (engine == NULL) {
+        check_server_join(&s, stid);
+        return;
+    }
+    for (i = 0; i < ENGINE_THREADS; i++)
+        pthread_create(&tid[i], NULL, engine_client, (void *)(long)i);
+    for (i = 0; i < ENGINE_THREADS; i++) {
+        pthread_join(tid[i], NULL);
+        bad += engine_bad[i];
+    }
+    CHECK(bad == 0);
+    redis_engine_free(engine);
+    check_server_join(&s, stid);
+    CHECK(s.nconn == 4);
+    CHECK(s.ncmd == ENGINE_THREADS*ENGINE_COMMANDS);
+
+    /* a connection that cannot be opened fails the whole engine */
+    if (check_server_start(&s, 0) == -1) {
+        CHECK(0);
+        return;
+    }
+    port = s.port;
+    check_server_stop(&s);
+    CHECK(redis_engine_create(err, 2, 2, "127.0.0.1", port, NULL) == NULL);
+}
+
+/* loops stay on the native backend unless io_uring is asked for, and an
+ * io_uring loop, where the kernel allows one, delivers readiness alike */
+static void uring_readable(struct st_event_loop *el, int fd, void *clientdata, int mask) {
+    char c;
+
+    (void)mask;
+    if (read(fd, &c, 1) == 1)
+        (*(int *)clientdata)++;
+    cel_stop(el);
+}
+
+static void check_uring(void) {
+    st_event_loop *el;
+    int fds[2], timeout = 0, nread = 0;
+
+    el = cel_create_event_loop(16);
+    CHECK(el != NULL && strcmp(cel_get_api_name(el), "io_uring") != 0);
+    cel_delete_event_loop(el);
+    if ((el = cel_create_event_loop_api(16, EL_API_URING)) == NULL)
+        return;
+    CHECK(strcmp(cel_get_api_name(el), "io_uring") == 0);
+    if (pipe(fds) == -1) {
+        CHECK(0);
+        cel_delete_event_loop(el);
+        return;
+    }
+    cel_add_file_event(el, fds[0], EL_READABLE, uring_readable, &nread);
+    cel_add_timer_event(el, 2000, check_deadline, &timeout);
+    CHECK(write(fds[1], "x", 1) == 1);
+    cel_main(el);
+    CHECK(!timeout);
+    CHECK(nread == 1);
+    cel_del_file_event(el, fds[0], EL_READABLE);
+    close(fds[0]);
+    close(fds[1]);
+    cel_delete_event_loop(el);
+}
+
+/* timers fire by deadline whatever order they were added in, cancelled
+ * ones in the middle of the heap never fire, and a stale id does not
+ * cancel the timer that reused its slot */
+#define TIMERS 40
+static int timer_fired[TIMERS+1], timer_nfired;
+
+static int timer_fire(struct st_event_loop *el, int id, void *clientdata) {
+    (void)id;
+    timer_fired[timer_nfired++] = (int)(long)clientdata;
+    if ((int)(long)clientdata == TIMERS)
+        cel_stop(el);
+    return EL_NOMORE;
+}
+
+static void check_timers(void) {
+    st_event_loop *el = cel_create_event_loop(16);
+    int id[TIMERS], i, k, stale, sorted = 1, timeout = 0;
+
+    /* deadlines 1..TIMERS ms, added in a scrambled order */
+    for (i = 0; i < TIMERS; i++) {
+        k = (i*17) % TIMERS;
+        id[k] = cel_add_timer_event(el, k+1, timer_fire, (void *)(long)k);
+    }
+    for (k = 5; k < TIMERS; k += 10)
+        CHECK(cel_del_timer_event(el, id[k]) == EL_OK);
+    CHECK(cel_del_timer_event(el, id[5]) == EL_ERR);
+
+    stale = cel_add_timer_event(el, 1, timer_fire, (void *)(long)-1);
+    CHECK(cel_del_timer_event(el, stale) == EL_OK);
+    /* the slot just freed is the next one handed out */
+    cel_add_timer_event(el, TIMERS+5, timer_fire, (void *)(long)TIMERS);
+    CHECK(cel_del_timer_event(el, stale) == EL_ERR);
+
+    cel_add_timer_event(el, 2000, check_deadline, &timeout);
+    cel_main(el);
+    CHECK(!timeout);
+    CHECK(timer_nfired == TIMERS-4+1);
+    for (i = 0; i < timer_nfired; i++) {
+        if (timer_fired[i]%10 == 5 || timer_fired[i] < 0 || (i > 0 && timer_fired[i] <= timer_fired[i-1]))
+            sorted = 0;
+    }
+    CHECK(sorted);
+    CHECK(timer_fired[timer_nfired-1] == TIMERS);
+    cel_delete_event_loop(el);
+}
+
+/* posts from another thread run on the loop in posting order, and a stop
+ * from another thread wakes a loop that has nothing else to do */
+#define POSTS 1000
+static int post_seen[POSTS], post_nseen;
+
+static void post_run(struct st_event_loop *el, void *arg) {
+    if (post_nseen < POSTS)
+        post_seen[post_nseen++] = (int)(long)arg;
+    if (post_nseen == POSTS)
+        cel_stop(el);
+}
+
+static void *post_thread(void *arg) {
+    st_event_loop *el = (st_event_loop *)arg;
+    int i;
+
+    for (i = 0; i < POSTS; i++) {
+        cel_post(el, post_run, (void *)(long)i);
+        if (i % 100 == 0)
+            usleep(1000);
+    }
+    return NULL;
+}
+
+static void *stop_thread(void *arg) {
+    usleep(20*1000);
+    cel_stop((st_event_loop *)arg);
+    return NULL;
+}
+
+static void check_post(void) {
+    st_event_loop *el = cel_create_event_loop(16);
+    struct timeval start, end;
+    pthread_t tid;
+    int i, ordered = 1, timeout = 0;
+    long ms;
+
+    cel_add_timer_event(el, 5000, check_deadline, &timeout);
+    pthread_create(&tid, NULL, post_thread, el);
+    cel_main(el);
+    pthread_join(tid, NULL);
+    CHECK(!timeout);
+    CHECK(post_nseen == POSTS);
+    for (i = 0; i < post_nseen; i++) {
+        if (post_seen[i] != i)
+            ordered = 0;
+    }
+    CHECK(ordered);
+    cel_delete_event_loop(el);
+
+    el = cel_create_event_loop(16);
+    cel_add_timer_event(el, 5000, check_deadline, &timeout);
+    gettimeofday(&start, NULL);
+    pthread_create(&tid, NULL, stop_thread, el);
+    cel_main(el);
+    gettimeofday(&end, NULL);
+    pthread_join(tid, NULL);
+    ms = (end.tv_sec-start.tv_sec)*1000+(end.tv_usec-start.tv_usec)/1000;
+    CHECK(!timeout);
+    CHECK(ms < 1000);
+    cel_delete_event_loop(el);
+}
+
+/* an edge-triggered loop hands out a write edge that came before anyone
+ * asked for write interest */
+static int et_reads, et_writes;
+
+static void et_read(struct st_event_loop *el, int fd, void *clientdata, int mask) {
+    char buf[16];
+
+    (void)el;
+    (void)clientdata;
+    (void)mask;
+    while (read(fd, buf, sizeof(buf)) > 0)
+        et_reads++;
+}
+
+static void et_write(struct st_event_loop *el, int fd, void *clientdata, int mask) {
+    (void)clientdata;
+    (void)mask;
+    et_writes++;
+    cel_del_file_event(el, fd, EL_WRITABLE);
+    cel_stop(el);
+}
+
+static int et_want_write(struct st_event_loop *el, int id, void *clientdata) {
+    (void)id;
+    cel_add_file_event(el, *(int *)clientdata, EL_WRITABLE, et_write, NULL);
+    return EL_NOMORE;
+}
+
+static void check_epoll_et(void) {
+    st_event_loop *el;
+    char err[128];
+    int sv[2], timeout = 0;
+
+    if ((el = cel_create_event_loop_api(16, EL_API_EPOLL_ET)) == NULL) {
+        CHECK(0);
+        return;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        CHECK(0);
+        cel_delete_event_loop(el);
+        return;
+    }
+    csocket_non_block(err, sv[0]);
+    CHECK(write(sv[1], "x", 1) == 1);
+    cel_add_file_event(el, sv[0], EL_READABLE, et_read, NULL);
+    /* the loop polls, and sees sv[0] writable, before this is due */
+    cel_add_timer_event(el, 20, et_want_write, &sv[0]);
+    cel_add_timer_event(el, 2000, check_deadline, &timeout);
+    cel_main(el);
+    CHECK(!timeout);
+    CHECK(et_reads == 1);
+    CHECK(et_writes == 1);
+    cel_del_file_event(el, sv[0], EL_READABLE);
+    close(sv[0]);
+    close(sv[1]);
+    cel_delete_event_loop(el);
+}
+
+/* a lost server is retried after between half and all of a backoff that
+ * doubles per failed attempt, and back to the minimum once it answers */
+#define BACKOFF_TRIES 4
+static check_server backoff_s, backoff_s2;
+static redis_async_context *backoff_ac;
+static struct timeval backoff_at[BACKOFF_TRIES+1];
+static int backoff_was[BACKOFF_TRIES+1], backoff_n, backoff_last, backoff_reconnects;
+
+static long check_ms(struct timeval *a, struct timeval *b) {
+    return (b->tv_sec-a->tv_sec)*1000+(b->tv_usec-a->tv_usec)/1000;
+}
+
+static void backoff_reconnect(redis_async_context *ac) {
+    backoff_reconnects++;
+    cel_stop(ac->el);
+}
+
+static int backoff_watch(struct st_event_loop *el, int id, void *clientdata) {
+    redis_async_context *ac = backoff_ac;
+
+    (void)id;
+    (void)clientdata;
+    if (backoff_last == 0) {
+        /* connected: drop the server under it */
+        if (backoff_s.nconn == 0)
+            return 1;
+        check_server_stop(&backoff_s);
+        backoff_last = ac->backoff;
+        return 1;
+    }
+    /* each attempt armed doubles the backoff */
+    if (ac->backoff != backoff_last && backoff_n <= BACKOFF_TRIES) {
+        gettimeofday(&backoff_at[backoff_n], NULL);
+        backoff_was[backoff_n++] = backoff_last;
+        backoff_last = ac->backoff;
+        if (backoff_n == BACKOFF_TRIES+1) {
+            check_server_start(&backoff_s2, 0);
+            check_server_attach(&backoff_s2, el);
+            ac->port = backoff_s2.port;
+        }
+    }
+    return 1;
+}
+
+static void check_backoff(void) {
+    redis_async_context *ac;
+    char err[REDIS_ERRBUF_SIZE];
+    int i, timeout = 0, within = 1;
+    long ms;
+
+    if (check_server_start(&backoff_s, 0) == -1) {
+        CHECK(0);
+        return;
+    }
+    ac = redis_async_connect(err, "127.0.0.1", backoff_s.port, NULL);
+    CHECK(ac != NULL);
+    if (ac == NULL) {
+        check_server_stop(&backoff_s);
+        return;
+    }
+    backoff_ac = ac;
+    redis_async_set_reconnect_callback(ac, backoff_reconnect);
+    check_server_attach(&backoff_s, ac->el);
+    cel_add_timer_event(ac->el, 1, backoff_watch, NULL);
+    cel_add_timer_event(ac->el, 5000, check_deadline, &timeout);
+    redis_async_run(ac);
+    CHECK(!timeout);
+    CHECK(backoff_n == BACKOFF_TRIES+1);
+    CHECK(backoff_was[0] == REDIS_RECONNECT_MIN);
+    /* a refused connect fails at once, so the gap is the delay drawn */
+    for (i = 0; i+1 < backoff_n; i++) {
+        ms = check_ms(&backoff_at[i], &backoff_at[i+1]);
+        if (backoff_was[i+1] != backoff_was[i]*2 || ms < backoff_was[i]/2-2 || ms > backoff_was[i]+100)
+            within = 0;
+    }
+    CHECK(within);
+    CHECK(backoff_reconnects == 1);
+    CHECK(ac->status == 1);
+    CHECK(ac->backoff == REDIS_RECONNECT_MIN);
+    if (backoff_n == BACKOFF_TRIES+1)
+        check_server_stop(&backoff_s2);
+    redis_async_free(ac);
+}
+
+/* the poll backend and csocket_selectid take fds past FD_SETSIZE */
+#define POLL_FD 1500
+
+static void check_poll(void) {
+    st_event_loop *el;
+    struct rlimit rl;
+    int fds[2], hi[2], timeout = 0, nread = 0;
+
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur <= POLL_FD+1 && rl.rlim_max > POLL_FD+1) {
+        rl.rlim_cur = POLL_FD+2;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (pipe(fds) == -1) {
+        CHECK(0);
+        return;
+    }
+    hi[0] = dup2(fds[0], POLL_FD);
+    hi[1] = dup2(fds[1], POLL_FD+1);
+    close(fds[0]);
+    close(fds[1]);
+    if (hi[0] == -1 || hi[1] == -1) {
+        /* no room for such fds here */
+        if (hi[0] != -1) close(hi[0]);
+        if (hi[1] != -1) close(hi[1]);
+        return;
+    }
+    CHECK(csocket_selectid(hi[1], 100, FD_WRITE) == FD_WRITE);
+    CHECK(csocket_selectid(hi[0], 10, FD_READ) == -1);
+    el = cel_create_event_loop_api(16, EL_API_POLL);
+    CHECK(el != NULL && strcmp(cel_get_api_name(el), "poll") == 0);
+    if (el == NULL) {
+        close(hi[0]);
+        close(hi[1]);
+        return;
+    }
+    CHECK(cel_add_file_event(el, hi[0], EL_READABLE, uring_readable, &nread) == EL_OK);
+    cel_add_timer_event(el, 2000, check_deadline, &timeout);
+    CHECK(write(hi[1], "x", 1) == 1);
+    CHECK(csocket_selectid(hi[0], 100, FD_READ) == FD_READ);
+    cel_main(el);
+    CHECK(!timeout);
+    CHECK(nread == 1);
+    cel_del_file_event(el, hi[0], EL_READABLE);
+    close(hi[0]);
+    close(hi[1]);
+    cel_delete_event_loop(el);
+}
+
+/* a pooled connection goes back to the idle stack only when the next
+ * caller can use it as is */
+static int pool_client_id(redis_pool_conn *conn) {
+    redis_reply *reply;
+
+    if (redis_append_command(conn->c, "client id") == -1 || redis_exec_command(conn->c, conn->r) == -1)
+        return -1;
+    if ((reply = redis_get_reply(conn->r)) == NULL || reply->type != REDIS_REPLY_INTEGER)
+        return -1;
+    return (int)reply->integer;
+}
+
+static void check_pool(void) {
+    redis_pool *p;
+    redis_pool_conn *conn;
+    redis_reply *reply;
+    pthread_t stid;
+    check_server s;
+    char err[REDIS_ERRBUF_SIZE];
+
+    if (check_server_spawn(&s, &stid) == -1) {
+        CHECK(0);
+        return;
+    }
+    p = redis_pool_create(err, "127.0.0.1", s.port, NULL, 1, 1);
+    CHECK(p != NULL);
+    if (p == NULL) {
+        check_server_join(&s, stid);
+        return;
+    }
+    conn = redis_pool_get(p, err);
+    CHECK(conn != NULL && pool_client_id(conn) == 0);
+    redis_pool_put(p, conn);
+    conn = redis_pool_get(p, err);
+    CHECK(conn != NULL && pool_client_id(conn) == 0);
+
+    /* a reply nobody read is waiting in the socket */
+    redis_append_command(conn->c, "echo x");
+    CHECK(redis_exec_command(conn->c, conn->r) == 0);
+    CHECK(csocket_selectid(conn->c->fd, 1000, FD_READ) == FD_READ);
+    redis_pool_put(p, conn);
+    conn = redis_pool_get(p, err);
+    CHECK(conn != NULL && pool_client_id(conn) == 1);
+
+    /* a command that was never sent */
+    redis_append_command(conn->c, "echo y");
+    redis_pool_put(p, conn);
+    conn = redis_pool_get(p, err);
+    CHECK(conn != NULL && pool_client_id(conn) == 2);
+
+    /* the server hung up after its last reply */
+    redis_append_command(conn->c, "quit");
+    CHECK(redis_exec_command(conn->c, conn->r) == 0);
+    reply = redis_get_reply(conn->r);
+    CHECK(reply != NULL && reply->type == REDIS_REPLY_STATUS);
+    CHECK(csocket_selectid(conn->c->fd, 1000, FD_READ) == FD_READ);
+    redis_pool_put(p, conn);
+    conn = redis_pool_get(p, err);
+    CHECK(conn != NULL && pool_client_id(conn) == 3);
+
+    redis_pool_put(p, conn);
+    redis_pool_free(p);
+    check_server_join(&s, stid);
+}
+
+/* the replies on a mux connection reach the futures of the threads that
+ * sent the commands, however their commands interleaved on the wire */
+#define MUX_THREADS 4
+#define MUX_COMMANDS 200
+static redis_mux *mux;
+static int mux_bad[MUX_THREADS];
+
+static int mux_same(redis_reply *reply, int t, int i) {
+    char want[32];
+
+    snprintf(want, sizeof(want), "t%d-%d", t, i);
+    return reply != NULL && reply->type == REDIS_REPLY_STRING && strcmp(reply->str, want) == 0;
+}
+
+static void *mux_client(void *arg) {
+    redis_future *f[MUX_COMMANDS/2];
+    redis_reply *reply;
+    int t = (int)(long)arg, i;
+
+    for (i = 0; i < MUX_COMMANDS/2; i++)
+        f[i] = redis_mux_command_future(mux, "ECHO t%d-%d", t, i);
+    for (i = 0; i < MUX_COMMANDS/2; i++) {
+        if (f[i] == NULL || !mux_same(redis_future_wait(f[i]), t, i))
+            mux_bad[t]++;
+        if (f[i]) redis_future_free(f[i]);
+    }
+    for (i = MUX_COMMANDS/2; i < MUX_COMMANDS; i++) {
+        reply = redis_mux_command(mux, "ECHO t%d-%d", t, i);
+        if (!mux_same(reply, t, i))
+            mux_bad[t]++;
+        free(reply);
+    }
+    return NULL;
+}
+
+static void check_mux(void) {
+    pthread_t stid, tid[MUX_THREADS];
+    check_server s;
+    char err[REDIS_ERRBUF_SIZE];
+    int i, bad = 0;
+
+    if (check_server_spawn(&s, &stid) == -1) {
+        CHECK(0);
+        return;
+    }
+    mux = redis_mux_connect(err, "127.0.0.1", s.port, NULL);
+    CHECK(mux != NULL);
+    if (mux == NULL) {
+        check_server_join(&s, stid);
+        return;
+    }
+    for (i = 0; i < MUX_THREADS; i++)
+        pthread_create(&tid[i], NULL, mux_client, (void *)(long)i);
+    for (i = 0; i < MUX_THREADS; i++) {
+        pthread_join(tid[i], NULL);
+        bad += mux_bad[i];
+    }
+    CHECK(bad == 0);
+    CHECK(redis_mux_error(mux, err) == 0);
+    redis_mux_free(mux);
+    check_server_join(&s, stid);
+    CHECK(s.nconn == 1);
+    CHECK(s.ncmd == MUX_THREADS*MUX_COMMANDS);
+}
+
+/* the hash slot vectors of the cluster spec, and its hash tag rules */
+static int check_slot(const char *key) {
+    return redis_cluster_keyslot(key, strlen(key));
+}
+
+static void check_keyslot(void) {
+    CHECK(check_slot("123456789") == 12739);
+    CHECK(check_slot("{user1000}.following") == check_slot("user1000"));
+    CHECK(check_slot("{user1000}.followers") == check_slot("user1000"));
+    CHECK(check_slot("foo{}{bar}") != check_slot("bar"));
+    CHECK(check_slot("foo{}{bar}") == 8363);
+    CHECK(check_slot("foo{{bar}}zap") == check_slot("{bar"));
+    CHECK(check_slot("foo{bar}{zap}") == check_slot("bar"));
+}
+
+/* Two fake nodes, a with slots 0-8191 and b with the rest. CLUSTER SLOTS
+ * also lists ranges of the wrong shape, which must be skipped. GET answers
+ * the name of the node, except for these keys:
+ *   moved (slot 1999)   a redirects to b with MOVED
+ *   ask (slot 11420)    b redirects to a with ASK; a takes it after ASKING
+ *   slow (slot 8903)    b never answers, nor anything after it */
+static check_server cluster_a, cluster_b;
+static int cluster_dead;
+
+static int cluster_answer(check_conn *cn, redis_reply *q) {
+    check_server *s = cn->s;
+    const char *cmd = q->element[0].str, *key = q->elements > 1 ? q->element[1].str : "";
+    char buf[512];
+    int n, asking = cn->state == 1;
+
+    if (cn->state == 2)
+        return 1;
+    cn->state = 0;
+    if (strcasecmp(cmd, "cluster") == 0) {
+        n = snprintf(buf, sizeof(buf), "*6\r\n"
+                "*3\r\n:0\r\n:8191\r\n*2\r\n$9\r\n127.0.0.1\r\n:%d\r\n"
+                "*3\r\n:8192\r\n:16383\r\n*2\r\n$9\r\n127.0.0.1\r\n:%d\r\n"
+                "*3\r\n$1\r\n0\r\n:16383\r\n*2\r\n$9\r\n127.0.0.1\r\n:%d\r\n"
+                "*3\r\n:0\r\n:16383\r\n*2\r\n:7\r\n:%d\r\n"
+                "*3\r\n:0\r\n:16383\r\n*2\r\n$9\r\n127.0.0.1\r\n$5\r\n%05d\r\n"
+                "*3\r\n:0\r\n:16383\r\n*1\r\n$9\r\n127.0.0.1\r\n",
+                cluster_a.port, cluster_b.port, cluster_dead, cluster_dead, cluster_dead);
+        cn->out = cdscatlen(cn->out, buf, n);
+    } else if (strcasecmp(cmd, "asking") == 0) {
+        cn->out = cdscat(cn->out, "+OK\r\n");
+        cn->state = 1;
+    } else if (strcasecmp(cmd, "get") != 0) {
+        return 0;
+    } else if (s == &cluster_a && strcmp(key, "moved") == 0) {
+        n = snprintf(buf, sizeof(buf), "-MOVED 1999 127.0.0.1:%d\r\n", cluster_b.port);
+        cn->out = cdscatlen(cn->out, buf, n);
+    } else if (s == &cluster_b && strcmp(key, "ask") == 0) {
+        n = snprintf(buf, sizeof(buf), "-ASK 11420 127.0.0.1:%d\r\n", cluster_a.port);
+        cn->out = cdscatlen(cn->out, buf, n);
+    } else if (s == &cluster_a && strcmp(key, "ask") == 0 && !asking) {
+        n = snprintf(buf, sizeof(buf), "-MOVED 11420 127.0.0.1:%d\r\n", cluster_b.port);
+        cn->out = cdscatlen(cn->out, buf, n);
+    } else if (s == &cluster_b && strcmp(key, "slow") == 0) {
+        cn->state = 2;
+    } else {
+        cn->out = cdscat(cn->out, s == &cluster_a ? "$1\r\na\r\n" : "$1\r\nb\r\n");
+    }
+    return 1;
+}
+
+static int cluster_is(redis_reply *reply, const char *str) {
+    return reply != NULL && reply->type == REDIS_REPLY_STRING && strcmp(reply->str, str) == 0;
+}
+
+static void check_cluster(void) {
+    redis_cluster *cc;
+    pthread_t atid, btid;
+    struct timeval start, end;
+    check_server dead;
+    char err[REDIS_ERRBUF_SIZE], addr[64];
+    int ancmd, bncmd;
+    long ms;
+
+    /* a port nobody listens on */
+    if (check_server_start(&dead, 0) == -1) {
+        CHECK(0);
+        return;
+    }
+    cluster_dead = dead.port;
+    check_server_stop(&dead);
+    if (check_server_spawn(&cluster_a, &atid) == -1) {
+        CHECK(0);
+        return;
+    }
+    if (check_server_spawn(&cluster_b, &btid) == -1) {
+        CHECK(0);
+        check_server_join(&cluster_a, atid);
+        return;
+    }
+    /* read once the first command arrives, after this */
+    cluster_a.answer = cluster_b.answer = cluster_answer;
+    snprintf(addr, sizeof(addr), "127.0.0.1:%d", cluster_a.port);
+    cc = redis_cluster_connect(err, addr, NULL);
+    CHECK(cc != NULL);
+    if (cc == NULL) {
+        check_server_join(&cluster_a, atid);
+        check_server_join(&cluster_b, btid);
+        return;
+    }
+    CHECK(cluster_is(redis_cluster_command(cc, "GET bar"), "a"));
+    CHECK(cluster_is(redis_cluster_command(cc, "GET foo"), "b"));
+
+    /* MOVED repoints the slot: the second GET goes to b right away */
+    CHECK(cluster_is(redis_cluster_command(cc, "GET moved"), "b"));
+    ancmd = cluster_a.ncmd;
+    CHECK(cluster_is(redis_cluster_command(cc, "GET moved"), "b"));
+    CHECK(cluster_a.ncmd == ancmd);
+
+    /* ASK is followed once, with ASKING, and leaves the slot with b */
+    ancmd = cluster_a.ncmd;
+    bncmd = cluster_b.ncmd;
+    CHECK(cluster_is(redis_cluster_command(cc, "GET ask"), "a"));
+    CHECK(cluster_is(redis_cluster_command(cc, "GET ask"), "a"));
+    CHECK(cluster_a.ncmd == ancmd+4);
+    CHECK(cluster_b.ncmd == bncmd+2);
+
+    /* a node that does not answer costs the batch the timeout, not more,
+     * and only its own commands */
+    redis_cluster_set_timeout(cc, 200);
+    redis_cluster_append_command(cc, "GET bar");
+    redis_cluster_append_command(cc, "GET slow");
+    redis_cluster_append_command(cc, "GET foo");
+    gettimeofday(&start, NULL);
+    CHECK(redis_cluster_exec(cc, err) == -1);
+    gettimeofday(&end, NULL);
+    ms = check_ms(&start, &end);
+    CHECK(ms >= 190 && ms < 2000);
+    CHECK(cluster_is(redis_cluster_get_reply(cc), "a"));
+    CHECK(redis_cluster_get_reply(cc) == NULL);
+    CHECK(redis_cluster_get_reply(cc) == NULL);
+    CHECK(cluster_is(redis_cluster_command(cc, "GET bar"), "a"));
+
+    redis_cluster_free(cc);
+    check_server_join(&cluster_a, atid);
+    check_server_join(&cluster_b, btid);
+}
+
+/* adding a fifth node to a ring of four takes about a fifth of the keys,
+ * all of them from the others to the new node */
+#define SHARD_KEYS 10000
+
+static void check_shard_add_node(void) {
+    redis_shard *sh;
+    char err[REDIS_ERRBUF_SIZE], key[32];
+    static int before[SHARD_KEYS];
+    int i, len, node, moved = 0, elsewhere = 0;
+
+    sh = redis_shard_connect(err, "127.0.0.1:7001,127.0.0.1:7002,127.0.0.1:7003,127.0.0.1:7004", NULL);
+    CHECK(sh != NULL);
+    if (sh == NULL)
+        return;
+    for (i = 0; i < SHARD_KEYS; i++) {
+        len = snprintf(key, sizeof(key), "key:%d", i);
+        before[i] = redis_shard_locate(sh, key, len);
+    }
+    CHECK(redis_shard_add_node(sh, err, "127.0.0.1", 7005) == 0);
+    CHECK(redis_shard_add_node(sh, err, "127.0.0.1", 7005) == -1);
+    for (i = 0; i < SHARD_KEYS; i++) {
+        len = snprintf(key, sizeof(key), "key:%d", i);
+        if ((node = redis_shard_locate(sh, key, len)) == before[i])
+            continue;
+        moved++;
+        if (node != 4)
+            elsewhere++;
+    }
+    CHECK(moved > SHARD_KEYS/5*3/4 && moved < SHARD_KEYS/5*5/4);
+    CHECK(elsewhere == 0);
+    redis_shard_free(sh);
+}
+
+/* MGET over fake shards, which answer each key with port/key and keys
+ * starting with nil with a nil; the merged reply is in key order */
+#define SHARD_NODES 3
+#define SHARD_MGET 20
+
+static int shard_answer(check_conn *cn, redis_reply *q) {
+    char val[64], hdr[32];
+    int i, n, h;
+
+    if (strcasecmp(q->element[0].str, "mget") != 0)
+        return 0;
+    h = snprintf(hdr, sizeof(hdr), "*%d\r\n", (int)q->elements-1);
+    cn->out = cdscatlen(cn->out, hdr, h);
+    for (i = 1; i < (int)q->elements; i++) {
+        if (strncmp(q->element[i].str, "nil", 3) == 0) {
+            cn->out = cdscat(cn->out, "$-1\r\n");
+            continue;
+        }
+        n = snprintf(val, sizeof(val), "%d/%s", cn->s->port, q->element[i].str);
+        h = snprintf(hdr, sizeof(hdr), "$%d\r\n", n);
+        cn->out = cdscatlen(cn->out, hdr, h);
+        cn->out = cdscatlen(cn->out, val, n);
+        cn->out = cdscat(cn->out, "\r\n");
+    }
+    return 1;
+}
+
+static void check_shard_mget(void) {
+    check_server s[SHARD_NODES];
+    pthread_t tid[SHARD_NODES];
+    redis_shard *sh;
+    redis_reply *reply, *e;
+    char err[REDIS_ERRBUF_SIZE], addrs[128], want[64];
+    char keys[SHARD_MGET][16];
+    const char *argv[SHARD_MGET];
+    size_t argvlen[SHARD_MGET];
+    int i, n, len = 0, used[SHARD_NODES] = {0}, nused = 0, bad = 0;
+
+    for (n = 0; n < SHARD_NODES; n++) {
+        if (check_server_spawn(&s[n], &tid[n]) == -1)
+            break;
+        /* read once the first command arrives, after this */
+        s[n].answer = shard_answer;
+        len += snprintf(addrs+len, sizeof(addrs)-len, "%s127.0.0.1:%d", n ? "," : "", s[n].port);
+    }
+    CHECK(n == SHARD_NODES);
+    sh = n == SHARD_NODES ? redis_shard_connect(err, addrs, NULL) : NULL;
+    CHECK(sh != NULL);
+    if (sh == NULL) {
+        while (n--)
+            check_server_join(&s[n], tid[n]);
+        return;
+    }
+    for (i = 0; i < SHARD_MGET; i++) {
+        argvlen[i] = snprintf(keys[i], sizeof(keys[i]), i % 7 == 3 ? "nil:%d" : "key:%d", i);
+        argv[i] = keys[i];
+        if (!used[redis_shard_locate(sh, argv[i], argvlen[i])]++)
+            nused++;
+    }
+    CHECK(nused > 1);
+    reply = redis_shard_mget(sh, err, SHARD_MGET, argv, argvlen);
+    CHECK(reply != NULL && reply->type == REDIS_REPLY_ARRAY && reply->elements == SHARD_MGET);
+    if (reply != NULL && reply->elements == SHARD_MGET) {
+        for (i = 0; i < SHARD_MGET; i++) {
+            e = &reply->element[i];
+            if (keys[i][0] == 'n') {
+                if (e->type != REDIS_REPLY_NIL)
+                    bad++;
+                continue;
+            }
+            snprintf(want, sizeof(want), "%d/%s", s[redis_shard_locate(sh, argv[i], argvlen[i])].port, keys[i]);
+            if (e->type != REDIS_REPLY_STRING || strcmp(e->str, want) != 0)
+                bad++;
+        }
+    }
+    CHECK(bad == 0);
+    free(reply);
+    redis_shard_free(sh);
+    for (n = 0; n < SHARD_NODES; n++)
+        check_server_join(&s[n], tid[n]);
+}
+
+int main(void) {
+    check_parser_resume();
+    check_bad_numbers();
+    check_simd();
+    check_reader_reclaim();
+    check_read_big();
+    check_write_big();
+    check_format();
+    check_template();
+    check_write_resume();
+    check_pubsub();
+    check_fifo();
+    check_pipeline();
+    check_engine();
+    check_uring();
+    check_timers();
+    check_post();
+    check_epoll_et();
+    check_backoff();
+    check_poll();
+    check_pool();
+    check_mux();
+    check_keyslot();
+    check_cluster();
+    check_shard_add_node();
+    check_shard_mget();
+    printf("%d checks, %d failed\n", nchecks, nfailed);
+    return nfailed ? 1 : 0;
+}
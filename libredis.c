@@ -2,6 +2,16 @@
 #include <malloc.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/time.h>
+#ifdef SUNOS
+ #include <sys/filio.h>
+#endif
 #include "cctype.h"
 #include "ccsocket.h"
 #include "ccds.h"
@@ -30,21 +40,41 @@ static void redis_reader_set_error(redis_reader *r, int type, const char *fmt, .
     }
 }
 
-static int intlen(int i) {
-    int len = 0;
-    if (i < 0) {
-        len++;
-        i = -i;
-    }
+/* Longest RESP header: a prefix, 20 digits and \r\n. */
+#define REDIS_HEADER_MAX 23
+
+/* Write the digits of v to dst, which must have room for 20 bytes, and
+ * return their number. */
+static int encode_ull(char *dst, unsigned long long v) {
+    char tmp[20];
+    int i = 0, len = 0;
+
     do {
-        len++;
-        i /= 10;
-    } while(i);
+        tmp[i++] = '0'+v%10;
+        v /= 10;
+    } while (v);
+    while (i) dst[len++] = tmp[--i];
     return len;
 }
 
-static size_t bulklen(size_t len) {
-    return 1+intlen(len)+2+len+2;
+static int encode_ll(char *dst, long long v) {
+    if (v < 0) {
+        *dst = '-';
+        return 1+encode_ull(dst+1, 0-(unsigned long long)v);
+    }
+    return encode_ull(dst, v);
+}
+
+/* Write a RESP header such as "*3\r\n" or "$5\r\n" to dst, which must have
+ * room for REDIS_HEADER_MAX bytes, and return its length. */
+static int encode_header(char *dst, char prefix, size_t n) {
+    int len = 0;
+
+    dst[len++] = prefix;
+    len += encode_ull(dst+len, n);
+    dst[len++] = '\r';
+    dst[len++] = '\n';
+    return len;
 }
 
 static char *read_bytes(redis_reader *r, unsigned int bytes) {
@@ -58,7 +88,7 @@ static char *read_bytes(redis_reader *r, unsigned int bytes) {
 }
 
 /* Find pointer to \r\n. */
-static char *seek_newline(char *s, size_t len) {
+static char *seek_newline_scalar(char *s, size_t len) {
     int pos = 0; 
     int _len = len-1;
 
@@ -84,33 +114,190 @@ static char *seek_newline(char *s, size_t len) {
     return NULL;
 }
 
-/* Read a long long value starting at *s, under the assumption that it will be
- * terminated by \r\n. Ambiguously returns -1 for unexpected input. */
-static long long read_longlong(char *s) {
-    long long v = 0;
-    int dec, mult = 1;
-    char c;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define REDIS_HAVE_X86_SIMD
+#include <immintrin.h>
+
+/* The vector kernels compare a block against \r and the block shifted by
+ * one byte against \n, so a match is already a \r\n pair. They never load
+ * past s+len and leave the last partial block to the scalar loop. */
+__attribute__((target("sse2")))
+static char *seek_newline_sse2(char *s, size_t len) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t pos = 0;
+    int mask;
+
+    while (pos+17 <= len) {
+        mask = _mm_movemask_epi8(_mm_and_si128(
+                    _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(s+pos)), cr),
+                    _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(s+pos+1)), lf)));
+        if (mask) return s+pos+__builtin_ctz(mask);
+        pos += 16;
+    }
+    return seek_newline_scalar(s+pos, len-pos);
+}
 
-    if (*s == '-') {
-        mult = -1;
-        s++;
-    } else if (*s == '+') {
-        mult = 1;
+__attribute__((target("avx2")))
+static char *seek_newline_avx2(char *s, size_t len) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t pos = 0;
+    unsigned int mask;
+
+    while (pos+33 <= len) {
+        mask = _mm256_movemask_epi8(_mm256_and_si256(
+                    _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(s+pos)), cr),
+                    _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(s+pos+1)), lf)));
+        if (mask) return s+pos+__builtin_ctz(mask);
+        pos += 32;
+    }
+    return seek_newline_sse2(s+pos, len-pos);
+}
+#endif
+
+static int simd_level = -1;
+static char *(*seek_newline_kernel)(char *s, size_t len) = seek_newline_scalar;
+
+static int simd_detect(void) {
+#ifdef REDIS_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return REDIS_SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2")) return REDIS_SIMD_SSE2;
+#endif
+    return REDIS_SIMD_NONE;
+}
+
+/* Pick the CRLF kernel at runtime from CPUID. level caps the kernel that may
+ * be used; REDIS_SIMD_NONE forces the scalar code, also for integer decoding.
+ * The level actually in effect is returned. */
+int redis_set_simd(int level) {
+    char *(*kernel)(char *s, size_t len) = seek_newline_scalar;
+    int supported = simd_detect();
+
+    if (level > supported) level = supported;
+    switch (level) {
+#ifdef REDIS_HAVE_X86_SIMD
+        case REDIS_SIMD_AVX2:
+            kernel = seek_newline_avx2;
+            break;
+        case REDIS_SIMD_SSE2:
+            kernel = seek_newline_sse2;
+            break;
+#endif
+        default:
+            level = REDIS_SIMD_NONE;
+    }
+    /* readers on other threads see the kernel once they see the level */
+    __atomic_store_n(&seek_newline_kernel, kernel, __ATOMIC_RELAXED);
+    __atomic_store_n(&simd_level, level, __ATOMIC_RELEASE);
+    return level;
+}
+
+static char *seek_newline(char *s, size_t len) {
+    if (__atomic_load_n(&simd_level, __ATOMIC_ACQUIRE) < 0) redis_set_simd(REDIS_SIMD_AVX2);
+    return __atomic_load_n(&seek_newline_kernel, __ATOMIC_RELAXED)(s, len);
+}
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define REDIS_HAVE_SWAR_DIGITS
+
+/* SWAR helpers working on 8 ASCII bytes loaded little endian, so the first
+ * character sits in the lowest byte. */
+static int is_eight_digits(uint64_t v) {
+    return ((v & 0xF0F0F0F0F0F0F0F0ULL) |
+            (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ==
+        0x3333333333333333ULL;
+}
+
+static uint32_t parse_eight_digits(uint64_t v) {
+    v -= 0x3030303030303030ULL;
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+            (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    return (uint32_t)v;
+}
+#endif
+
+static int read_digits_scalar(const char *s, long len, unsigned long long *value) {
+    unsigned long long v = 0;
+
+    while (len--) {
+        int dec = *(s++) - '0';
+        if (dec < 0 || dec > 9) return RET_ERR;
+        v = v*10 + dec;
+    }
+    *value = v;
+    return RET_OK;
+}
+
+#ifdef REDIS_HAVE_SWAR_DIGITS
+/* Eight digits per step; short lengths such as most bulk headers are cheaper
+ * one by one, so the tail is left to the scalar loop. */
+static int read_digits_swar(const char *s, long len, unsigned long long *value) {
+    unsigned long long v = 0, tail;
+    uint64_t chunk;
+
+    while (len >= 8) {
+        memcpy(&chunk, s, 8);
+        if (!is_eight_digits(chunk)) return RET_ERR;
+        v = v*100000000ULL + parse_eight_digits(chunk);
+        s += 8;
+        len -= 8;
+    }
+    if (len) {
+        if (read_digits_scalar(s, len, &tail) == RET_ERR) return RET_ERR;
+        while (len--) v *= 10;
+        v += tail;
+    }
+    *value = v;
+    return RET_OK;
+}
+#endif
+
+/* Read the long long value in the len bytes at s (a line without its \r\n).
+ * Anything but an optionally signed run of digits that fits in a long long
+ * is rejected. */
+static int read_longlong(const char *s, long len, long long *value) {
+    unsigned long long v;
+    int neg = 0, ret;
+
+    if (len > 0 && (*s == '-' || *s == '+')) {
+        neg = (*s == '-');
         s++;
+        len--;
     }
+    /* 19 digits always fit in an unsigned long long */
+    if (len <= 0 || len > 19)
+        return RET_ERR;
+#ifdef REDIS_HAVE_SWAR_DIGITS
+    if (__atomic_load_n(&simd_level, __ATOMIC_RELAXED) > REDIS_SIMD_NONE)
+        ret = read_digits_swar(s, len, &v);
+    else
+#endif
+        ret = read_digits_scalar(s, len, &v);
+    if (ret == RET_ERR)
+        return RET_ERR;
 
-    while ((c = *(s++)) != '\r') {
-        dec = c - '0';
-        if (dec >= 0 && dec < 10) {
-            v *= 10;
-            v += dec;
-        } else {
-            /* Should not happen... */
-            return -1;
-        }
+    if (neg) {
+        if (v > (unsigned long long)LLONG_MAX+1) return RET_ERR;
+        *value = (long long)(0-v);
+    } else {
+        if (v > (unsigned long long)LLONG_MAX) return RET_ERR;
+        *value = (long long)v;
     }
+    return RET_OK;
+}
+
+/* Like read_longlong() for a number that still has to be delimited by \r\n
+ * within the avail bytes at s. Ambiguously returns -1 for unexpected input. */
+static long long read_line_longlong(char *s, size_t avail) {
+    char *e = seek_newline(s, avail);
+    long long v;
 
-    return mult*v;
+    if (e == NULL || read_longlong(s, e-s, &v) == RET_ERR)
+        return -1;
+    return v;
 }
 
 static char *read_line(redis_reader *r, long *_len) {
@@ -128,34 +315,113 @@ static char *read_line(redis_reader *r, long *_len) {
     return NULL;
 }
 
-static redis_reply *create_reply(void) {
+/* Round up so every reply and element array in the arena is aligned. */
+#define ARENA_ALIGN(n) (((n)+sizeof(long long)-1) & ~(sizeof(long long)-1))
+
+static redis_arena_block *arena_new_block(size_t size, redis_arena_block *next) {
+    redis_arena_block *b;
+
+    if ((b = malloc(sizeof(redis_arena_block)+size)) == NULL)
+        return NULL;
+    b->next = next;
+    b->size = size;
+    b->used = 0;
+    return b;
+}
+
+static void *arena_alloc(redis_reader *r, size_t size) {
+    redis_arena_block *b = r->arena;
+    size_t newsize;
+    void *p;
+
+    size = ARENA_ALIGN(size);
+    if (b == NULL || b->size-b->used < size) {
+        newsize = b ? b->size*2 : REDIS_ARENA_BLOCK_SIZE;
+        if (newsize < size) newsize = size;
+        if ((b = arena_new_block(newsize, b)) == NULL)
+            return NULL;
+        r->arena = b;
+    }
+    p = b->data+b->used;
+    b->used += size;
+    return p;
+}
+
+/* Drop every reply built so far. Blocks only ever double, so keeping the
+ * newest one is enough to hold the next reply of the same size; a block
+ * that grew beyond maxbuf is given back too. */
+static void arena_reset(redis_reader *r) {
+    redis_arena_block *b = r->arena, *next;
+
+    if (b == NULL) return;
+    next = b->next;
+    b->next = NULL;
+    b->used = 0;
+    while (next) {
+        redis_arena_block *n = next->next;
+        free(next);
+        next = n;
+    }
+    if (r->maxbuf && b->size > r->maxbuf) {
+        free(b);
+        r->arena = NULL;
+    }
+}
+
+static void arena_free(redis_reader *r) {
+    arena_reset(r);
+    if (r->arena) free(r->arena);
+    r->arena = NULL;
+}
+
+static redis_reply *create_reply(redis_reader *r, size_t n) {
     redis_reply *obj;
-    if ((obj = malloc(sizeof(redis_reply))) == NULL)
+    if ((obj = arena_alloc(r, sizeof(redis_reply)*n)) == NULL) {
+        redis_reader_set_error(r, REDIS_ERR_OMM, "malloc memory error, errno=%d, errmsg=%s", 
+                __errno__, __errmsg__);
         return NULL;
-    memset(obj, 0, sizeof(redis_reply));    
+    }
+    memset(obj, 0, sizeof(redis_reply)*n);    
     return obj;
 }
 
-static void free_reply(redis_reply *reply) {
-    size_t i;
-    if (!reply) return;
-    if (reply->str) cdsfree(reply->str);
-    for (i = 0; i < reply->total; i++) {
-        if (reply->element[i].str)
-            cdsfree(reply->element[i].str);
+/* Set the string of a reply to the len bytes at p, which sit in r->buf and are
+ * followed by \r\n. In zero-copy mode the bytes are not copied: the offset
+ * from the start of the reply is kept in reply->integer until the whole reply
+ * is parsed, because the buffer may still be reallocated or compacted when
+ * more data is fed, see resolve_views(). */
+static int set_reply_str(redis_reader *r, redis_reply *reply, char *p, long len) {
+    if (r->flags & REDIS_READER_ZEROCOPY) {
+        p[len] = '\0';
+        reply->str = NULL;
+        reply->integer = p-(r->buf+r->rstart);
+    } else {
+        if ((reply->str = arena_alloc(r, len+1)) == NULL) {
+            redis_reader_set_error(r, REDIS_ERR_OMM, "malloc memory error, errno=%d, errmsg=%s", 
+                    __errno__, __errmsg__);
+            return RET_ERR;
+        }
+        memcpy(reply->str, p, len);
+        reply->str[len] = '\0';
     }
-    if (reply->element) free(reply->element);
-    free(reply);
+    reply->len = len;
+    return RET_OK;
 }
 
-static void clear_reply(redis_reply *reply) {
-    if (!reply) return;
-    reply->type = 0; 
-    reply->integer = 0;
-    reply->elements = 0;
-    if (reply->len) {
-        reply->len = 0;
-        cdsclear(reply->str);
+static void resolve_views(redis_reader *r, redis_reply *reply) {
+    size_t i;
+
+    switch (reply->type) {
+        case REDIS_REPLY_STRING:
+        case REDIS_REPLY_STATUS:
+        case REDIS_REPLY_ERROR:
+            reply->str = r->buf+r->rstart+reply->integer;
+            reply->integer = 0;
+            break;
+        case REDIS_REPLY_ARRAY:
+            for (i = 0; i < reply->elements; i++)
+                resolve_views(r, &reply->element[i]);
+            break;
     }
 }
 
@@ -166,6 +432,9 @@ static redis_context *redis_context_init(void) {
         return NULL;
     c->err = c->fd = c->flags = 0;
     c->pipe = -1;
+    c->refs = NULL;
+    c->nref = c->maxref = 0;
+    c->wpos = c->hwm = 0;
     c->errstr[0] = c->errstr[127] = 0;
     c->obuf = cdsnew(NULL);
     if (!c->obuf) {
@@ -181,6 +450,7 @@ void redis_free(redis_context *c) {
         close(c->fd);
     }
     if (c->obuf) cdsfree(c->obuf);
+    if (c->refs) free(c->refs);
     free(c);
 }
 
@@ -190,9 +460,11 @@ redis_reader *redis_create_reader(void) {
         return NULL;
     memset(r, 0, sizeof(redis_reader));    
     r->buf = cdsnew(NULL);
-    r->reply = create_reply();
     r->maxbuf = REDIS_READER_MAX_BUF;
-    if (!r->buf || !r->reply) {
+    r->readsize = REDIS_READER_READ_SIZE;
+    r->ridx = -1;
+    r->bulklen = -1;
+    if (!r->buf) {
         redis_free_reader(r);
         return NULL;
     }
@@ -203,19 +475,30 @@ redis_reader *redis_create_reader(void) {
 void redis_free_reader(redis_reader *r) {
     if (!r) return;
     if (r->buf) cdsfree(r->buf);
-    if (r->reply) free_reply(r->reply);
+    arena_free(r);
     free(r);
 }
 
+/* In zero-copy mode reply->str/len of every string point straight into the
+ * reader buffer. They stay valid until the reader reads or is fed again. */
+void redis_reader_set_zerocopy(redis_reader *r, int on) {
+    if (on)
+        r->flags |= REDIS_READER_ZEROCOPY;
+    else
+        r->flags &= ~REDIS_READER_ZEROCOPY;
+}
+
 redis_reader *_redis_copy_reader(redis_reader *r) {
     redis_reader *newread; 
     if ((newread = malloc(sizeof(redis_reader))) == NULL)
         return NULL;
     memset(newread, 0, sizeof(redis_reader));    
     newread->buf = cdsdup(r->buf);
-    newread->reply = create_reply();
     newread->maxbuf = REDIS_READER_MAX_BUF;
-    if (!newread->buf || !newread->reply) {
+    newread->readsize = REDIS_READER_READ_SIZE;
+    newread->ridx = -1;
+    newread->bulklen = -1;
+    if (!newread->buf) {
         redis_free_reader(newread);
         return NULL;
     }
@@ -243,11 +526,26 @@ redis_context *redis_connect_with_timeout(char *ip, int port, size_t timeout) {
     return redis_tcp_connect(ip, port, timeout);
 }
 
-static int redis_reconnect(redis_context *c, char *ip, int port, size_t timeout) {
-    if (c->fd > 0) close(c->fd);
-    c->fd = csocket_tcp_connect(c->errstr, ip, port, timeout);
+static redis_context *redis_unix_connect(char *path, size_t timeout) {
+    redis_context *c;
+
+    if ((c = redis_context_init()) == NULL)
+        return NULL;
     c->flags |= REDIS_BLOCK;
-    return c->fd;
+    c->fd = csocket_unix_connect(c->errstr, path, timeout);
+    if (c->fd <= 0) {
+        redis_set_error(c, REDIS_ERR_IO, NULL);
+    }
+    return c;
+}
+
+/* Connect to a redis on this host through its unix socket. */
+redis_context *redis_connect_unix(char *path) {
+    return redis_unix_connect(path, 0);
+}
+
+redis_context *redis_connect_unix_with_timeout(char *path, size_t timeout) {
+    return redis_unix_connect(path, timeout);
 }
 
 int redis_set_nonblock(redis_context *c) {
@@ -270,8 +568,37 @@ int redis_set_timeout(redis_context *c, size_t timeout) {
     return RET_OK;
 }
 
+/* Once more than hwm bytes wait to be written, appending a command fails
+ * with REDIS_ERR_FULL until the socket drained them. */
+void redis_set_write_hwm(redis_context *c, size_t hwm) {
+    c->hwm = hwm;
+}
+
+static size_t redis_obuf_total(redis_context *c) {
+    size_t total = cdslen(c->obuf);
+    int i;
+
+    for (i = 0; i < c->nref; i++)
+        total += c->refs[i].len;
+    return total;
+}
+
+size_t redis_write_pending(redis_context *c) {
+    return redis_obuf_total(c)-c->wpos;
+}
+
+static int redis_check_hwm(redis_context *c) {
+    if (c->hwm && redis_write_pending(c) >= c->hwm) {
+        redis_set_error(c, REDIS_ERR_FULL, "output buffer full");
+        return RET_ERR;
+    }
+    return RET_OK;
+}
+
 static void redis_clear_writer(redis_context *c) {
     cdsclear(c->obuf);    
+    c->nref = 0;
+    c->wpos = 0;
     c->pipe = -1;
 }
 
@@ -281,259 +608,272 @@ static void redis_clear_reader(redis_reader *r) {
     r->readcount = 0;
     r->len = 0;
     r->pos = 0;
+    r->ridx = -1;
+    r->bulklen = -1;
 }
 
-static int redis_v_format_command(char **target, const char *format, va_list ap) {
-    const char *c = format;
-    char *cmd = NULL; /* final command */
-    int pos; /* position in final command */
-    cds curarg, newarg; /* current argument */
-    int touched = 0; /* was the current argument touched? */
-    int spacedata = 0;
-    char **curargv = NULL, **newargv = NULL;
-    int argc = 0;
-    int totlen = 0;
-    int j;
-
-    /* Abort if there is not target to set */
-    if (target == NULL)
-        return -1;
-
-    /* Build the command string accordingly to protocol */
-    curarg = cdsnew(NULL);
-    if (curarg == NULL)
-        return -1;
+#define FORMAT_INTS "diouxX"
+
+/* Skip the flags, field width and precision of a printf conversion; p points
+ * just after the '%'. */
+static const char *format_skip_spec(const char *p) {
+    if (*p == '#') p++;
+    if (*p == '0') p++;
+    if (*p == '-') p++;
+    if (*p == ' ') p++;
+    if (*p == '+') p++;
+    while (isdigit((unsigned char)*p)) p++;
+    if (*p == '.') {
+        p++;
+        while (isdigit((unsigned char)*p)) p++;
+    }
+    return p;
+}
 
-    while (*c != '\0') {
-        if (*c != '%' || spacedata || c[1] == '\0') {
-            if (*c == '\'') {
-                spacedata = spacedata ? 0 : 1;
-            }
-            if (*c == ' ' && !spacedata) {
-                if (touched) {
-                    newargv = realloc(curargv,sizeof(char*)*(argc+1));
-                    if (newargv == NULL) goto err;
-                    curargv = newargv;
-                    curargv[argc++] = curarg;
-                    totlen += bulklen(cdslen(curarg));
-
-                    /* curarg is put in argv so it can be overwritten. */
-                    curarg = cdsnew(NULL);
-                    if (curarg == NULL) goto err;
-                    touched = 0;
-                }
-            } else if (*c != '\''){
-                newarg = cdscatlen(curarg,c,1);
-                if (newarg == NULL) goto err;
-                curarg = newarg;
-                touched = 1;
-            }
-        } else {
-            char *arg;
-            size_t size;
-
-            /* Set newarg so it can be checked even if it is not touched. */
-            newarg = curarg;
-
-            switch(c[1]) {
-                case 's':
-                    arg = va_arg(ap,char*);
-                    size = strlen(arg);
-                    if (size > 0)
-                        newarg = cdscatlen(curarg,arg,size);
-                    break;
-                case 'b':
-                    arg = va_arg(ap,char*);
-                    size = va_arg(ap,size_t);
-                    if (size > 0)
-                        newarg = cdscatlen(curarg,arg,size);
-                    break;
-                case '%':
-                    newarg = cdscat(curarg,"%");
-                    break;
-                default:
-                    /* Try to detect printf format */
-                    {
-                        static const char intfmts[] = "diouxX";
-                        char _format[16];
-                        const char *_p = c+1;
-                        size_t _l = 0;
-                        va_list _cpy;
-
-                        /* Flags */
-                        if (*_p != '\0' && *_p == '#') _p++;
-                        if (*_p != '\0' && *_p == '0') _p++;
-                        if (*_p != '\0' && *_p == '-') _p++;
-                        if (*_p != '\0' && *_p == ' ') _p++;
-                        if (*_p != '\0' && *_p == '+') _p++;
-
-                        /* Field width */
-                        while (*_p != '\0' && isdigit(*_p)) _p++;
-
-                        /* Precision */
-                        if (*_p == '.') {
-                            _p++;
-                            while (*_p != '\0' && isdigit(*_p)) _p++;
-                        }
-
-                        /* Copy va_list before consuming with va_arg */
-                        va_copy(_cpy,ap);
-                        /* Integer conversion (without modifiers) */
-                        if (strchr(intfmts,*_p) != NULL) {
-                            va_arg(ap,int);
-                            goto fmt_valid;
-                        }
-
-                        /* Double conversion (without modifiers) */
-                        if (strchr("eEfFgGaA",*_p) != NULL) {
-                            va_arg(ap,double);
-                            goto fmt_valid;
-                        }
-
-                        /* Size: char */
-                        if (_p[0] == 'h' && _p[1] == 'h') {
-                            _p += 2;
-                            if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                                va_arg(ap,int); /* char gets promoted to int */
-                                goto fmt_valid;
-                            }
-                            goto fmt_invalid;
-                        }
-                        /* Size: short */
-                        if (_p[0] == 'h') {
-                            _p += 1;
-                            if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                                va_arg(ap,int); /* short gets promoted to int */
-                                goto fmt_valid;
-                            }
-                            goto fmt_invalid;
-                        }
-
-                        /* Size: long long */
-                        if (_p[0] == 'l' && _p[1] == 'l') {
-                            _p += 2;
-                            if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                                va_arg(ap,long long);
-                                goto fmt_valid;
-                            }
-                            goto fmt_invalid;
-                        }
-
-                        /* Size: long */
-                        if (_p[0] == 'l') {
-                            _p += 1;
-                            if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                                va_arg(ap,long);
-                                goto fmt_valid;
-                            }
-                            goto fmt_invalid;
-                        }
-fmt_invalid:
-                        va_end(_cpy);
-                        goto err;
-
-fmt_valid:
-                        _l = (_p+1)-c;
-                        if (_l < sizeof(_format)-2) {
-                            memcpy(_format,c,_l);
-                            _format[_l] = '\0';
-                            newarg = cdscatvprintf(curarg,_format,_cpy);
-
-                            /* Update current position (note: outer blocks
-                             * increment c twice so compensate here) */
-                            c = _p-1;
-                        }
-
-                        va_end(_cpy);
-                        break;
-                    }
-            }
+/* Parse the printf conversion at f, which points at the '%'. Returns a
+ * pointer to the conversion character, or NULL when it is not supported.
+ * mod is set to the length modifier, 'H' for hh and 'L' for ll, and plain
+ * tells whether the conversion has no flags, width or precision. */
+static const char *format_conv(const char *f, int *mod, int *plain) {
+    const char *p = format_skip_spec(f+1);
+
+    *plain = (p == f+1);
+    *mod = 0;
+    if (p[0] == 'h' && p[1] == 'h') *mod = 'H', p += 2;
+    else if (p[0] == 'h') *mod = 'h', p += 1;
+    else if (p[0] == 'l' && p[1] == 'l') *mod = 'L', p += 2;
+    else if (p[0] == 'l') *mod = 'l', p += 1;
+    if (*p == '\0' || p+1-f >= 16)
+        return NULL;
+    if (strchr(FORMAT_INTS, *p) == NULL && (*mod || strchr("eEfFgGaA", *p) == NULL))
+        return NULL;
+    return p;
+}
 
-            if (newarg == NULL) goto err;
-            curarg = newarg;
+/* Fetch the next %d, %i or %u argument with length modifier mod from ap and
+ * encode it into num, n is set to its length. */
+#define FORMAT_INT_ARG(ap, conv, mod, num, n) do { \
+    if ((conv) == 'u') { \
+        unsigned long long _v; \
+        switch (mod) { \
+            case 'H': _v = (unsigned char)va_arg(ap, int); break; \
+            case 'h': _v = (unsigned short)va_arg(ap, int); break; \
+            case 'L': _v = va_arg(ap, unsigned long long); break; \
+            case 'l': _v = va_arg(ap, unsigned long); break; \
+            default: _v = va_arg(ap, unsigned int); \
+        } \
+        (n) = encode_ull(num, _v); \
+    } else { \
+        long long _v; \
+        switch (mod) { \
+            case 'H': _v = (signed char)va_arg(ap, int); break; \
+            case 'h': _v = (short)va_arg(ap, int); break; \
+            case 'L': _v = va_arg(ap, long long); break; \
+            case 'l': _v = va_arg(ap, long); break; \
+            default: _v = va_arg(ap, int); \
+        } \
+        (n) = encode_ll(num, _v); \
+    } \
+} while (0)
+
+/* Consume the argument of a conversion printed by redis_cat_printf(). */
+#define FORMAT_SKIP_ARG(ap, conv, mod) do { \
+    if (strchr(FORMAT_INTS, conv) == NULL) (void)va_arg(ap, double); \
+    else if ((mod) == 'L') (void)va_arg(ap, long long); \
+    else if ((mod) == 'l') (void)va_arg(ap, long); \
+    else (void)va_arg(ap, int); \
+} while (0)
+
+/* Print the len bytes long conversion spec with the next argument of ap at
+ * the end of obuf. ap itself is left alone, see FORMAT_SKIP_ARG. */
+static int redis_cat_printf(redis_context *c, const char *spec, size_t len, va_list ap) {
+    char _format[16];
+    va_list _cpy;
+    cds newbuf;
+    int n;
+
+    memcpy(_format, spec, len);
+    _format[len] = '\0';
+    va_copy(_cpy, ap);
+    n = vsnprintf(NULL, 0, _format, _cpy);
+    va_end(_cpy);
+    if (n < 0 || (newbuf = cdsmakeroom(c->obuf, n+1)) == NULL)
+        return RET_ERR;
+    c->obuf = newbuf;
+    va_copy(_cpy, ap);
+    vsnprintf(c->obuf+cdslen(c->obuf), n+1, _format, _cpy);
+    va_end(_cpy);
+    cdsincrlen(c->obuf, n);
+    return RET_OK;
+}
 
+/* Count the arguments a format expands to. Only the format is needed: an
+ * argument exists as soon as it holds a character or a conversion, even one
+ * expanding to nothing. */
+static int format_argc(const char *f) {
+    int argc = 0, touched = 0, spacedata = 0;
+
+    while (*f != '\0') {
+        if (*f == '\'') {
+            spacedata = !spacedata;
+        } else if (*f == ' ' && !spacedata) {
+            argc += touched;
+            touched = 0;
+        } else {
             touched = 1;
-            c++;
+            if (*f == '%' && !spacedata && f[1] != '\0') {
+                f = format_skip_spec(f+1);
+                if (*f == '\0') break;
+            }
         }
-        c++;
-    }
-
-    /* Add the last argument if needed */
-    if (touched) {
-        newargv = realloc(curargv,sizeof(char*)*(argc+1));
-        if (newargv == NULL) goto err;
-        curargv = newargv;
-        curargv[argc++] = curarg;
-        totlen += bulklen(cdslen(curarg));
-    } else {
-        cdsfree(curarg);
+        f++;
     }
+    return argc+touched;
+}
 
-    /* Clear curarg because it was put in curargv or was free'd. */
-    curarg = NULL;
+/* Write the header in front of the argument built at argstart, behind
+ * REDIS_HEADER_MAX reserved bytes, and close it. */
+static int redis_end_format_arg(redis_context *c, size_t argstart) {
+    char hdr[REDIS_HEADER_MAX];
+    size_t size = cdslen(c->obuf)-argstart-REDIS_HEADER_MAX;
+    cds newbuf;
+    int n;
 
-    /* Add bytes needed to hold multi bulk count */
-    totlen += 1+intlen(argc)+2;
+    n = encode_header(hdr, '$', size);
+    memmove(c->obuf+argstart+n, c->obuf+argstart+REDIS_HEADER_MAX, size);
+    memcpy(c->obuf+argstart, hdr, n);
+    cdsrange(c->obuf, 0, argstart+n+size);
+    if ((newbuf = cdscatlen(c->obuf, "\r\n", 2)) == NULL)
+        return RET_ERR;
+    c->obuf = newbuf;
+    return RET_OK;
+}
 
-    /* Build the command at protocol level */
-    cmd = malloc(totlen+1);
-    if (cmd == NULL) goto err;
+/* Encode a printf-like command straight into obuf in a single pass. The
+ * multi bulk count comes from format_argc(). An argument that is exactly one
+ * %s or %b gets its header written before the payload; any other argument is
+ * built behind REDIS_HEADER_MAX reserved bytes and moved down once its length
+ * is known. Integers are encoded by hand, only unusual conversions go
+ * through vsnprintf. Nothing is allocated but obuf growth. */
+static int redis_v_append_command(redis_context *c, const char *format, va_list ap) {
+    const char *f = format, *arg;
+    size_t oldlen = cdslen(c->obuf), argstart = 0, size;
+    int touched = 0, spacedata = 0, argc, n;
+    cds newbuf;
 
-    pos = sprintf(cmd,"*%d\r\n",argc);
-    for (j = 0; j < argc; j++) {
-#ifdef LINUX
-        pos += sprintf(cmd+pos,"$%zu\r\n",cdslen(curargv[j]));
-#else
-        pos += sprintf(cmd+pos,"$%u\r\n",cdslen(curargv[j]));
-#endif
-        memcpy(cmd+pos,curargv[j],cdslen(curargv[j]));
-        pos += cdslen(curargv[j]);
-        cdsfree(curargv[j]);
-        cmd[pos++] = '\r';
-        cmd[pos++] = '\n';
+    if (redis_check_hwm(c) == RET_ERR)
+        return RET_ERR;
+    if ((argc = format_argc(format)) == 0) {
+        redis_set_error(c, REDIS_ERR_OTHER, "empty command");
+        return RET_ERR;
     }
-    //assert(pos == totlen);
-    cmd[pos] = '\0';
-
-    free(curargv);
-    *target = cmd;
-    return totlen;
+    if ((newbuf = cdsmakeroom(c->obuf, REDIS_HEADER_MAX)) == NULL) goto oom;
+    c->obuf = newbuf;
+    cdsincrlen(c->obuf, encode_header(c->obuf+cdslen(c->obuf), '*', argc));
 
-err:
-    while(argc--)
-        cdsfree(curargv[argc]);
-    free(curargv);
+    while (*f != '\0') {
+        if (*f == '\'') {
+            spacedata = !spacedata;
+            f++;
+            continue;
+        }
+        if (*f == ' ' && !spacedata) {
+            if (touched && redis_end_format_arg(c, argstart) == RET_ERR) goto oom;
+            touched = 0;
+            f++;
+            continue;
+        }
 
-    if (curarg != NULL)
-        cdsfree(curarg);
+        /* fast path, the whole argument is one %s or %b */
+        if (!touched && !spacedata && *f == '%' && (f[1] == 's' || f[1] == 'b') &&
+                (f[2] == ' ' || f[2] == '\0')) {
+            arg = va_arg(ap, char *);
+            size = (f[1] == 'b') ? va_arg(ap, size_t) : strlen(arg);
+            if ((newbuf = cdsmakeroom(c->obuf, REDIS_HEADER_MAX+size+2)) == NULL) goto oom;
+            c->obuf = newbuf;
+            n = encode_header(c->obuf+cdslen(c->obuf), '$', size);
+            memcpy(c->obuf+cdslen(c->obuf)+n, arg, size);
+            memcpy(c->obuf+cdslen(c->obuf)+n+size, "\r\n", 2);
+            cdsincrlen(c->obuf, n+size+2);
+            f += 2;
+            continue;
+        }
 
-    /* No need to check cmd since it is the last statement that can fail,
-     * but do it anyway to be as defensive as possible. */
-    if (cmd != NULL)
-        free(cmd);
+        if (!touched) {
+            /* reserve room for the header of the new argument */
+            if ((newbuf = cdsmakeroom(c->obuf, REDIS_HEADER_MAX)) == NULL) goto oom;
+            c->obuf = newbuf;
+            argstart = cdslen(c->obuf);
+            cdsincrlen(c->obuf, REDIS_HEADER_MAX);
+            touched = 1;
+        }
 
-    return -1;
-}
+        if (*f != '%' || spacedata || f[1] == '\0') {
+            /* a run of plain characters */
+            size = spacedata ? strcspn(f, "'") : 1+strcspn(f+1, " '%");
+            if ((newbuf = cdscatlen(c->obuf, f, size)) == NULL) goto oom;
+            c->obuf = newbuf;
+            f += size;
+            continue;
+        }
 
-static int redis_v_append_command(redis_context *c, const char *format, va_list ap) {
-    char *cmd;
-    int len;
-    cds newbuf;
+        switch (f[1]) {
+            case 's':
+                arg = va_arg(ap, char *);
+                size = strlen(arg);
+                break;
+            case 'b':
+                arg = va_arg(ap, char *);
+                size = va_arg(ap, size_t);
+                break;
+            case '%':
+                arg = "%";
+                size = 1;
+                break;
+            default:
+                arg = NULL;
+                size = 0;
+        }
+        if (arg) {
+            if (size > 0) {
+                if ((newbuf = cdscatlen(c->obuf, arg, size)) == NULL) goto oom;
+                c->obuf = newbuf;
+            }
+            f += 2;
+            continue;
+        }
 
-    len = redis_v_format_command(&cmd, format, ap); 
-    if (len == RET_ERR) {
-        goto err;
-    }
-    newbuf = cdscatlen(c->obuf, cmd, len);
-    if (newbuf == NULL) {
-        free(cmd);
-        goto err;
+        /* printf conversion */
+        {
+            const char *p;
+            int plain, conv, mod;
+            char num[21];
+
+            if ((p = format_conv(f, &mod, &plain)) == NULL)
+                goto badfmt;
+            conv = *p;
+            if (plain && (conv == 'd' || conv == 'i' || conv == 'u')) {
+                FORMAT_INT_ARG(ap, conv, mod, num, n);
+                if ((newbuf = cdscatlen(c->obuf, num, n)) == NULL) goto oom;
+                c->obuf = newbuf;
+            } else {
+                if (redis_cat_printf(c, f, p+1-f, ap) == RET_ERR) goto oom;
+                FORMAT_SKIP_ARG(ap, conv, mod);
+            }
+            f = p+1;
+        }
     }
+    if (touched && redis_end_format_arg(c, argstart) == RET_ERR) goto oom;
+
     c->pipe++;
-    c->obuf = newbuf;
-    free(cmd);
     return RET_OK;
-err:
+
+badfmt:
+    cdsrange(c->obuf, 0, oldlen);
+    redis_set_error(c, REDIS_ERR_OTHER, "invalid command format");
+    return RET_ERR;
+oom:
+    cdsrange(c->obuf, 0, oldlen);
     redis_set_error(c, REDIS_ERR_OMM, "out of memory");
     return RET_ERR;
 }
@@ -548,106 +888,571 @@ int redis_append_command(redis_context *c, const char *format, ...) {
     return ret; 
 }
 
-int redis_reader_feed(redis_reader *r, const char *buf, size_t len) {
-    cds newbuf;
+/* steps of a compiled command */
+#define REDIS_TPL_CONST 1   /* constant RESP bytes */
+#define REDIS_TPL_ARG 2     /* %s, %b or integer slot that is a whole argument */
+#define REDIS_TPL_BEGIN 3   /* start of an argument built from pieces */
+#define REDIS_TPL_LIT 4     /* literal piece of such an argument */
+#define REDIS_TPL_SLOT 5    /* conversion piece of such an argument */
+#define REDIS_TPL_END 6
 
-    /* Copy the provided buffer. */
-    if (buf != NULL && len >= 1) {
-        /* Destroy internal buffer when it is empty and is quite large. */
-        if (r->len == 0 && r->maxbuf != 0 && cdsavail(r->buf) > r->maxbuf) {
-            cdsfree(r->buf);
-            r->buf = cdsnew(NULL);
-            r->pos = 0;
-            if (r->buf == NULL) {
-                return RET_ERR;
-            }
-        }   
-        newbuf = cdscatlen(r->buf, buf, len);
-        if (newbuf == NULL) {
+static int tpl_add_op(redis_template *tpl, int type, int conv, int mod, size_t off, size_t len) {
+    redis_template_op *op;
+
+    if (tpl->nop == tpl->maxop) {
+        int max = tpl->maxop ? tpl->maxop*2 : 8;
+        if ((op = realloc(tpl->op, sizeof(redis_template_op)*max)) == NULL)
             return RET_ERR;
-        }
-        r->buf = newbuf;
-        r->len = cdslen(r->buf);
+        tpl->op = op;
+        tpl->maxop = max;
     }
+    op = &tpl->op[tpl->nop++];
+    op->type = type;
+    op->conv = conv;
+    op->mod = mod;
+    op->off = off;
+    op->len = len;
+    return RET_OK;
+}
 
+/* Turn the constant bytes appended to data since *constoff into one step. */
+static int tpl_flush_const(redis_template *tpl, size_t *constoff) {
+    size_t len = cdslen(tpl->data)-*constoff;
+
+    if (len > 0 && tpl_add_op(tpl, REDIS_TPL_CONST, 0, 0, *constoff, len) == RET_ERR)
+        return RET_ERR;
+    *constoff = cdslen(tpl->data);
     return RET_OK;
 }
 
-int redis_buffer_read(redis_context *c, redis_reader *r, int flag) {
-    char buf[1024*16];
-    int nread;
+/* Compile the argument made of npiece pieces, whose literal bytes and
+ * printf specs are held in lit. A fully literal argument is encoded into the
+ * constant run, a lone %s, %b or integer becomes a single slot, anything
+ * else is built at run time. */
+static int tpl_end_arg(redis_template *tpl, const redis_template_op *piece, int npiece,
+        const char *lit, size_t *constoff) {
+    char hdr[REDIS_HEADER_MAX];
+    cds newbuf;
+    int i;
 
-    do {
-        nread = read(c->fd,buf,sizeof(buf));
-        if (nread == -1) {
-            if ((errno == EAGAIN && !(c->flags & REDIS_BLOCK)) || (errno == EINTR)) {
-                /* Try again later */
-            } else {
-                if (flag)
-                    redis_reader_set_error(r, REDIS_ERR_IO, "errno=%d, errmsg=%s", __errno__, __errmsg__);
-                else
-                    redis_set_error(c, REDIS_ERR_IO, "errno=%d, errmsg=%s", __errno__, __errmsg__);
-                return RET_ERR;
-            }
-        } else if (nread == 0) {
-            if (flag)
-                redis_reader_set_error(r, REDIS_ERR_EOF, "Server closed the connection");
-            else
-                redis_set_error(c, REDIS_ERR_EOF, "Server closed the connection");
+    if (npiece == 0 || (npiece == 1 && piece[0].type == REDIS_TPL_LIT)) {
+        size_t len = npiece ? piece[0].len : 0;
+        if ((newbuf = cdscatlen(tpl->data, hdr, encode_header(hdr, '$', len))) == NULL)
             return RET_ERR;
-        } else {
-            if (redis_reader_feed(r, buf, nread) != RET_OK) {
-                if (flag)
-                    redis_reader_set_error(r, REDIS_ERR_OMM, "out of memory");
-                else
-                    redis_set_error(c, REDIS_ERR_OMM, "out of memory");
+        tpl->data = newbuf;
+        if ((newbuf = cdscatlen(tpl->data, lit, len)) == NULL)
+            return RET_ERR;
+        tpl->data = newbuf;
+        if ((newbuf = cdscatlen(tpl->data, "\r\n", 2)) == NULL)
+            return RET_ERR;
+        tpl->data = newbuf;
+        return RET_OK;
+    }
+
+    if (tpl_flush_const(tpl, constoff) == RET_ERR)
+        return RET_ERR;
+    if (npiece == 1 && piece[0].len == 0)
+        return tpl_add_op(tpl, REDIS_TPL_ARG, piece[0].conv, piece[0].mod, 0, 0);
+
+    if (tpl_add_op(tpl, REDIS_TPL_BEGIN, 0, 0, 0, 0) == RET_ERR)
+        return RET_ERR;
+    for (i = 0; i < npiece; i++) {
+        /* literal bytes and printf specs move to data */
+        size_t off = cdslen(tpl->data);
+        if (piece[i].len > 0) {
+            if ((newbuf = cdscatlen(tpl->data, lit+piece[i].off, piece[i].len)) == NULL)
                 return RET_ERR;
-            }
+            tpl->data = newbuf;
         }
-        //printf("%d, r->len=%d\n", nread, r->len);
-    } while (nread == sizeof(buf));
-
+        if (tpl_add_op(tpl, piece[i].type, piece[i].conv, piece[i].mod, off, piece[i].len) == RET_ERR)
+            return RET_ERR;
+    }
+    if (tpl_add_op(tpl, REDIS_TPL_END, 0, 0, 0, 0) == RET_ERR)
+        return RET_ERR;
+    *constoff = cdslen(tpl->data);
     return RET_OK;
 }
 
-int redis_buffer_write(redis_context *c) {
-    int nwritten, len, index = 0;
+/* Compile a redis_append_command() format once, so commands sent over and
+ * over with the same shape skip the format parsing. The multi bulk count and
+ * every constant argument are encoded ahead into runs of RESP bytes; only
+ * the slots are filled in by redis_append_template(). Returns NULL for an
+ * empty or invalid format or when out of memory. */
+redis_template *redis_compile_command(const char *format) {
+    redis_template *tpl;
+    redis_template_op *piece, *last;
+    const char *f = format, *p;
+    char hdr[REDIS_HEADER_MAX];
+    size_t constoff = 0, size;
+    int touched = 0, spacedata = 0, npiece = 0, argc, plain, mod;
+    cds lit = NULL, newbuf;
+
+    if ((argc = format_argc(format)) == 0)
+        return NULL;
+    if ((tpl = calloc(1, sizeof(redis_template))) == NULL)
+        return NULL;
+    tpl->argc = argc;
+    /* every piece takes at least one character of the format */
+    if ((piece = malloc(sizeof(redis_template_op)*(strlen(format)+1))) == NULL ||
+            (lit = cdsnew(NULL)) == NULL ||
+            (tpl->data = cdsnewlen(hdr, encode_header(hdr, '*', argc))) == NULL)
+        goto err;
 
-    len = cdslen(c->obuf);
-    do {
-        nwritten = write(c->fd, c->obuf+index, len-index);
-        if (nwritten == -1) {
-            if ((errno == EAGAIN && !(c->flags & REDIS_BLOCK)) || (errno == EINTR)) {
-                /* Try again later */
-            } else {
-                redis_set_error(c, REDIS_ERR_IO, "errno=%d, errmsg=%s", __errno__, __errmsg__);
-                return RET_ERR;
-            }
-        } else if (nwritten > 0) {
-            index += nwritten;
-            if (index == (signed)cdslen(c->obuf)) {
-                cdsclear(c->obuf);
-                break;
-            }
+    while (*f != '\0') {
+        if (*f == '\'') {
+            spacedata = !spacedata;
+            f++;
+            continue;
         }
-    } while (1);
+        if (*f == ' ' && !spacedata) {
+            if (touched && tpl_end_arg(tpl, piece, npiece, lit, &constoff) == RET_ERR)
+                goto err;
+            touched = 0;
+            npiece = 0;
+            cdsclear(lit);
+            f++;
+            continue;
+        }
+        touched = 1;
 
-    return RET_OK;
+        last = npiece ? &piece[npiece-1] : NULL;
+        if (*f != '%' || spacedata || f[1] == '\0' || f[1] == '%') {
+            /* a run of plain characters, merged with the previous one */
+            if (*f == '%' && f[1] == '%')
+                p = f+1, size = 1;
+            else
+                p = f, size = spacedata ? strcspn(f, "'") : 1+strcspn(f+1, " '%");
+            if (last == NULL || last->type != REDIS_TPL_LIT) {
+                last = &piece[npiece++];
+                last->type = REDIS_TPL_LIT;
+                last->conv = last->mod = 0;
+                last->off = cdslen(lit);
+                last->len = 0;
+            }
+            if ((newbuf = cdscatlen(lit, p, size)) == NULL) goto err;
+            lit = newbuf;
+            last->len += size;
+            f = p+size;
+            continue;
+        }
+
+        last = &piece[npiece++];
+        last->type = REDIS_TPL_SLOT;
+        last->off = last->len = 0;
+        if (f[1] == 's' || f[1] == 'b') {
+            last->conv = f[1];
+            last->mod = 0;
+            f += 2;
+            continue;
+        }
+        if ((p = format_conv(f, &mod, &plain)) == NULL)
+            goto err;
+        last->conv = *p;
+        last->mod = mod;
+        if (!plain || (*p != 'd' && *p != 'i' && *p != 'u')) {
+            /* keep the spec for vsnprintf */
+            last->off = cdslen(lit);
+            last->len = p+1-f;
+            if ((newbuf = cdscatlen(lit, f, last->len)) == NULL) goto err;
+            lit = newbuf;
+        }
+        f = p+1;
+    }
+    if (touched && tpl_end_arg(tpl, piece, npiece, lit, &constoff) == RET_ERR)
+        goto err;
+    if (tpl_flush_const(tpl, &constoff) == RET_ERR)
+        goto err;
+
+    free(piece);
+    cdsfree(lit);
+    return tpl;
+
+err:
+    free(piece);
+    if (lit) cdsfree(lit);
+    redis_free_template(tpl);
+    return NULL;
+}
+
+void redis_free_template(redis_template *tpl) {
+    if (tpl == NULL)
+        return;
+    if (tpl->data) cdsfree(tpl->data);
+    free(tpl->op);
+    free(tpl);
+}
+
+static int redis_v_append_template(redis_context *c, const redis_template *tpl, va_list ap) {
+    const redis_template_op *op, *end = tpl->op+tpl->nop;
+    size_t oldlen = cdslen(c->obuf), argstart = 0, size;
+    const char *arg;
+    char num[21];
+    cds newbuf;
+    int n;
+
+    if (redis_check_hwm(c) == RET_ERR)
+        return RET_ERR;
+    for (op = tpl->op; op < end; op++) {
+        switch (op->type) {
+            case REDIS_TPL_CONST:
+            case REDIS_TPL_LIT:
+                if ((newbuf = cdscatlen(c->obuf, tpl->data+op->off, op->len)) == NULL) goto oom;
+                c->obuf = newbuf;
+                continue;
+            case REDIS_TPL_BEGIN:
+                if ((newbuf = cdsmakeroom(c->obuf, REDIS_HEADER_MAX)) == NULL) goto oom;
+                c->obuf = newbuf;
+                argstart = cdslen(c->obuf);
+                cdsincrlen(c->obuf, REDIS_HEADER_MAX);
+                continue;
+            case REDIS_TPL_END:
+                if (redis_end_format_arg(c, argstart) == RET_ERR) goto oom;
+                continue;
+        }
+
+        if (op->len > 0) {
+            if (redis_cat_printf(c, tpl->data+op->off, op->len, ap) == RET_ERR) goto oom;
+            FORMAT_SKIP_ARG(ap, op->conv, op->mod);
+            continue;
+        }
+        if (op->conv == 's' || op->conv == 'b') {
+            arg = va_arg(ap, char *);
+            size = (op->conv == 'b') ? va_arg(ap, size_t) : strlen(arg);
+        } else {
+            FORMAT_INT_ARG(ap, op->conv, op->mod, num, n);
+            arg = num;
+            size = n;
+        }
+        if (op->type == REDIS_TPL_SLOT) {
+            if ((newbuf = cdscatlen(c->obuf, arg, size)) == NULL) goto oom;
+            c->obuf = newbuf;
+            continue;
+        }
+        if ((newbuf = cdsmakeroom(c->obuf, REDIS_HEADER_MAX+size+2)) == NULL) goto oom;
+        c->obuf = newbuf;
+        n = encode_header(c->obuf+cdslen(c->obuf), '$', size);
+        memcpy(c->obuf+cdslen(c->obuf)+n, arg, size);
+        memcpy(c->obuf+cdslen(c->obuf)+n+size, "\r\n", 2);
+        cdsincrlen(c->obuf, n+size+2);
+    }
+
+    c->pipe++;
+    return RET_OK;
+
+oom:
+    cdsrange(c->obuf, 0, oldlen);
+    redis_set_error(c, REDIS_ERR_OMM, "out of memory");
+    return RET_ERR;
+}
+
+/* Append a command compiled by redis_compile_command(), taking the same
+ * arguments its format would. */
+int redis_append_template(redis_context *c, const redis_template *tpl, ...) {
+    va_list ap;
+    int ret;
+
+    va_start(ap, tpl);
+    ret = redis_v_append_template(c, tpl, ap);
+    va_end(ap);
+    return ret;
+}
+
+/* Reclaim the bytes in front of pos that were already parsed, so a reader
+ * that never runs dry, like a busy subscriber, does not keep growing. In
+ * zero-copy mode the reply being built still points into its own bytes, so
+ * only what precedes it can go. The prefix is only moved out once it is as
+ * large as what is left, which keeps the cost amortized O(1) per byte. */
+static void redis_reader_compact(redis_reader *r) {
+    size_t keep = r->pos;
+
+    if ((r->flags & REDIS_READER_ZEROCOPY) && r->ridx >= 0)
+        keep = r->rstart;
+    if (keep == 0 || (keep < r->len && keep < r->len-keep))
+        return;
+    cdsrange(r->buf, keep, r->len);
+    r->len -= keep;
+    r->pos -= keep;
+    r->rstart = (r->rstart > keep) ? r->rstart-keep : 0;
+}
+
+/* Make room for len more bytes at the end of the buffer and return where
+ * they go. */
+static char *redis_reader_reserve(redis_reader *r, size_t len) {
+    cds newbuf;
+
+    redis_reader_compact(r);
+    /* Shrink internal buffer when it holds little and is quite large. */
+    if (r->maxbuf != 0 && cdsavail(r->buf) > r->maxbuf && 
+            cdsavail(r->buf) > r->readsize*2 && r->len < r->maxbuf) {
+        if ((newbuf = cdsnewlen(r->buf, r->len)) == NULL) {
+            return NULL;
+        }
+        cdsfree(r->buf);
+        r->buf = newbuf;
+    }   
+    if ((newbuf = cdsmakeroom(r->buf, len)) == NULL) {
+        return NULL;
+    }
+    r->buf = newbuf;
+    return r->buf+r->len;
+}
+
+/* Reference len bytes of caller memory at the current end of obuf. */
+static int redis_add_obuf_ref(redis_context *c, const char *data, size_t len) {
+    redis_obuf_ref *refs;
+
+    if (c->nref == c->maxref) {
+        int max = c->maxref ? c->maxref*2 : 8;
+        if ((refs = realloc(c->refs, sizeof(redis_obuf_ref)*max)) == NULL)
+            return RET_ERR;
+        c->refs = refs;
+        c->maxref = max;
+    }
+    c->refs[c->nref].pos = cdslen(c->obuf);
+    c->refs[c->nref].data = data;
+    c->refs[c->nref].len = len;
+    c->nref++;
+    return RET_OK;
+}
+
+/* Append a command given as argc arguments. argvlen may be NULL when all
+ * arguments are NUL terminated. The RESP headers are encoded straight into
+ * obuf. Arguments of at least REDIS_WRITEV_MIN_ARG bytes are not copied but
+ * written with writev() from the caller's memory, which therefore has to stay
+ * untouched until the command is written out by redis_exec_command(). */
+int redis_append_command_argv(redis_context *c, int argc, const char **argv, const size_t *argvlen) {
+    size_t oldlen = cdslen(c->obuf), len;
+    int oldnref = c->nref, j, n;
+    cds newbuf;
+
+    if (redis_check_hwm(c) == RET_ERR)
+        return RET_ERR;
+    if (argc <= 0) {
+        redis_set_error(c, REDIS_ERR_OTHER, "empty command");
+        return RET_ERR;
+    }
+    if ((newbuf = cdsmakeroom(c->obuf, REDIS_HEADER_MAX)) == NULL) goto err;
+    c->obuf = newbuf;
+    n = encode_header(c->obuf+cdslen(c->obuf), '*', argc);
+    cdsincrlen(c->obuf, n);
+    for (j = 0; j < argc; j++) {
+        len = argvlen ? argvlen[j] : strlen(argv[j]);
+        if (len >= REDIS_WRITEV_MIN_ARG) {
+            if ((newbuf = cdsmakeroom(c->obuf, REDIS_HEADER_MAX+2)) == NULL) goto err;
+            c->obuf = newbuf;
+            n = encode_header(c->obuf+cdslen(c->obuf), '$', len);
+            cdsincrlen(c->obuf, n);
+            if (redis_add_obuf_ref(c, argv[j], len) == RET_ERR) goto err;
+        } else {
+            if ((newbuf = cdsmakeroom(c->obuf, REDIS_HEADER_MAX+len+2)) == NULL) goto err;
+            c->obuf = newbuf;
+            n = encode_header(c->obuf+cdslen(c->obuf), '$', len);
+            memcpy(c->obuf+cdslen(c->obuf)+n, argv[j], len);
+            cdsincrlen(c->obuf, n+len);
+        }
+        memcpy(c->obuf+cdslen(c->obuf), "\r\n", 2);
+        cdsincrlen(c->obuf, 2);
+    }
+    c->pipe++;
+    return RET_OK;
+
+err:
+    cdsrange(c->obuf, 0, oldlen);
+    c->nref = oldnref;
+    redis_set_error(c, REDIS_ERR_OMM, "out of memory");
+    return RET_ERR;
+}
+
+int redis_reader_feed(redis_reader *r, const char *buf, size_t len) {
+    char *p;
+
+    /* Copy the provided buffer. */
+    if (buf != NULL && len >= 1) {
+        if ((p = redis_reader_reserve(r, len)) == NULL) {
+            return RET_ERR;
+        }
+        memcpy(p, buf, len);
+        cdsincrlen(r->buf, len);
+        r->len += len;
+    }
+
+    return RET_OK;
+}
+
+/* How much to read next: the adaptive read size, or the rest of a pending
+ * bulk when that is known to be larger. */
+static size_t redis_reader_want(redis_reader *r) {
+    size_t want = r->readsize;
+
+    if (r->bulklen >= 0 && (size_t)r->bulklen+2 > r->len-r->pos &&
+            (size_t)r->bulklen+2-(r->len-r->pos) > want)
+        want = r->bulklen+2-(r->len-r->pos);
+    return want;
+}
+
+/* Read straight into the reader buffer. As long as a read fills the room
+ * asked for, FIONREAD tells how much more the socket holds, so it is drained
+ * in as few reads as possible and a blocking socket never waits for data
+ * that is not there. The read size doubles while reads come back full and
+ * halves while they come back mostly empty. */
+int redis_buffer_read(redis_context *c, redis_reader *r, int flag) {
+    char *p;
+    size_t want = redis_reader_want(r);
+    int nread, avail;
+
+    do {
+        if ((p = redis_reader_reserve(r, want)) == NULL) {
+            if (flag)
+                redis_reader_set_error(r, REDIS_ERR_OMM, "out of memory");
+            else
+                redis_set_error(c, REDIS_ERR_OMM, "out of memory");
+            return RET_ERR;
+        }
+        nread = read(c->fd, p, want);
+        if (nread == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN && !(c->flags & REDIS_BLOCK)) {
+                /* Try again later */
+                break;
+            } else {
+                if (flag)
+                    redis_reader_set_error(r, REDIS_ERR_IO, "errno=%d, errmsg=%s", __errno__, __errmsg__);
+                else
+                    redis_set_error(c, REDIS_ERR_IO, "errno=%d, errmsg=%s", __errno__, __errmsg__);
+                return RET_ERR;
+            }
+        } else if (nread == 0) {
+            if (flag)
+                redis_reader_set_error(r, REDIS_ERR_EOF, "Server closed the connection");
+            else
+                redis_set_error(c, REDIS_ERR_EOF, "Server closed the connection");
+            return RET_ERR;
+        }
+        cdsincrlen(r->buf, nread);
+        r->len += nread;
+
+        if ((size_t)nread < want) {
+            if ((size_t)nread < r->readsize/4 && r->readsize > REDIS_READER_READ_SIZE)
+                r->readsize /= 2;
+            break;
+        }
+        if (r->readsize < REDIS_READER_MAX_READ)
+            r->readsize *= 2;
+        if (ioctl(c->fd, FIONREAD, &avail) == -1 || avail <= 0)
+            break;
+        want = (size_t)avail > r->readsize ? (size_t)avail : r->readsize;
+    } while (1);
+
+    return RET_OK;
+}
+
+/* Fill iov with what is left to write once skip bytes went out: obuf with
+ * the referenced caller buffers spliced in. Returns the number of entries. */
+static int redis_build_iov(redis_context *c, struct iovec *iov, int max, size_t skip) {
+    size_t from = 0, to, len;
+    int i, n = 0;
+
+    for (i = 0; i <= c->nref && n < max; i++) {
+        /* the obuf bytes before ref i, then the ref itself */
+        to = (i < c->nref) ? c->refs[i].pos : cdslen(c->obuf);
+        len = to-from;
+        if (skip >= len) {
+            skip -= len;
+        } else {
+            iov[n].iov_base = c->obuf+from+skip;
+            iov[n].iov_len = len-skip;
+            skip = 0;
+            n++;
+        }
+        if (i == c->nref || n == max) break;
+        len = c->refs[i].len;
+        if (skip >= len) {
+            skip -= len;
+        } else {
+            iov[n].iov_base = (char *)c->refs[i].data+skip;
+            iov[n].iov_len = len-skip;
+            skip = 0;
+            n++;
+        }
+        from = to;
+    }
+    return n;
+}
+
+static size_t redis_iov_total(struct iovec *iov, int n) {
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        total += iov[i].iov_len;
+    return total;
+}
+
+/* Write the pending output from wpos on. Returns RET_OK once all of it is
+ * written, or RET_CONTINUE when a non-blocking socket takes no more; the
+ * next call resumes where this one stopped. */
+int redis_buffer_write(redis_context *c) {
+    struct iovec iov[REDIS_MAX_IOV];
+    size_t len;
+    ssize_t nwritten;
+    int n;
+
+    len = redis_obuf_total(c);
+    while (c->wpos < len) {
+        if (c->nref == 0) {
+            nwritten = write(c->fd, c->obuf+c->wpos, len-c->wpos);
+        } else {
+            n = redis_build_iov(c, iov, REDIS_MAX_IOV, c->wpos);
+#ifdef MSG_MORE
+            if (n == REDIS_MAX_IOV && redis_iov_total(iov, n) < len-c->wpos) {
+                /* more follows, do not let the kernel push a short segment */
+                struct msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = iov;
+                msg.msg_iovlen = n;
+                nwritten = sendmsg(c->fd, &msg, MSG_MORE);
+            } else
+#endif
+            nwritten = writev(c->fd, iov, n);
+        }
+        if (nwritten == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN && !(c->flags & REDIS_BLOCK)) {
+                /* Try again when writable, dropping what went out if that
+                 * is the larger part so obuf does not keep growing. */
+                if (c->nref == 0 && c->wpos >= len-c->wpos) {
+                    cdsrange(c->obuf, c->wpos, len);
+                    c->wpos = 0;
+                }
+                return RET_CONTINUE;
+            }
+            redis_set_error(c, REDIS_ERR_IO, "errno=%d, errmsg=%s", __errno__, __errmsg__);
+            return RET_ERR;
+        }
+        c->wpos += nwritten;
+    }
+    cdsclear(c->obuf);
+    c->nref = 0;
+    c->wpos = 0;
+
+    return RET_OK;
 }
 
-/* exec redis command */
+/* exec redis command. A non-blocking context writes what the socket takes
+ * and keeps the rest pending, see redis_async_exec_command(). */
 int _redis_exec_command(redis_context *c, redis_reader *r) {
     if (c->err) c->err = c->errstr[0] = 0;
-    if (cdslen(c->obuf) <= 0)
+    if (redis_write_pending(c) == 0)
         return RET_ERR;
 
-    if (c->flags & REDIS_BLOCK) {
-        if (redis_buffer_write(c) == RET_ERR)
-            goto err;
+    if (redis_buffer_write(c) == RET_ERR)
+        goto err;
+    if (c->flags & REDIS_BLOCK)
         redis_clear_reader(r);
-    }
     r->c = c;
-    redis_clear_writer(c);
+    c->pipe = -1;
     return RET_OK;
 
 err:
@@ -669,7 +1474,7 @@ int _redis_get_return_number(redis_reader *r) {
     for (i = 0; i < len;) {
         switch (p[i]) {
             case '$':
-                strlen = read_longlong(p+i+1);
+                strlen = read_line_longlong(p+i+1, len-i-1);
                 if (strlen > 0) i += strlen+3;
             case '+':
             case ':':
@@ -681,7 +1486,7 @@ int _redis_get_return_number(redis_reader *r) {
                 i += 2;
                 break;
             case '*':
-                multi = read_longlong(p+i+1);
+                multi = read_line_longlong(p+i+1, len-i-1);
                 rows++;
                 i += 2;
                 break;
@@ -690,361 +1495,2543 @@ int _redis_get_return_number(redis_reader *r) {
                 break;
         }
     }
-    return rows;    
+    return rows;    
+}
+
+int redis_get_return_number(redis_reader *r) {
+    return _redis_get_return_number(r);
+}
+
+/* Parse the payload of a bulk whose length line was already consumed. */
+static int process_bulk_payload(redis_reader *r, redis_reply *reply) {
+    char *p;
+    long len = r->bulklen;
+
+    if ((long)(r->len-r->pos) < len+2)
+        return RET_CONTINUE;
+    p = r->buf+r->pos;
+    r->pos += len+2;
+    r->bulklen = -1;
+    return set_reply_str(r, reply, p, len);
+}
+
+/* Parse the type byte and the header line of one item. Nothing is consumed
+ * until the whole line is buffered, so the item can be retried as is once
+ * more data arrives; only a bulk payload is left pending in r->bulklen. */
+static int process_item(redis_reader *r, redis_reply *reply) {
+    char *p;
+    long len;
+    long long v;
+    size_t start = r->pos;
+    int type;
+
+    if (r->bulklen >= 0)
+        return process_bulk_payload(r, reply);
+    if ((p = read_bytes(r,1)) == NULL)
+        return RET_CONTINUE;
+    switch (p[0]) {
+        case '-': 
+            type = REDIS_REPLY_ERROR;
+            break;
+        case '+':
+            type = REDIS_REPLY_STATUS;
+            break;
+        case ':':
+            type = REDIS_REPLY_INTEGER;
+            break;
+        case '$':
+            type = REDIS_REPLY_STRING;
+            break;
+        case '*':
+            type = REDIS_REPLY_ARRAY;
+            break;
+        default:
+            redis_reader_set_error(r, REDIS_ERR_PROTOCOL, "protocol error, unkown type");
+            return RET_ERR;
+    }
+    if ((p = read_line(r, &len)) == NULL) {
+        r->pos = start;
+        return RET_CONTINUE;
+    }
+
+    reply->type = type;
+    switch (type) {
+        case REDIS_REPLY_ERROR:
+        case REDIS_REPLY_STATUS:
+            return set_reply_str(r, reply, p, len);
+        case REDIS_REPLY_INTEGER:
+            if (read_longlong(p, len, &reply->integer) == RET_ERR)
+                goto badnum;
+            return RET_OK;
+        case REDIS_REPLY_STRING:
+            if (read_longlong(p, len, &v) == RET_ERR)
+                goto badnum;
+            if (v < 0) {
+                reply->type = REDIS_REPLY_NIL;
+                return RET_OK;
+            }
+            r->bulklen = v;
+            return process_bulk_payload(r, reply);
+        default:
+            if (read_longlong(p, len, &v) == RET_ERR)
+                goto badnum;
+            if (v < 0) {
+                reply->type = REDIS_REPLY_NIL;
+                return RET_OK;
+            }
+            reply->elements = v;
+            if (v > 0 && (reply->element = create_reply(r, v)) == NULL)
+                return RET_ERR;
+            return RET_OK;
+    }
+
+badnum:
+    redis_reader_set_error(r, REDIS_ERR_PROTOCOL, "protocol error, bad integer");
+    return RET_ERR;
+}
+
+/* Resumable parser: the reply tree being built and the position in it are
+ * kept in r->task, so when the buffer runs dry NULL is returned without any
+ * I/O and the next call continues where this one stopped. The whole tree
+ * lives in the reader arena, so the reply returned last time is dropped in
+ * one go before the next one is started. */
+static redis_reply *redis_parse_message(redis_reader *r) {
+    redis_read_task *task;
+    redis_reply *reply;
+    int ret;
+
+    if (r->ridx < 0) {
+        if (r->pos >= r->len) {
+            redis_reader_set_error(r, REDIS_ERR_EOF, "no data"); 
+            return NULL;
+        }
+        arena_reset(r);
+        r->reply = NULL;
+        if ((reply = create_reply(r, 1)) == NULL)
+            return NULL;
+        r->task[0].reply = reply;
+        r->task[0].idx = 0;
+        r->ridx = 0;
+        r->rstart = r->pos;
+    }
+
+    while (r->ridx >= 0) {
+        task = &r->task[r->ridx];
+        reply = task->reply;
+        if (reply->type == 0 || r->bulklen >= 0) {
+            if ((ret = process_item(r, reply)) == RET_CONTINUE)
+                return NULL;
+            if (ret == RET_ERR)
+                goto err;
+        }
+        if (reply->type == REDIS_REPLY_ARRAY && task->idx < reply->elements) {
+            if (r->ridx+1 >= REDIS_READER_MAX_DEPTH) {
+                redis_reader_set_error(r, REDIS_ERR_PROTOCOL, "protocol error, nested multi bulk too deep");
+                goto err;
+            }
+            r->task[r->ridx+1].reply = &reply->element[task->idx++];
+            r->task[r->ridx+1].idx = 0;
+            r->ridx++;
+        } else {
+            r->ridx--;
+        }
+    }
+
+    reply = r->task[0].reply;
+    if (r->flags & REDIS_READER_ZEROCOPY)
+        resolve_views(r, reply);
+    r->reply = reply;
+    return reply;
+
+err:
+    r->ridx = -1;
+    r->bulklen = -1;
+    return NULL;
+}
+
+/* A blocking context keeps reading until the reply is complete, otherwise
+ * NULL with r->err unset means the reply is not complete yet. */
+redis_reply *redis_get_reply(redis_reader *r) {
+    redis_reply *reply;
+
+    if (r == NULL) return NULL;
+    if (r->err) r->err = r->errstr[0] = 0;
+    if (!r->readcount && r->c) {
+        if (redis_buffer_read(r->c, r, 0) == RET_ERR)
+            return NULL;
+        r->readcount++;
+    }
+    while ((reply = redis_parse_message(r)) == NULL) {
+        if (r->err || r->ridx < 0 || !r->c || !(r->c->flags & REDIS_BLOCK))
+            return NULL;
+        if (redis_buffer_read(r->c, r, 1) == RET_ERR) {
+            r->ridx = -1;
+            r->bulklen = -1;
+            return NULL;
+        }
+        r->readcount++;
+    }
+    return reply;
+}
+
+static int redis_auth(char *errstr, redis_context *c, redis_reader *r, char *pass) {
+    int ret;
+    redis_reply *reply;
+
+    redis_append_command(c, "auth %s", pass);
+    ret = redis_exec_command(c, r);
+    if (ret == -1) {
+        if (errstr && c->err) strcpy(errstr, c->errstr);
+        return 0;
+    }
+    reply = redis_get_reply(r);
+    if (reply == NULL) {
+        /* the first read reports to the context */
+        if (errstr) strcpy(errstr, r->err ? r->errstr : c->errstr);
+        return 0;
+    }
+    if (reply->type == REDIS_REPLY_STATUS && reply->len && strcmp(reply->str, "OK") == 0) {
+        //auth ok           
+    } else {
+        if (errstr) strcpy(errstr, "redis auth failed"); 
+        return 0;
+    }
+    return 1;
+}
+
+static void redis_async_before_sleep(struct st_event_loop *el, void *clientdata);
+static void redis_async_schedule_reconnect(redis_async_context *ac);
+
+/* path set: connect through a unix socket, ip and port are ignored */
+/* Make an async context of c, connected and authenticated, and its reader
+ * r, which it owns from then on even when this fails. It runs on el, or on
+ * a loop of its own when el is NULL. */
+static redis_async_context *redis_async_adopt(char *errstr, st_event_loop *el, redis_context *c,
+        redis_reader *r, char *ip, int port, char *path, char *pass) {
+    redis_async_context *ac;    
+
+    if ((ac = calloc(1, sizeof(redis_async_context))) == NULL) {
+        strcpy(errstr, "malloc failed");
+        redis_free(c);
+        redis_free_reader(r);
+        return NULL;
+    }
+    ac->flush_timer = ac->reconnect_timer = ac->connect_timer = -1;
+    ac->backoff = REDIS_RECONNECT_MIN;
+    ac->seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)ac;
+    ac->c = c;
+    ac->r = r;
+    if ((ac->el = el) == NULL) {
+        ac->el = cel_create_event_loop(10);
+        ac->own_el = 1;
+    }
+    ac->flush = malloc(sizeof(st_el_hook));
+    if (!ac->el || !ac->flush) {
+        strcpy(errstr, "malloc failed");
+        redis_async_free(ac);
+        return NULL;
+    }
+    if (pass)
+        strcpy(ac->passwd, pass);
+    cel_init_hook(ac->flush, redis_async_before_sleep, ac);
+    if (path) {
+        strcpy(ac->path, path);
+    } else {
+        ac->port = port;
+        strcpy(ac->ip, ip);
+    }
+    ac->status = 1;
+    return ac;
+}
+
+static redis_async_context *_redis_async_connect(char *errstr, char *ip, int port, char *path, char *pass) {
+    redis_context *c;
+    redis_reader *r;
+
+    r = redis_create_reader(); 
+    if (path)
+        c = redis_connect_unix_with_timeout(path, 5*1000);
+    else
+        c = redis_connect_with_timeout(ip, port, 5*1000); 
+    if (!r || !c) {
+        strcpy(errstr, "malloc failed");
+        goto err;
+    }
+    if (c->err) {
+        strcpy(errstr, c->errstr);
+        goto err;
+    }
+    if (pass && !redis_auth(errstr, c, r, pass))
+        goto err;
+    return redis_async_adopt(errstr, NULL, c, r, ip, port, path, pass);
+
+err:
+    redis_free(c);
+    redis_free_reader(r);
+    return NULL;
+}
+
+redis_async_context* redis_async_connect(char *errstr, char *ip, int port, char *pass) {
+    return _redis_async_connect(errstr, ip, port, NULL, pass);
+}
+
+redis_async_context* redis_async_connect_unix(char *errstr, char *path, char *pass) {
+    return _redis_async_connect(errstr, NULL, 0, path, pass);
+}
+
+/* Complete every callback still waiting with a NULL reply. */
+static void redis_async_fail_callbacks(redis_async_context *ac) {
+    redis_async_callback cb;
+
+    while (ac->cbcount > 0) {
+        cb = ac->cb[ac->cbhead];
+        ac->cbhead = (ac->cbhead+1) % ac->cbsize;
+        ac->cbcount--;
+        if (cb.fn) cb.fn(ac, NULL, cb.privdata);
+    }
+}
+
+void redis_async_free(redis_async_context *ac) {
+    if (!ac) return;
+    redis_async_fail_callbacks(ac);
+    free(ac->cb);
+    if (ac->el) {
+        /* leave a shared loop as if ac had never been there */
+        if (ac->flush) cel_cancel_hook(ac->el, ac->flush);
+        if (ac->flush_timer != -1) cel_del_timer_event(ac->el, ac->flush_timer);
+        if (ac->reconnect_timer != -1) cel_del_timer_event(ac->el, ac->reconnect_timer);
+        if (ac->connect_timer != -1) cel_del_timer_event(ac->el, ac->connect_timer);
+        if (ac->c && ac->c->fd > 0) cel_del_file_event(ac->el, ac->c->fd, EL_READABLE|EL_WRITABLE);
+        if (ac->own_el) cel_delete_event_loop(ac->el);
+    }
+    free(ac->flush);
+    if (ac->r) redis_free_reader(ac->r);
+    if (ac->c) redis_free(ac->c);    
+    free(ac);
+}
+
+void redis_async_set_read_callback(redis_async_context *ac, redis_callback_function *fn) {
+    ac->fn_read = fn; 
+}
+
+void redis_async_set_reconnect_callback(redis_async_context *ac, redis_callback_function *fn) {
+    ac->fn_reconnect = fn; 
+}
+
+static void redis_async_read_event(struct st_event_loop *el, int fd, void *clientdata, int mask) {
+    redis_async_context *ac = (redis_async_context *)clientdata;
+    redis_async_callback cb;
+    redis_reply *reply;
+
+    NOMORE(mask);
+    /* fn_read drains with redis_get_reply until it finds no data, which
+     * leaves an EOF behind; only a protocol error means the stream is bad */
+    if (ac->r->err == REDIS_ERR_EOF)
+        ac->r->err = ac->r->errstr[0] = 0;
+    else if (ac->r->err)
+        goto lost;
+    /* keep whatever belongs to a reply that is not complete yet */
+    ac->r->readcount = 1;
+    if (redis_buffer_read(ac->c, ac->r, 0) == RET_ERR)
+        goto lost;
+
+    /* replies come back in the order the commands went out */
+    while (ac->cbcount > 0 && ac->r->pos < ac->r->len &&
+            (reply = redis_get_reply(ac->r)) != NULL) {
+        cb = ac->cb[ac->cbhead];
+        ac->cbhead = (ac->cbhead+1) % ac->cbsize;
+        ac->cbcount--;
+        if (cb.fn) cb.fn(ac, reply, cb.privdata);
+    }
+    if (ac->r->err)
+        goto lost;
+    if (ac->fn_read && ac->cbcount == 0) ac->fn_read(ac);
+    return;
+
+lost:
+    ac->status = 0;
+    cel_del_file_event(el, fd, EL_READABLE|EL_WRITABLE);
+    /* output half written to the lost connection is useless */
+    redis_clear_writer(ac->c);
+    redis_clear_reader(ac->r);
+    redis_async_fail_callbacks(ac);
+    redis_async_schedule_reconnect(ac);
+}
+
+static void redis_async_write_event(struct st_event_loop *el, int fd, void *clientdata, int mask) {
+    redis_async_context *ac = (redis_async_context *)clientdata;
+
+    NOMORE(mask);
+    switch (redis_buffer_write(ac->c)) {
+        case RET_CONTINUE:
+            return;
+        case RET_ERR:
+            /* the read event notices a lost connection */
+            redis_clear_writer(ac->c);
+            break;
+    }
+    cel_del_file_event(el, fd, EL_WRITABLE);
+}
+
+/* Write out the pending output, leaving what the socket does not take to
+ * the write event. */
+static void redis_async_flush(redis_async_context *ac) {
+    redis_context *c = ac->c;
+
+    if (cel_get_file_event(ac->el, c->fd) & EL_WRITABLE)
+        return;
+    switch (redis_buffer_write(c)) {
+        case RET_CONTINUE:
+            if (cel_add_file_event(ac->el, c->fd, EL_WRITABLE, redis_async_write_event, ac) == EL_ERR)
+                redis_set_error(c, REDIS_ERR_OTHER, "add write event failed");
+            break;
+        case RET_ERR:
+            /* the read event notices a lost connection */
+            redis_clear_writer(c);
+            break;
+    }
+}
+
+static int redis_async_flush_timer(struct st_event_loop *el, int id, void *clientdata) {
+    redis_async_context *ac = (redis_async_context *)clientdata;
+
+    NOMORE(el);
+    NOMORE(id);
+    ac->flush_timer = -1;
+    redis_async_flush(ac);
+    return EL_NOMORE;
+}
+
+/* Runs once per loop iteration in which commands were appended, right
+ * before the loop polls, so they all go out with a single write. With a
+ * flush delay a small batch is held back until the delay timer fires. */
+static void redis_async_before_sleep(struct st_event_loop *el, void *clientdata) {
+    redis_async_context *ac = (redis_async_context *)clientdata;
+
+    if (ac->flush_delay > 0 && redis_write_pending(ac->c) < REDIS_FLUSH_BATCH) {
+        if (ac->flush_timer == -1)
+            ac->flush_timer = cel_add_timer_event(el, ac->flush_delay, redis_async_flush_timer, ac);
+        /* without a timer the batch goes out now */
+        if (ac->flush_timer != -1)
+            return;
+    } else if (ac->flush_timer != -1) {
+        cel_del_timer_event(el, ac->flush_timer);
+        ac->flush_timer = -1;
+    }
+    redis_async_flush(ac);
+}
+
+/* Let a batch smaller than REDIS_FLUSH_BATCH wait up to milliseconds for
+ * more commands before it is written. 0, the default, writes every loop
+ * iteration. */
+void redis_async_set_flush_delay(redis_async_context *ac, int milliseconds) {
+    ac->flush_delay = milliseconds > 0 ? milliseconds : 0;
+}
+
+/* Send the appended commands. Once the context runs in its event loop they
+ * are only written before the loop polls again, so every command appended
+ * in one iteration shares one write; what the socket does not take then is
+ * written as it drains. */
+int redis_async_exec_command(redis_async_context *ac) {
+    redis_context *c = ac->c;
+
+    if (c->flags & REDIS_BLOCK)
+        return redis_exec_command(c, ac->r);
+    if (c->err) c->err = c->errstr[0] = 0;
+    if (redis_write_pending(c) == 0)
+        return RET_ERR;
+    ac->r->c = c;
+    c->pipe = -1;
+    cel_schedule_hook(ac->el, ac->flush);
+    return RET_OK;
+}
+
+static int redis_async_push_callback(redis_async_context *ac, redis_reply_callback *fn, void *privdata) {
+    redis_async_callback *cb;
+    int i, size;
+
+    if (ac->cbcount == ac->cbsize) {
+        /* grow the ring, unwrapping it at the front of the new one */
+        size = ac->cbsize ? ac->cbsize*2 : 16;
+        if ((cb = malloc(sizeof(redis_async_callback)*size)) == NULL)
+            return RET_ERR;
+        for (i = 0; i < ac->cbcount; i++)
+            cb[i] = ac->cb[(ac->cbhead+i) % ac->cbsize];
+        free(ac->cb);
+        ac->cb = cb;
+        ac->cbhead = 0;
+        ac->cbsize = size;
+    }
+    cb = &ac->cb[(ac->cbhead+ac->cbcount) % ac->cbsize];
+    cb->fn = fn;
+    cb->privdata = privdata;
+    ac->cbcount++;
+    return RET_OK;
+}
+
+/* Send a command whose reply is handed to fn once it arrived. Callbacks are
+ * completed in the order their commands were sent, so any number of them
+ * can be in flight on the connection. The reply belongs to the reader and
+ * is only valid until fn returns. */
+int redis_async_command(redis_async_context *ac, redis_reply_callback *fn, void *privdata, const char *format, ...) {
+    redis_context *c = ac->c;
+    va_list ap;
+    int ret;
+
+    if (!ac->status) {
+        redis_set_error(c, REDIS_ERR_IO, "not connected");
+        return RET_ERR;
+    }
+    if (redis_async_push_callback(ac, fn, privdata) == RET_ERR) {
+        redis_set_error(c, REDIS_ERR_OMM, "out of memory");
+        return RET_ERR;
+    }
+    va_start(ap, format);
+    ret = redis_v_append_command(c, format, ap);
+    va_end(ap);
+    if (ret == RET_ERR || redis_async_exec_command(ac) == RET_ERR) {
+        ac->cbcount--;
+        return RET_ERR;
+    }
+    return RET_OK;
+}
+
+/* Give up on the attempt in progress and wait for the next one. */
+static void redis_async_connect_failed(redis_async_context *ac) {
+    redis_context *c = ac->c;
+
+    if (ac->connect_timer != -1) {
+        cel_del_timer_event(ac->el, ac->connect_timer);
+        ac->connect_timer = -1;
+    }
+    if (c->fd > 0) {
+        cel_del_file_event(ac->el, c->fd, EL_READABLE|EL_WRITABLE);
+        close(c->fd);
+        c->fd = -1;
+    }
+    redis_clear_writer(c);
+    redis_clear_reader(ac->r);
+    ac->connecting = REDIS_CONN_IDLE;
+    redis_async_schedule_reconnect(ac);
+}
+
+static void redis_async_connected(redis_async_context *ac) {
+    if (ac->connect_timer != -1) {
+        cel_del_timer_event(ac->el, ac->connect_timer);
+        ac->connect_timer = -1;
+    }
+    redis_clear_reader(ac->r);
+    if (cel_add_file_event(ac->el, ac->c->fd, EL_READABLE, redis_async_read_event, ac) == EL_ERR) {
+        redis_async_connect_failed(ac);
+        return;
+    }
+    ac->connecting = REDIS_CONN_IDLE;
+    ac->backoff = REDIS_RECONNECT_MIN;
+    ac->status = 1;
+    /* commands issued here go out with the next flush */
+    if (ac->fn_reconnect) ac->fn_reconnect(ac);
+}
+
+static void redis_async_auth_event(struct st_event_loop *el, int fd, void *clientdata, int mask) {
+    redis_async_context *ac = (redis_async_context *)clientdata;
+    redis_reply *reply;
+
+    NOMORE(el);
+    NOMORE(fd);
+    NOMORE(mask);
+    if (redis_buffer_read(ac->c, ac->r, 0) == RET_ERR) {
+        redis_async_connect_failed(ac);
+        return;
+    }
+    if ((reply = redis_get_reply(ac->r)) == NULL) {
+        if (ac->r->err) redis_async_connect_failed(ac);
+        return;
+    }
+    if (reply->type != REDIS_REPLY_STATUS || reply->len != 2 || strcmp(reply->str, "OK") != 0) {
+        redis_set_error(ac->c, REDIS_ERR_OTHER, "redis auth failed");
+        redis_async_connect_failed(ac);
+        return;
+    }
+    redis_async_connected(ac);
+}
+
+/* The socket turned writable: the connect is done, one way or the other. */
+static void redis_async_connect_event(struct st_event_loop *el, int fd, void *clientdata, int mask) {
+    redis_async_context *ac = (redis_async_context *)clientdata;
+    redis_context *c = ac->c;
+
+    NOMORE(mask);
+    cel_del_file_event(el, fd, EL_WRITABLE);
+    if (csocket_get_error(c->errstr, fd) == RET_ERR) {
+        c->err = REDIS_ERR_IO;
+        redis_async_connect_failed(ac);
+        return;
+    }
+    if (!ac->passwd[0]) {
+        redis_async_connected(ac);
+        return;
+    }
+    ac->connecting = REDIS_CONN_AUTH;
+    if (redis_append_command(c, "auth %s", ac->passwd) == RET_ERR ||
+            cel_add_file_event(el, fd, EL_READABLE, redis_async_auth_event, ac) == EL_ERR) {
+        redis_async_connect_failed(ac);
+        return;
+    }
+    switch (redis_buffer_write(c)) {
+        case RET_CONTINUE:
+            if (cel_add_file_event(el, fd, EL_WRITABLE, redis_async_write_event, ac) == EL_ERR)
+                redis_async_connect_failed(ac);
+            break;
+        case RET_ERR:
+            redis_async_connect_failed(ac);
+            break;
+    }
+}
+
+static int redis_async_connect_timeout(struct st_event_loop *el, int id, void *clientdata) {
+    redis_async_context *ac = (redis_async_context *)clientdata;
+
+    NOMORE(el);
+    NOMORE(id);
+    ac->connect_timer = -1;
+    redis_set_error(ac->c, REDIS_ERR_IO, "connect timeout");
+    redis_async_connect_failed(ac);
+    return EL_NOMORE;
+}
+
+/* Start connecting without blocking the loop; the connect, auth and the
+ * reconnect callback all follow from events. */
+static int redis_async_reconnect(struct st_event_loop *el, int id, void *clientdata) {
+    redis_async_context *ac = (redis_async_context *)clientdata;
+    redis_context *c = ac->c;
+
+    NOMORE(id);
+    ac->reconnect_timer = -1;
+    if (c->fd > 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    ac->connecting = REDIS_CONN_CONNECT;
+    if (ac->path[0])
+        c->fd = csocket_unix_connect_nonblock(c->errstr, ac->path);
+    else
+        c->fd = csocket_tcp_connect_nonblock(c->errstr, ac->ip, ac->port);
+    if (c->fd == RET_ERR) {
+        c->err = REDIS_ERR_IO;
+        redis_async_connect_failed(ac);
+        return EL_NOMORE;
+    }
+    c->flags &= ~REDIS_BLOCK;
+    if (cel_add_file_event(el, c->fd, EL_WRITABLE, redis_async_connect_event, ac) == EL_ERR) {
+        redis_async_connect_failed(ac);
+        return EL_NOMORE;
+    }
+    ac->connect_timer = cel_add_timer_event(el, REDIS_CONNECT_TIMEOUT, redis_async_connect_timeout, ac);
+    return EL_NOMORE;
+}
+
+/* Arm the next attempt after a random delay between half and all of the
+ * backoff, which doubles up to REDIS_RECONNECT_MAX, so the contexts that
+ * lost one server do not all come back at the same instant. */
+static void redis_async_schedule_reconnect(redis_async_context *ac) {
+    int delay;
+
+    if (ac->reconnect_timer != -1)
+        return;
+    ac->seed = ac->seed*1103515245+12345;
+    delay = ac->backoff/2 + (int)((ac->seed >> 16) % (unsigned int)(ac->backoff/2+1));
+    ac->backoff = ac->backoff < REDIS_RECONNECT_MAX/2 ? ac->backoff*2 : REDIS_RECONNECT_MAX;
+    ac->reconnect_timer = cel_add_timer_event(ac->el, delay, redis_async_reconnect, ac);
+}
+
+/* Let ac be driven by el, a loop the caller runs and that may host any
+ * number of contexts, instead of the one ac was created with. Call it
+ * instead of redis_async_run(). */
+int redis_async_attach(redis_async_context *ac, struct st_event_loop *el) {
+    if (ac->el != el) {
+        if (ac->own_el) cel_delete_event_loop(ac->el);
+        ac->el = el;
+        ac->own_el = 0;
+    }
+    if (redis_set_nonblock(ac->c) == RET_ERR)
+        return RET_ERR;
+    if (cel_add_file_event(el, ac->c->fd, EL_READABLE, redis_async_read_event, ac) == EL_ERR) {
+        redis_set_error(ac->c, REDIS_ERR_OTHER, "add read event failed");
+        return RET_ERR;
+    }
+    return RET_OK;
+}
+
+void redis_async_run(redis_async_context *ac) {
+    if (redis_async_attach(ac, ac->el) == RET_ERR) return;
+    cel_main(ac->el);    
+}
+
+static void reply_copy_size(const redis_reply *reply, size_t *nreply, size_t *nchar) {
+    size_t i;
+
+    if (reply->str) *nchar += reply->len+1;
+    if (reply->type == REDIS_REPLY_ARRAY) {
+        *nreply += reply->elements;
+        for (i = 0; i < reply->elements; i++)
+            reply_copy_size(&reply->element[i], nreply, nchar);
+    }
+}
+
+static void reply_copy(redis_reply *dst, const redis_reply *src, redis_reply **rp, char **cp) {
+    size_t i;
+
+    *dst = *src;
+    if (src->str) {
+        dst->str = *cp;
+        memcpy(dst->str, src->str, src->len);
+        dst->str[src->len] = '\0';
+        *cp += src->len+1;
+    }
+    if (src->type == REDIS_REPLY_ARRAY && src->elements) {
+        dst->element = *rp;
+        *rp += src->elements;
+        for (i = 0; i < src->elements; i++)
+            reply_copy(&dst->element[i], &src->element[i], rp, cp);
+    }
+}
+
+/* Copy a reply out of the reader into a single block released with free(),
+ * so it outlives the next call to redis_get_reply(). */
+redis_reply *redis_copy_reply(const redis_reply *reply) {
+    size_t nreply = 1, nchar = 0;
+    redis_reply *copy, *rp;
+    char *cp;
+
+    reply_copy_size(reply, &nreply, &nchar);
+    if ((copy = malloc(sizeof(redis_reply)*nreply+nchar)) == NULL)
+        return NULL;
+    rp = copy+1;
+    cp = (char *)(copy+nreply);
+    reply_copy(copy, reply, &rp, &cp);
+    return copy;
+}
+
+static redis_pool *_redis_pool_create(char *errstr, char *ip, int port, char *path, char *pass, int min, int max);
+
+/* A command submitted to the engine, already encoded by the caller */
+typedef struct redis_engine_task {
+    struct redis_engine_loop *loop;
+    redis_reply_callback *fn;
+    void *privdata;
+    cds cmd;
+} redis_engine_task;
+
+typedef struct redis_engine_loop {
+    struct redis_engine *engine;
+    st_event_loop *el;
+    pthread_t tid;
+    int started;
+    redis_async_context **ac;
+    int nac;
+    int next;                       /* connection the next command goes to */
+} redis_engine_loop;
+
+struct redis_engine {
+    redis_engine_loop *loop;
+    int nloop;
+    unsigned int next;              /* loop the next command goes to */
+    int stop;
+};
+
+struct redis_future {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    redis_reply *reply;
+    struct redis_future *next;      /* next waiter of a mux */
+};
+
+static void redis_engine_fail_task(redis_async_context *ac, redis_engine_task *task) {
+    if (task->fn) task->fn(ac, NULL, task->privdata);
+    cdsfree(task->cmd);
+    free(task);
+}
+
+/* Hand a task to one of the loop's connections, round robin over those
+ * that are up. It goes out with the loop's next flush. */
+static void redis_engine_dispatch(redis_engine_loop *loop, redis_engine_task *task) {
+    redis_async_context *ac = NULL;
+    cds newbuf;
+    int i;
+
+    for (i = 0; i < loop->nac && ac == NULL; i++) {
+        ac = loop->ac[loop->next];
+        loop->next = (loop->next+1) % loop->nac;
+        if (!ac->status) ac = NULL;
+    }
+    if (ac == NULL || redis_async_push_callback(ac, task->fn, task->privdata) == RET_ERR) {
+        redis_engine_fail_task(ac, task);
+        return;
+    }
+    if ((newbuf = cdscatlen(ac->c->obuf, task->cmd, cdslen(task->cmd))) == NULL) {
+        ac->cbcount--;
+        redis_engine_fail_task(ac, task);
+        return;
+    }
+    ac->c->obuf = newbuf;
+    redis_async_exec_command(ac);
+    cdsfree(task->cmd);
+    free(task);
+}
+
+/* Runs on the loop's thread for every submission, or when the loop is
+ * deleted for those that never got there. */
+static void redis_engine_post(struct st_event_loop *el, void *arg) {
+    redis_engine_task *task = (redis_engine_task *)arg;
+
+    NOMORE(el);
+    if (__atomic_load_n(&task->loop->engine->stop, __ATOMIC_ACQUIRE)) {
+        redis_engine_fail_task(NULL, task);
+        return;
+    }
+    redis_engine_dispatch(task->loop, task);
+}
+
+static void *redis_engine_thread(void *arg) {
+    redis_engine_loop *loop = (redis_engine_loop *)arg;
+
+    cel_main(loop->el);
+    return NULL;
+}
+
+/* Give the loop nconn of the connections warmed up in p. */
+static int redis_engine_loop_init(char *errstr, redis_engine_loop *loop, redis_pool *p, int nconn,
+        char *ip, int port, char *pass) {
+    redis_pool_conn *conn;
+    int i;
+
+    if ((loop->el = cel_create_event_loop(nconn+2)) == NULL ||
+            (loop->ac = calloc(nconn, sizeof(redis_async_context *))) == NULL) {
+        strcpy(errstr, "malloc failed");
+        return RET_ERR;
+    }
+    for (i = 0; i < nconn; i++) {
+        if ((conn = redis_pool_get(p, errstr)) == NULL)
+            return RET_ERR;
+        loop->ac[i] = redis_async_adopt(errstr, loop->el, conn->c, conn->r, ip, port, NULL, pass);
+        conn->c = NULL;
+        conn->r = NULL;
+        if (loop->ac[i] == NULL)
+            return RET_ERR;
+        loop->nac++;
+        if (redis_async_attach(loop->ac[i], loop->el) == RET_ERR) {
+            strcpy(errstr, loop->ac[i]->c->errstr);
+            return RET_ERR;
+        }
+    }
+    return RET_OK;
+}
+
+/* Start nthread I/O threads, each running its own event loop with nconn
+ * connections. Commands may then be submitted from any thread; they are
+ * spread over the loops and their connections and pipelined there. All
+ * connections are opened at once, the way a pool warms up. */
+redis_engine *redis_engine_create(char *errstr, int nthread, int nconn, char *ip, int port, char *pass) {
+    redis_engine *e;
+    redis_pool *p;
+    int i;
+
+    if (nthread <= 0 || nconn <= 0) {
+        strcpy(errstr, "invalid engine size");
+        return NULL;
+    }
+    if ((e = calloc(1, sizeof(redis_engine))) == NULL ||
+            (e->loop = calloc(nthread, sizeof(redis_engine_loop))) == NULL) {
+        strcpy(errstr, "malloc failed");
+        free(e);
+        return NULL;
+    }
+    e->nloop = nthread;
+    if ((p = _redis_pool_create(errstr, ip, port, NULL, pass, nthread*nconn, nthread*nconn)) == NULL)
+        goto err;
+    for (i = 0; i < nthread; i++) {
+        e->loop[i].engine = e;
+        if (redis_engine_loop_init(errstr, &e->loop[i], p, nconn, ip, port, pass) == RET_ERR) {
+            redis_pool_free(p);
+            goto err;
+        }
+    }
+    redis_pool_free(p);
+    for (i = 0; i < nthread; i++) {
+        if (pthread_create(&e->loop[i].tid, NULL, redis_engine_thread, &e->loop[i]) != 0) {
+            strcpy(errstr, "create thread failed");
+            goto err;
+        }
+        e->loop[i].started = 1;
+    }
+    return e;
+
+err:
+    redis_engine_free(e);
+    return NULL;
+}
+
+/* Stop the I/O threads. Commands still queued or waiting for a reply are
+ * completed with a NULL reply. */
+void redis_engine_free(redis_engine *e) {
+    redis_engine_loop *loop;
+    int i, j;
+
+    if (!e) return;
+    __atomic_store_n(&e->stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < e->nloop; i++) {
+        loop = &e->loop[i];
+        if (!loop->started) continue;
+        cel_stop(loop->el);
+        pthread_join(loop->tid, NULL);
+    }
+    for (i = 0; i < e->nloop; i++) {
+        loop = &e->loop[i];
+        for (j = 0; j < loop->nac; j++)
+            redis_async_free(loop->ac[j]);
+        free(loop->ac);
+        /* fails the submissions that are still queued */
+        if (loop->el) cel_delete_event_loop(loop->el);
+    }
+    free(e->loop);
+    free(e);
+}
+
+static int redis_engine_v_command(redis_engine *e, redis_reply_callback *fn, void *privdata,
+        const char *format, va_list ap) {
+    redis_engine_task *task;
+    redis_context c;
+
+    /* encode in the calling thread, the loop only copies bytes */
+    memset(&c, 0, sizeof(c));
+    c.pipe = -1;
+    if ((c.obuf = cdsnew(NULL)) == NULL)
+        return RET_ERR;
+    if (redis_v_append_command(&c, format, ap) == RET_ERR ||
+            (task = malloc(sizeof(redis_engine_task))) == NULL) {
+        cdsfree(c.obuf);
+        return RET_ERR;
+    }
+    task->fn = fn;
+    task->privdata = privdata;
+    task->cmd = c.obuf;
+    task->loop = &e->loop[__atomic_fetch_add(&e->next, 1, __ATOMIC_RELAXED) % e->nloop];
+    if (cel_post(task->loop->el, redis_engine_post, task) == EL_ERR) {
+        cdsfree(task->cmd);
+        free(task);
+        return RET_ERR;
+    }
+    return RET_OK;
+}
+
+/* Submit a command from any thread. fn runs on the I/O thread that owns the
+ * connection, with the same contract as for redis_async_command(); ac is
+ * NULL when the command never reached a connection. */
+int redis_engine_command(redis_engine *e, redis_reply_callback *fn, void *privdata, const char *format, ...) {
+    va_list ap;
+    int ret;
+
+    va_start(ap, format);
+    ret = redis_engine_v_command(e, fn, privdata, format, ap);
+    va_end(ap);
+    return ret;
+}
+
+static void redis_future_complete(redis_async_context *ac, redis_reply *reply, void *privdata) {
+    redis_future *f = (redis_future *)privdata;
+    redis_reply *copy = reply ? redis_copy_reply(reply) : NULL;
+
+    NOMORE(ac);
+    pthread_mutex_lock(&f->lock);
+    f->reply = copy;
+    f->done = 1;
+    pthread_cond_signal(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/* Submit a command whose reply is waited for with redis_future_wait(). */
+redis_future *redis_engine_command_future(redis_engine *e, const char *format, ...) {
+    redis_future *f;
+    va_list ap;
+    int ret;
+
+    if ((f = calloc(1, sizeof(redis_future))) == NULL)
+        return NULL;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    va_start(ap, format);
+    ret = redis_engine_v_command(e, redis_future_complete, f, format, ap);
+    va_end(ap);
+    if (ret == RET_ERR) {
+        redis_future_free(f);
+        return NULL;
+    }
+    return f;
+}
+
+/* Block until the reply arrived. It belongs to the future, NULL means the
+ * connection was lost or memory ran out. */
+redis_reply *redis_future_wait(redis_future *f) {
+    pthread_mutex_lock(&f->lock);
+    while (!f->done)
+        pthread_cond_wait(&f->cond, &f->lock);
+    pthread_mutex_unlock(&f->lock);
+    return f->reply;
+}
+
+/* Release a future, only once it was waited for. */
+void redis_future_free(redis_future *f) {
+    free(f->reply);
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->cond);
+    free(f);
+}
+
+/* A pool slot; conn is first so a checked out conn leads back to it. */
+typedef struct redis_pool_slot {
+    redis_pool_conn conn;
+    int next;                       /* next slot on the same stack */
+} redis_pool_slot;
+
+/* The stacks are a slot index plus one in the low half and a tag in the
+ * high half, bumped by every change so a pop never succeeds against a head
+ * that was popped and pushed back in between. */
+struct redis_pool {
+    char ip[64];
+    int port;
+    char path[128];                 /* unix socket, empty for tcp */
+    char passwd[512];
+    int min;
+    int max;
+    redis_pool_slot *slot;
+    uint64_t idle;                  /* connected slots */
+    uint64_t empty;                 /* slots without a connection */
+    int nidle;
+};
+
+static void redis_pool_push(redis_pool *p, uint64_t *head, int i) {
+    uint64_t old = __atomic_load_n(head, __ATOMIC_RELAXED), new;
+
+    do {
+        __atomic_store_n(&p->slot[i].next, (int)(old & 0xffffffff)-1, __ATOMIC_RELAXED);
+        new = (((old >> 32)+1) << 32) | (uint64_t)(i+1);
+    } while (!__atomic_compare_exchange_n(head, &old, new, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static int redis_pool_pop(redis_pool *p, uint64_t *head) {
+    uint64_t old = __atomic_load_n(head, __ATOMIC_ACQUIRE), new;
+    int i, next;
+
+    do {
+        if ((old & 0xffffffff) == 0)
+            return -1;
+        i = (int)(old & 0xffffffff)-1;
+        /* may be stale, then the tag makes the exchange fail */
+        next = __atomic_load_n(&p->slot[i].next, __ATOMIC_RELAXED);
+        new = (((old >> 32)+1) << 32) | (uint64_t)(next+1);
+    } while (!__atomic_compare_exchange_n(head, &old, new, 1,
+                __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    return i;
+}
+
+static void redis_pool_close(redis_pool *p, int i) {
+    redis_free(p->slot[i].conn.c);
+    redis_free_reader(p->slot[i].conn.r);
+    p->slot[i].conn.c = NULL;
+    p->slot[i].conn.r = NULL;
+    redis_pool_push(p, &p->empty, i);
+}
+
+static void redis_pool_idle(redis_pool *p, int i) {
+    __atomic_fetch_add(&p->nidle, 1, __ATOMIC_RELAXED);
+    redis_pool_push(p, &p->idle, i);
+}
+
+/* Open n connections at once: all connects are started, then they and the
+ * AUTHs are completed together under a single poll(), so the warm-up takes
+ * about one round trip however many connections there are. */
+static int redis_pool_warm(char *errstr, redis_pool *p, int n) {
+    struct pollfd *pfd = NULL;
+    int *idx = NULL, *state = NULL;
+    int i, k, npfd, left = 0, failed = 0, timeout;
+    redis_context *c;
+    redis_reader *r;
+    redis_reply *reply;
+    struct timeval start, now;
+
+    if (n <= 0) return RET_OK;
+    if ((pfd = malloc(sizeof(struct pollfd)*n)) == NULL ||
+            (idx = malloc(sizeof(int)*n)) == NULL ||
+            (state = malloc(sizeof(int)*n)) == NULL) {
+        strcpy(errstr, "malloc failed");
+        failed = 1;
+        goto end;
+    }
+    /* state: 0 connecting, 1 waiting for AUTH, 2 ready, -1 failed */
+    for (k = 0; k < n; k++) {
+        idx[k] = redis_pool_pop(p, &p->empty);
+        state[k] = -1;
+        if ((c = p->slot[idx[k]].conn.c = redis_context_init()) == NULL ||
+                (p->slot[idx[k]].conn.r = redis_create_reader()) == NULL) {
+            strcpy(errstr, "malloc failed");
+            continue;
+        }
+        if (p->path[0])
+            c->fd = csocket_unix_connect_nonblock(c->errstr, p->path);
+        else
+            c->fd = csocket_tcp_connect_nonblock(c->errstr, p->ip, p->port);
+        if (c->fd == RET_ERR) {
+            strcpy(errstr, c->errstr);
+            continue;
+        }
+        state[k] = 0;
+        left++;
+    }
+
+    gettimeofday(&start, NULL);
+    while (left > 0) {
+        gettimeofday(&now, NULL);
+        timeout = REDIS_CONNECT_TIMEOUT-(int)((now.tv_sec-start.tv_sec)*1000+(now.tv_usec-start.tv_usec)/1000);
+        if (timeout <= 0) {
+            strcpy(errstr, "connect timeout");
+            break;
+        }
+        for (k = 0, npfd = 0; k < n; k++) {
+            if (state[k] != 0 && state[k] != 1) continue;
+            pfd[npfd].fd = p->slot[idx[k]].conn.c->fd;
+            pfd[npfd].events = state[k] == 0 ? POLLOUT : POLLIN;
+            pfd[npfd].revents = 0;
+            npfd++;
+        }
+        if (poll(pfd, npfd, timeout) == -1 && errno != EINTR) {
+            sprintf(errstr, "poll failed, errno=%d", errno);
+            break;
+        }
+        for (k = 0, i = 0; k < n; k++) {
+            if (state[k] != 0 && state[k] != 1) continue;
+            if (pfd[i++].revents == 0) continue;
+            c = p->slot[idx[k]].conn.c;
+            r = p->slot[idx[k]].conn.r;
+            if (state[k] == 0) {
+                if (csocket_get_error(c->errstr, c->fd) == RET_ERR) {
+                    strcpy(errstr, c->errstr);
+                    state[k] = -1;
+                } else if (!p->passwd[0]) {
+                    state[k] = 2;
+                } else if (redis_append_command(c, "auth %s", p->passwd) == RET_ERR ||
+                        redis_buffer_write(c) != RET_OK) {
+                    /* a few bytes on a fresh socket, not taking them is an error */
+                    strcpy(errstr, c->err ? c->errstr : "auth write failed");
+                    state[k] = -1;
+                } else {
+                    state[k] = 1;
+                }
+            } else {
+                if (redis_buffer_read(c, r, 0) == RET_ERR) {
+                    strcpy(errstr, c->errstr);
+                    state[k] = -1;
+                } else if ((reply = redis_get_reply(r)) != NULL) {
+                    if (reply->type == REDIS_REPLY_STATUS && reply->len == 2 && strcmp(reply->str, "OK") == 0) {
+                        state[k] = 2;
+                    } else {
+                        strcpy(errstr, "redis auth failed");
+                        state[k] = -1;
+                    }
+                } else if (r->err) {
+                    strcpy(errstr, r->errstr);
+                    state[k] = -1;
+                }
+            }
+            if (state[k] == -1 || state[k] == 2) left--;
+        }
+    }
+
+    for (k = 0; k < n; k++) {
+        c = p->slot[idx[k]].conn.c;
+        if (state[k] == 2 && csocket_block(c->errstr, c->fd) == RET_OK) {
+            c->flags |= REDIS_BLOCK;
+            redis_clear_reader(p->slot[idx[k]].conn.r);
+            redis_pool_idle(p, idx[k]);
+        } else {
+            redis_pool_close(p, idx[k]);
+            failed = 1;
+        }
+    }
+
+end:
+    free(pfd);
+    free(idx);
+    free(state);
+    return failed ? RET_ERR : RET_OK;
+}
+
+static redis_pool *_redis_pool_create(char *errstr, char *ip, int port, char *path, char *pass, int min, int max) {
+    redis_pool *p;
+    int i;
+
+    if (min < 0 || max <= 0 || min > max) {
+        strcpy(errstr, "invalid pool size");
+        return NULL;
+    }
+    if ((path && strlen(path) >= sizeof(p->path)) || (ip && strlen(ip) >= sizeof(p->ip)) ||
+            (pass && strlen(pass) >= sizeof(p->passwd))) {
+        strcpy(errstr, "address or password too long");
+        return NULL;
+    }
+    if ((p = calloc(1, sizeof(redis_pool))) == NULL ||
+            (p->slot = calloc(max, sizeof(redis_pool_slot))) == NULL) {
+        strcpy(errstr, "malloc failed");
+        free(p);
+        return NULL;
+    }
+    if (path) strcpy(p->path, path);
+    if (ip) strcpy(p->ip, ip);
+    if (pass) strcpy(p->passwd, pass);
+    p->port = port;
+    p->min = min;
+    p->max = max;
+    for (i = max-1; i >= 0; i--)
+        redis_pool_push(p, &p->empty, i);
+    if (redis_pool_warm(errstr, p, min) == RET_ERR) {
+        redis_pool_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+/* A pool of up to max blocking connections, min of them opened right away.
+ * Checkout and return are lock-free and may happen from any thread. */
+redis_pool *redis_pool_create(char *errstr, char *ip, int port, char *pass, int min, int max) {
+    return _redis_pool_create(errstr, ip, port, NULL, pass, min, max);
+}
+
+redis_pool *redis_pool_create_unix(char *errstr, char *path, char *pass, int min, int max) {
+    return _redis_pool_create(errstr, NULL, 0, path, pass, min, max);
+}
+
+/* Every connection must have been returned. */
+void redis_pool_free(redis_pool *p) {
+    int i;
+
+    if (!p) return;
+    for (i = 0; i < p->max; i++) {
+        redis_free(p->slot[i].conn.c);
+        redis_free_reader(p->slot[i].conn.r);
+    }
+    free(p->slot);
+    free(p);
+}
+
+/* Check out an idle connection, or open a new one while fewer than max are
+ * open. NULL when all max are out or the connect failed. */
+redis_pool_conn *redis_pool_get(redis_pool *p, char *errstr) {
+    redis_pool_slot *s;
+    int i;
+
+    if ((i = redis_pool_pop(p, &p->idle)) != -1) {
+        __atomic_fetch_sub(&p->nidle, 1, __ATOMIC_RELAXED);
+        return &p->slot[i].conn;
+    }
+    if ((i = redis_pool_pop(p, &p->empty)) == -1) {
+        if (errstr) strcpy(errstr, "pool exhausted");
+        return NULL;
+    }
+    s = &p->slot[i];
+    if (p->path[0])
+        s->conn.c = redis_connect_unix_with_timeout(p->path, REDIS_CONNECT_TIMEOUT);
+    else
+        s->conn.c = redis_connect_with_timeout(p->ip, p->port, REDIS_CONNECT_TIMEOUT);
+    s->conn.r = redis_create_reader();
+    if (!s->conn.c || !s->conn.r) {
+        if (errstr) strcpy(errstr, "malloc failed");
+        goto err;
+    }
+    if (s->conn.c->err) {
+        if (errstr) strcpy(errstr, s->conn.c->errstr);
+        goto err;
+    }
+    if (p->passwd[0]) {
+        if (!redis_auth(errstr, s->conn.c, s->conn.r, p->passwd))
+            goto err;
+        redis_clear_reader(s->conn.r);
+    }
+    return &s->conn;
+
+err:
+    redis_pool_close(p, i);
+    return NULL;
+}
+
+/* Whether a returned connection can serve the next caller as is: no error,
+ * no output or reply left over, and the server has not hung up. */
+static int redis_pool_healthy(redis_pool_conn *conn) {
+    redis_context *c = conn->c;
+    redis_reader *r = conn->r;
+    char ch;
+    ssize_t n;
+
+    if (c->err || r->err || redis_write_pending(c) > 0 || r->pos < r->len)
+        return 0;
+    if (!(c->flags & REDIS_BLOCK))
+        return 0;
+    n = recv(c->fd, &ch, 1, MSG_PEEK|MSG_DONTWAIT);
+    return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Return a checked out connection; its replies are freed. A broken one is
+ * closed, the next checkout that finds no idle connection opens a new one. */
+void redis_pool_put(redis_pool *p, redis_pool_conn *conn) {
+    int i = (int)((redis_pool_slot *)conn-p->slot);
+
+    if (!redis_pool_healthy(conn)) {
+        redis_pool_close(p, i);
+        return;
+    }
+    redis_clear_reader(conn->r);
+    redis_pool_idle(p, i);
+}
+
+/* Close idle connections beyond min, e.g. from a timer after a burst. */
+void redis_pool_trim(redis_pool *p) {
+    int i;
+
+    while (__atomic_load_n(&p->nidle, __ATOMIC_RELAXED) > p->min &&
+            (i = redis_pool_pop(p, &p->idle)) != -1) {
+        __atomic_fetch_sub(&p->nidle, 1, __ATOMIC_RELAXED);
+        redis_pool_close(p, i);
+    }
+}
+
+/* One connection shared by many threads. Commands are encoded under the
+ * lock into queue, in the same order as their futures join the waiter
+ * list; whichever caller finds nobody writing swaps queue's output into c
+ * and writes it outside the lock, taking along what others queued in the
+ * meantime. A reader thread completes the waiters in order. */
+struct redis_mux {
+    pthread_mutex_t lock;
+    redis_context *c;               /* the connection, written by one caller at a time */
+    redis_context *queue;           /* commands not handed to a writer yet */
+    redis_reader *r;                /* owned by the reader thread */
+    redis_future *head;             /* waiters in the order of their commands */
+    redis_future *tail;
+    int writing;
+    int err;                        /* the connection is lost */
+    char errstr[REDIS_ERRBUF_SIZE];
+    pthread_t tid;
+    int started;
+};
+
+static void *redis_mux_thread(void *arg) {
+    redis_mux *m = (redis_mux *)arg;
+    redis_reader *r = m->r;
+    redis_reply *reply;
+    redis_future *f, *next;
+
+    for (;;) {
+        /* keep whatever belongs to a reply that is not complete yet */
+        r->readcount = 1;
+        if (redis_buffer_read(m->c, r, 1) == RET_ERR)
+            break;
+        while (r->pos < r->len && (reply = redis_get_reply(r)) != NULL) {
+            pthread_mutex_lock(&m->lock);
+            if ((f = m->head) != NULL && (m->head = f->next) == NULL)
+                m->tail = NULL;
+            pthread_mutex_unlock(&m->lock);
+            if (f == NULL) {
+                redis_reader_set_error(r, REDIS_ERR_PROTOCOL, "reply without a command");
+                break;
+            }
+            redis_future_complete(NULL, reply, f);
+        }
+        if (r->err) break;
+    }
+
+    pthread_mutex_lock(&m->lock);
+    if (!m->err) {
+        m->err = 1;
+        strcpy(m->errstr, r->errstr);
+    }
+    f = m->head;
+    m->head = m->tail = NULL;
+    pthread_mutex_unlock(&m->lock);
+    for (; f; f = next) {
+        next = f->next;
+        redis_future_complete(NULL, NULL, f);
+    }
+    return NULL;
+}
+
+static redis_mux *_redis_mux_connect(char *errstr, char *ip, int port, char *path, char *pass) {
+    redis_mux *m;
+
+    if ((m = calloc(1, sizeof(redis_mux))) == NULL) {
+        strcpy(errstr, "malloc failed");
+        return NULL;
+    }
+    pthread_mutex_init(&m->lock, NULL);
+    if (path)
+        m->c = redis_connect_unix_with_timeout(path, REDIS_CONNECT_TIMEOUT);
+    else
+        m->c = redis_connect_with_timeout(ip, port, REDIS_CONNECT_TIMEOUT);
+    m->queue = redis_context_init();
+    m->r = redis_create_reader();
+    if (!m->c || !m->queue || !m->r) {
+        strcpy(errstr, "malloc failed");
+        goto err;
+    }
+    if (m->c->err) {
+        strcpy(errstr, m->c->errstr);
+        goto err;
+    }
+    if (pass && !redis_auth(errstr, m->c, m->r, pass))
+        goto err;
+    /* from here on the reader thread does the reading */
+    redis_clear_reader(m->r);
+    m->r->c = NULL;
+    if (pthread_create(&m->tid, NULL, redis_mux_thread, m) != 0) {
+        strcpy(errstr, "create thread failed");
+        goto err;
+    }
+    m->started = 1;
+    return m;
+
+err:
+    redis_mux_free(m);
+    return NULL;
+}
+
+/* Connect a context that any number of threads may send commands on at
+ * the same time; they are pipelined over the one connection. */
+redis_mux *redis_mux_connect(char *errstr, char *ip, int port, char *pass) {
+    return _redis_mux_connect(errstr, ip, port, NULL, pass);
+}
+
+redis_mux *redis_mux_connect_unix(char *errstr, char *path, char *pass) {
+    return _redis_mux_connect(errstr, NULL, 0, path, pass);
+}
+
+/* Close the connection; commands still waiting get a NULL reply. No thread
+ * may be inside a redis_mux_command call anymore. */
+void redis_mux_free(redis_mux *m) {
+    if (!m) return;
+    if (m->started) {
+        /* wakes the reader thread up with an EOF */
+        shutdown(m->c->fd, SHUT_RDWR);
+        pthread_join(m->tid, NULL);
+    }
+    redis_free(m->c);
+    redis_free(m->queue);
+    redis_free_reader(m->r);
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+}
+
+static redis_future *redis_mux_v_command(redis_mux *m, const char *format, va_list ap) {
+    redis_future *f;
+    cds buf;
+    int ret = RET_OK;
+
+    if ((f = calloc(1, sizeof(redis_future))) == NULL)
+        return NULL;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+
+    pthread_mutex_lock(&m->lock);
+    if (m->err || redis_v_append_command(m->queue, format, ap) == RET_ERR) {
+        pthread_mutex_unlock(&m->lock);
+        redis_future_free(f);
+        return NULL;
+    }
+    if (m->tail) m->tail->next = f;
+    else m->head = f;
+    m->tail = f;
+    if (m->writing) {
+        /* goes out with the current writer's next round */
+        pthread_mutex_unlock(&m->lock);
+        return f;
+    }
+    m->writing = 1;
+    while (ret == RET_OK && cdslen(m->queue->obuf) > 0) {
+        buf = m->c->obuf;
+        m->c->obuf = m->queue->obuf;
+        m->queue->obuf = buf;
+        pthread_mutex_unlock(&m->lock);
+        ret = redis_buffer_write(m->c);
+        redis_clear_writer(m->c);
+        pthread_mutex_lock(&m->lock);
+    }
+    m->writing = 0;
+    if (ret == RET_ERR && !m->err) {
+        m->err = 1;
+        strcpy(m->errstr, m->c->errstr);
+        redis_clear_writer(m->queue);
+        /* the reader thread fails the waiters */
+        shutdown(m->c->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&m->lock);
+    return f;
+}
+
+/* Send a command from any thread; its reply is waited for with
+ * redis_future_wait(). NULL when the connection is already lost. */
+redis_future *redis_mux_command_future(redis_mux *m, const char *format, ...) {
+    redis_future *f;
+    va_list ap;
+
+    va_start(ap, format);
+    f = redis_mux_v_command(m, format, ap);
+    va_end(ap);
+    return f;
+}
+
+/* Send a command and wait for its reply, which the caller frees with
+ * free(). NULL when the connection was lost. */
+redis_reply *redis_mux_command(redis_mux *m, const char *format, ...) {
+    redis_future *f;
+    redis_reply *reply;
+    va_list ap;
+
+    va_start(ap, format);
+    f = redis_mux_v_command(m, format, ap);
+    va_end(ap);
+    if (f == NULL)
+        return NULL;
+    reply = redis_future_wait(f);
+    f->reply = NULL;
+    redis_future_free(f);
+    return reply;
+}
+
+/* Whether the connection was lost, with the reason in errstr. */
+int redis_mux_error(redis_mux *m, char *errstr) {
+    int err;
+
+    pthread_mutex_lock(&m->lock);
+    if ((err = m->err) && errstr)
+        strcpy(errstr, m->errstr);
+    pthread_mutex_unlock(&m->lock);
+    return err;
+}
+
+/* CRC16-CCITT (XMODEM), what redis cluster hashes keys with */
+static const unsigned short redis_crc16_tab[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+static unsigned short redis_crc16(const char *buf, size_t len) {
+    unsigned short crc = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        crc = (crc << 8) ^ redis_crc16_tab[((crc >> 8) ^ (unsigned char)buf[i]) & 0xff];
+    return crc;
+}
+
+/* The hash slot of a key. When it has a {tag} that is not empty only the
+ * tag is hashed, so keys sharing it land on the same node. */
+int redis_cluster_keyslot(const char *key, size_t len) {
+    size_t s, e;
+
+    for (s = 0; s < len && key[s] != '{'; s++);
+    if (s < len) {
+        for (e = s+1; e < len && key[e] != '}'; e++);
+        if (e < len && e != s+1)
+            return redis_crc16(key+s+1, e-s-1) & (REDIS_CLUSTER_SLOTS-1);
+    }
+    return redis_crc16(key, len) & (REDIS_CLUSTER_SLOTS-1);
+}
+
+typedef struct redis_cluster_node {
+    char ip[64];
+    int port;
+    redis_context *c;               /* non-blocking, NULL until first used */
+    redis_reader *r;
+    int down;                       /* connecting failed during this batch */
+    int *wait;                      /* commands in the order they went out, -1 for ASKING */
+    int whead;
+    int nwait;
+    int maxwait;
+} redis_cluster_node;
+
+typedef struct redis_cluster_cmd {
+    cds cmd;                        /* encoded */
+    int slot;                       /* -1 without a key */
+    int node;                       /* node picked by the caller, else -1 */
+    int ask;                        /* node an ASK redirected to, else -1 */
+    int pending;                    /* to be sent in the next round */
+    redis_reply *reply;
+} redis_cluster_cmd;
+
+struct redis_cluster {
+    char passwd[512];
+    redis_cluster_node *node;
+    int nnode;
+    int maxnode;
+    short slots[REDIS_CLUSTER_SLOTS];   /* node serving a slot, -1 unknown */
+    int refresh;                    /* reload the slot map before the next batch */
+    int timeout;                    /* ms a batch waits for any node to make progress, 0 for ever */
+    int standalone;                 /* nodes of a redis_shard, no slot map */
+    redis_cluster_cmd *cmd;         /* the batch */
+    int ncmd;
+    int maxcmd;
+    int next;                       /* next reply handed out */
+    int executed;
+    struct pollfd *pfd;
+    int *pfdnode;
+};
+
+/* Index of the node at ip:port, added when unknown; -1 out of memory. */
+static int redis_cluster_node_index(redis_cluster *cc, const char *ip, int port) {
+    redis_cluster_node *node;
+    struct pollfd *pfd;
+    int *pfdnode, i, max;
+
+    for (i = 0; i < cc->nnode; i++) {
+        if (cc->node[i].port == port && strcmp(cc->node[i].ip, ip) == 0)
+            return i;
+    }
+    if (strlen(ip) >= sizeof(cc->node[0].ip))
+        return -1;
+    if (cc->nnode == cc->maxnode) {
+        max = cc->maxnode ? cc->maxnode*2 : 8;
+        if ((node = realloc(cc->node, sizeof(redis_cluster_node)*max)) == NULL)
+            return -1;
+        cc->node = node;
+        if ((pfd = realloc(cc->pfd, sizeof(struct pollfd)*max)) == NULL)
+            return -1;
+        cc->pfd = pfd;
+        if ((pfdnode = realloc(cc->pfdnode, sizeof(int)*max)) == NULL)
+            return -1;
+        cc->pfdnode = pfdnode;
+        cc->maxnode = max;
+    }
+    node = &cc->node[cc->nnode];
+    memset(node, 0, sizeof(redis_cluster_node));
+    strcpy(node->ip, ip);
+    node->port = port;
+    return cc->nnode++;
+}
+
+static void redis_cluster_node_close(redis_cluster_node *n) {
+    redis_free(n->c);
+    redis_free_reader(n->r);
+    n->c = NULL;
+    n->r = NULL;
+    n->whead = n->nwait = 0;
+}
+
+/* Open a blocking connection to a node and authenticate it, reads and
+ * writes limited to REDIS_CONNECT_TIMEOUT. */
+static redis_context *redis_cluster_node_dial(redis_cluster *cc, redis_cluster_node *n,
+        redis_reader *r, char *errstr) {
+    redis_context *c;
+
+    if ((c = redis_connect_with_timeout(n->ip, n->port, REDIS_CONNECT_TIMEOUT)) == NULL) {
+        if (errstr) strcpy(errstr, "malloc failed");
+        return NULL;
+    }
+    /* a node that accepts but does not answer must not hang us */
+    if (c->err || redis_set_timeout(c, REDIS_CONNECT_TIMEOUT) == RET_ERR) {
+        if (errstr) strcpy(errstr, c->errstr);
+        redis_free(c);
+        return NULL;
+    }
+    if (cc->passwd[0] && !redis_auth(errstr, c, r, cc->passwd)) {
+        redis_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+static int redis_cluster_node_connect(redis_cluster *cc, redis_cluster_node *n, char *errstr) {
+    if ((n->r = redis_create_reader()) == NULL) {
+        if (errstr) strcpy(errstr, "malloc failed");
+        return RET_ERR;
+    }
+    if ((n->c = redis_cluster_node_dial(cc, n, n->r, errstr)) == NULL ||
+            redis_set_nonblock(n->c) == RET_ERR) {
+        if (errstr && n->c) strcpy(errstr, n->c->errstr);
+        redis_cluster_node_close(n);
+        return RET_ERR;
+    }
+    redis_clear_reader(n->r);
+    n->r->c = NULL;
+    return RET_OK;
+}
+
+/* Replace the slot map with what CLUSTER SLOTS of the first node that
+ * answers says. Nodes it names are added. */
+static int redis_cluster_load_slots(redis_cluster *cc, char *errstr) {
+    redis_context *c;
+    redis_reader *r;
+    redis_reply *reply, *e, *m;
+    int i, j, n, start, end, ret = RET_ERR;
+    char ip[64];
+
+    if ((r = redis_create_reader()) == NULL) {
+        if (errstr) strcpy(errstr, "malloc failed");
+        return RET_ERR;
+    }
+    for (i = 0; i < cc->nnode && ret == RET_ERR; i++) {
+        if ((c = redis_cluster_node_dial(cc, &cc->node[i], r, errstr)) == NULL)
+            continue;
+        redis_clear_reader(r);
+        redis_append_command(c, "CLUSTER SLOTS");
+        if (redis_exec_command(c, r) == RET_ERR || (reply = redis_get_reply(r)) == NULL) {
+            if (errstr) strcpy(errstr, c->err ? c->errstr : r->errstr);
+        } else if (reply->type != REDIS_REPLY_ARRAY) {
+            if (errstr) snprintf(errstr, REDIS_ERRBUF_SIZE, "cluster slots failed, %s",
+                    reply->type == REDIS_REPLY_ERROR ? reply->str : "unexpected reply");
+        } else {
+            for (j = 0; j < REDIS_CLUSTER_SLOTS; j++)
+                cc->slots[j] = -1;
+            ret = RET_OK;
+            for (j = 0; j < (int)reply->elements; j++) {
+                /* start, end, master [ip, port, id], replicas; a range
+                 * that is not shaped so is left unknown, not misrouted */
+                e = &reply->element[j];
+                if (e->type != REDIS_REPLY_ARRAY || e->elements < 3 ||
+                        e->element[0].type != REDIS_REPLY_INTEGER ||
+                        e->element[1].type != REDIS_REPLY_INTEGER ||
+                        e->element[2].type != REDIS_REPLY_ARRAY || e->element[2].elements < 2)
+                    continue;
+                m = &e->element[2];
+                if (m->element[0].type != REDIS_REPLY_STRING || m->element[1].type != REDIS_REPLY_INTEGER ||
+                        m->element[1].integer <= 0 || m->element[1].integer > 65535)
+                    continue;
+                start = (int)e->element[0].integer;
+                end = (int)e->element[1].integer;
+                /* an empty address means the node that was asked; one we
+                 * cannot keep is skipped like any other bad range */
+                if (m->element[0].len >= (int)sizeof(ip))
+                    continue;
+                if (m->element[0].len == 0)
+                    strcpy(ip, cc->node[i].ip);
+                else
+                    strcpy(ip, m->element[0].str);
+                if ((n = redis_cluster_node_index(cc, ip, (int)m->element[1].integer)) == -1) {
+                    if (errstr) strcpy(errstr, "malloc failed");
+                    ret = RET_ERR;
+                    break;
+                }
+                for (; start <= end && start < REDIS_CLUSTER_SLOTS; start++)
+                    if (start >= 0) cc->slots[start] = (short)n;
+            }
+        }
+        redis_free(c);
+    }
+    redis_free_reader(r);
+    return ret;
+}
+
+/* addrs is a comma separated list of ip:port. */
+static redis_cluster *redis_cluster_create(char *errstr, char *addrs, char *pass) {
+    redis_cluster *cc;
+    char addr[128], *p, *end, *colon;
+    size_t len;
+
+    if (pass && strlen(pass) >= sizeof(cc->passwd)) {
+        strcpy(errstr, "password too long");
+        return NULL;
+    }
+    if ((cc = calloc(1, sizeof(redis_cluster))) == NULL) {
+        strcpy(errstr, "malloc failed");
+        return NULL;
+    }
+    if (pass) strcpy(cc->passwd, pass);
+    cc->timeout = REDIS_CLUSTER_TIMEOUT;
+    for (p = addrs; *p; p = *end ? end+1 : end) {
+        if ((end = strchr(p, ',')) == NULL)
+            end = p+strlen(p);
+        len = end-p;
+        if (len == 0) continue;
+        if (len >= sizeof(addr)) {
+            strcpy(errstr, "address too long");
+            goto err;
+        }
+        memcpy(addr, p, len);
+        addr[len] = '\0';
+        if ((colon = strrchr(addr, ':')) == NULL) {
+            strcpy(errstr, "invalid address, ip:port expected");
+            goto err;
+        }
+        *colon = '\0';
+        if (redis_cluster_node_index(cc, addr, atoi(colon+1)) == -1) {
+            strcpy(errstr, "malloc failed");
+            goto err;
+        }
+    }
+    if (cc->nnode == 0) {
+        strcpy(errstr, "no address");
+        goto err;
+    }
+    return cc;
+
+err:
+    redis_cluster_free(cc);
+    return NULL;
+}
+
+/* Connect to a cluster through any of its nodes. The slot map is loaded
+ * right away, the nodes are connected to when a command first goes there. */
+redis_cluster *redis_cluster_connect(char *errstr, char *addrs, char *pass) {
+    redis_cluster *cc;
+
+    if ((cc = redis_cluster_create(errstr, addrs, pass)) == NULL)
+        return NULL;
+    if (redis_cluster_load_slots(cc, errstr) == RET_ERR) {
+        redis_cluster_free(cc);
+        return NULL;
+    }
+    return cc;
+}
+
+static void redis_cluster_clear_batch(redis_cluster *cc) {
+    int i;
+
+    for (i = 0; i < cc->ncmd; i++) {
+        cdsfree(cc->cmd[i].cmd);
+        free(cc->cmd[i].reply);
+    }
+    cc->ncmd = 0;
+    cc->next = 0;
+    cc->executed = 0;
+}
+
+void redis_cluster_free(redis_cluster *cc) {
+    int i;
+
+    if (!cc) return;
+    redis_cluster_clear_batch(cc);
+    for (i = 0; i < cc->nnode; i++) {
+        redis_cluster_node_close(&cc->node[i]);
+        free(cc->node[i].wait);
+    }
+    free(cc->node);
+    free(cc->cmd);
+    free(cc->pfd);
+    free(cc->pfdnode);
+    free(cc);
+}
+
+/* The first argument of an encoded command, NULL without one. */
+static char *redis_command_key(cds cmd, size_t *keylen) {
+    char *p = cmd;
+    long argc, len;
+
+    argc = strtol(p+1, &p, 10);
+    if (argc < 2) return NULL;
+    len = strtol(p+3, &p, 10);      /* the command name */
+    p += 2+len+2;
+    *keylen = (size_t)strtol(p+1, &p, 10);
+    return p+2;
+}
+
+/* Encode a command for the batch, the engine way: into a scratch context. */
+static cds redis_v_encode_command(const char *format, va_list ap) {
+    redis_context c;
+
+    memset(&c, 0, sizeof(c));
+    c.pipe = -1;
+    if ((c.obuf = cdsnew(NULL)) == NULL)
+        return NULL;
+    if (redis_v_append_command(&c, format, ap) == RET_ERR) {
+        cdsfree(c.obuf);
+        return NULL;
+    }
+    return c.obuf;
+}
+
+/* Add an encoded command to the batch, which takes it over. node is where
+ * it has to go, -1 to route it by the slot of its key. */
+static int redis_cluster_append_encoded(redis_cluster *cc, cds buf, int node) {
+    redis_cluster_cmd *cmd;
+    char *key;
+    size_t keylen;
+    int max;
+
+    if (cc->executed)
+        redis_cluster_clear_batch(cc);
+    if (cc->ncmd == cc->maxcmd) {
+        max = cc->maxcmd ? cc->maxcmd*2 : 16;
+        if ((cmd = realloc(cc->cmd, sizeof(redis_cluster_cmd)*max)) == NULL) {
+            cdsfree(buf);
+            return RET_ERR;
+        }
+        cc->cmd = cmd;
+        cc->maxcmd = max;
+    }
+    cmd = &cc->cmd[cc->ncmd++];
+    cmd->cmd = buf;
+    cmd->slot = -1;
+    if (node == -1 && (key = redis_command_key(buf, &keylen)) != NULL)
+        cmd->slot = redis_cluster_keyslot(key, keylen);
+    cmd->node = node;
+    cmd->ask = -1;
+    cmd->pending = 1;
+    cmd->reply = NULL;
+    return RET_OK;
 }
 
-int redis_get_return_number(redis_reader *r) {
-    return _redis_get_return_number(r);
+static int redis_cluster_v_append_command(redis_cluster *cc, const char *format, va_list ap) {
+    cds buf;
+
+    if ((buf = redis_v_encode_command(format, ap)) == NULL)
+        return RET_ERR;
+    return redis_cluster_append_encoded(cc, buf, -1);
 }
 
-static int continue_read_data(redis_reader *r) {
-    if (!r->c) return 0;
-    size_t len = r->len;
-    redis_buffer_read(r->c, r, 1);
-    r->readcount++;
-    if (len == r->len)
-        return 0;
-    else
-        return 1;
+/* Add a command to the batch. Its first argument is the key that decides
+ * the node; commands without one go to any node. */
+int redis_cluster_append_command(redis_cluster *cc, const char *format, ...) {
+    va_list ap;
+    int ret;
+
+    va_start(ap, format);
+    ret = redis_cluster_v_append_command(cc, format, ap);
+    va_end(ap);
+    return ret;
 }
 
-static int process_line_item(redis_reader *r, redis_reply *reply) {
-    char *p; 
-    long len;
+static int redis_cluster_push_wait(redis_cluster_node *n, int i) {
+    int *wait, max;
 
-reread:
-    if ((p = read_line(r, &len)) == NULL) {
-        if (continue_read_data(r)) goto reread;
-        redis_reader_set_error(r, REDIS_ERR_PROTOCOL, "protocol error, parse failed");
+    if (n->nwait == n->maxwait) {
+        max = n->maxwait ? n->maxwait*2 : 16;
+        if ((wait = realloc(n->wait, sizeof(int)*max)) == NULL)
+            return RET_ERR;
+        n->wait = wait;
+        n->maxwait = max;
+    }
+    n->wait[n->nwait++] = i;
+    return RET_OK;
+}
+
+/* Queue command i on the node owning its slot, or the one an ASK named. */
+static int redis_cluster_dispatch(redis_cluster *cc, int i, char *errstr) {
+    static const char asking[] = "*1\r\n$6\r\nASKING\r\n";
+    redis_cluster_cmd *cmd = &cc->cmd[i];
+    redis_cluster_node *n;
+    int idx = cmd->ask;
+    cds newbuf;
+
+    if (idx == -1)
+        idx = cmd->node;
+    if (idx == -1 && cmd->slot != -1)
+        idx = cc->slots[cmd->slot];
+    if (idx == -1) {
+        /* keyless or an unknown slot, a connected node will do */
+        for (idx = 0; idx < cc->nnode-1 && cc->node[idx].c == NULL; idx++);
+        cc->refresh |= cmd->slot != -1;
+    }
+    n = &cc->node[idx];
+    if (n->c == NULL && (n->down || redis_cluster_node_connect(cc, n, errstr) == RET_ERR)) {
+        /* do not wait for the connect timeout once per command */
+        n->down = 1;
+        cc->refresh = 1;
         return RET_ERR;
     }
-    if (reply->type == REDIS_REPLY_INTEGER) {
-        reply->integer = read_longlong(p);
-    } else {
-        if (reply->str == NULL) {
-            reply->str = cdsnewlen(p, len);
-        } else {
-            reply->str = cdscopylen(reply->str, p, len);
-        }
-        if (reply->str == NULL) {
-            redis_reader_set_error(r, REDIS_ERR_OMM, "malloc memory error, errno=%d, errmsg=%s", 
-                    __errno__, __errmsg__);
-            return RET_ERR;
-        }
-        reply->len = len;
+    if (cmd->ask != -1) {
+        if ((newbuf = cdscatlen(n->c->obuf, asking, sizeof(asking)-1)) == NULL)
+            goto oom;
+        n->c->obuf = newbuf;
+        if (redis_cluster_push_wait(n, -1) == RET_ERR)
+            goto oom;
     }
+    if ((newbuf = cdscatlen(n->c->obuf, cmd->cmd, cdslen(cmd->cmd))) == NULL)
+        goto oom;
+    n->c->obuf = newbuf;
+    if (redis_cluster_push_wait(n, i) == RET_ERR)
+        goto oom;
+    cmd->pending = 0;
     return RET_OK;
+
+oom:
+    if (errstr) strcpy(errstr, "malloc failed");
+    /* the node's output no longer matches its waiters */
+    redis_cluster_node_close(n);
+    return RET_ERR;
 }
 
-static int process_bulk_item(redis_reader *r, redis_reply *reply) {
-    char *p;
-    long len, plen;
+/* Keep the reply of command i; a MOVED or ASK sends it again next round,
+ * a MOVED also points its slot at the new owner. */
+static int redis_cluster_handle_reply(redis_cluster *cc, int i, redis_reply *reply) {
+    redis_cluster_cmd *cmd = &cc->cmd[i];
+    char *p, *colon;
+    int slot, idx, moved;
 
-reread1:
-    if ((p = read_line(r, &plen)) == NULL) {
-        if (continue_read_data(r)) goto reread1;
-        redis_reader_set_error(r, REDIS_ERR_PROTOCOL, "protocol error, parse failed");
+    free(cmd->reply);
+    if ((cmd->reply = redis_copy_reply(reply)) == NULL)
         return RET_ERR;
+    moved = reply->type == REDIS_REPLY_ERROR && strncmp(reply->str, "MOVED ", 6) == 0;
+    if (!moved && !(reply->type == REDIS_REPLY_ERROR && strncmp(reply->str, "ASK ", 4) == 0)) {
+        cmd->ask = -1;
+        return RET_OK;
+    }
+    /* MOVED <slot> <ip>:<port> */
+    p = cmd->reply->str+(moved ? 6 : 4);
+    slot = (int)strtol(p, &p, 10);
+    if (*p != ' ' || (colon = strrchr(p, ':')) == NULL || slot < 0 || slot >= REDIS_CLUSTER_SLOTS)
+        return RET_OK;
+    *colon = '\0';
+    if (strlen(p+1) >= sizeof(cc->node[0].ip)) {
+        /* an address we cannot keep, the redirect is the reply */
+        *colon = ':';
+        return RET_OK;
     }
-    len = read_longlong(p);
-    if (len < 0) {
-        reply->type = REDIS_REPLY_NIL;
-        if (reply->str && cdslen(reply->str) > 0)
-            cdsclear(reply->str);
+    idx = redis_cluster_node_index(cc, p+1, atoi(colon+1));
+    *colon = ':';
+    if (idx == -1)
+        return RET_ERR;
+    if (moved) {
+        cc->slots[slot] = (short)idx;
+        cmd->ask = -1;
     } else {
-reread2:
-        if (((long)(r->len - r->pos) < len)) {
-            if (continue_read_data(r)) goto reread2;
-            redis_reader_set_error(r, REDIS_ERR_PROTOCOL, 
-                    "protocol error, parse failed, %d,%d,%d", r->len, r->pos, len);
-            return RET_ERR;
-        }
-        if (reply->str == NULL) {
-            reply->str = cdsnewlen(p, len);
-        } else {
-            reply->str = cdscopylen(reply->str, p+plen+2, len);
-            r->pos += len+2;
-        }
-        if (reply->str == NULL) {
-            redis_reader_set_error(r, REDIS_ERR_OMM, "malloc memory error, errno=%d, errmsg=%s", 
-                    __errno__, __errmsg__);
-            return RET_ERR;
-        }
+        cmd->ask = idx;
     }
-    reply->len = len;
+    cmd->pending = 1;
     return RET_OK;
 }
 
-static int process_multi_bulk_item(redis_reader *r, redis_reply *reply) {
-    char *p;
+/* The node's connection broke: its commands still waiting get no reply. */
+static void redis_cluster_node_lost(redis_cluster *cc, redis_cluster_node *n, char *errstr, int *failed) {
     int i;
-    long l, len, elements;
-    redis_reply *re;
 
-reread1:
-    if ((p = read_line(r, NULL)) == NULL) {
-        if (continue_read_data(r)) goto reread1;
-        redis_reader_set_error(r, REDIS_ERR_PROTOCOL, "protocol error, parse failed");
-        return RET_ERR;
+    if (errstr) strcpy(errstr, n->c->err ? n->c->errstr : n->r->errstr);
+    for (; n->whead < n->nwait; n->whead++) {
+        if ((i = n->wait[n->whead]) == -1) continue;
+        free(cc->cmd[i].reply);
+        cc->cmd[i].reply = NULL;
+        (*failed)++;
     }
-    elements = read_longlong(p);
-    if (elements < 0) {
-        reply->type = REDIS_REPLY_NIL;
-    } else {
-        reply->elements = elements;
-        reply->type = REDIS_REPLY_ARRAY;
-        if (reply->elements > reply->total) {
-            if (reply->element == NULL) {
-                reply->element = malloc(sizeof(redis_reply)*elements);
-            } else {
-                reply->element = realloc(reply->element, sizeof(redis_reply)*elements);
+    redis_cluster_node_close(n);
+    cc->refresh = 1;
+}
+
+/* Write every node's pipeline and read the replies, all nodes at once. */
+static int redis_cluster_run(redis_cluster *cc, char *errstr, int *failed) {
+    redis_cluster_node *n;
+    redis_reply *reply;
+    int i, k, npfd, events, nnode = cc->nnode, ret, nready;
+
+    for (;;) {
+        for (i = 0, npfd = 0; i < nnode; i++) {
+            n = &cc->node[i];
+            if (n->c == NULL) continue;
+            events = 0;
+            if (redis_write_pending(n->c) > 0) events |= POLLOUT;
+            if (n->whead < n->nwait) events |= POLLIN;
+            if (events == 0) continue;
+            cc->pfd[npfd].fd = n->c->fd;
+            cc->pfd[npfd].events = events;
+            cc->pfd[npfd].revents = 0;
+            cc->pfdnode[npfd++] = i;
+        }
+        if (npfd == 0)
+            return RET_OK;
+        if ((nready = poll(cc->pfd, npfd, cc->timeout > 0 ? cc->timeout : -1)) == -1) {
+            if (errno == EINTR) continue;
+            if (errstr) sprintf(errstr, "poll failed, errno=%d", errno);
+            return RET_ERR;
+        }
+        if (nready == 0) {
+            /* none of them moved, give up on every node still busy */
+            for (k = 0; k < npfd; k++) {
+                n = &cc->node[cc->pfdnode[k]];
+                redis_set_error(n->c, REDIS_ERR_IO, "timeout");
+                redis_cluster_node_lost(cc, n, errstr, failed);
             }
-            if (reply->element == NULL) {
-                redis_reader_set_error(r, REDIS_ERR_OMM, "malloc memory error, errno=%d, errmsg=%s", 
-                        __errno__, __errmsg__);
-                return RET_ERR;
+            continue;
+        }
+        for (k = 0; k < npfd; k++) {
+            if (cc->pfd[k].revents == 0) continue;
+            n = &cc->node[cc->pfdnode[k]];
+            if (cc->pfd[k].events & POLLOUT) {
+                if (redis_buffer_write(n->c) == RET_ERR) {
+                    redis_cluster_node_lost(cc, n, errstr, failed);
+                    continue;
+                }
             }
-            memset(reply->element, 0, sizeof(redis_reply)*elements);
-            reply->total = elements;
-        } 
-
-        for (i = 0; i < elements; i++) {
-reread2:
-            if ((p = read_bytes(r,1)) == NULL || p[0] != '$' || 
-                    (p = read_line(r, NULL)) == NULL) {
-                if (continue_read_data(r)) goto reread2;
-                redis_reader_set_error(r, REDIS_ERR_PROTOCOL, "protocol error, parse failed");
-                return RET_ERR;
+            if (!(cc->pfd[k].revents & (POLLIN|POLLERR|POLLHUP)))
+                continue;
+            /* keep whatever belongs to a reply that is not complete yet */
+            n->r->readcount = 1;
+            if (redis_buffer_read(n->c, n->r, 0) == RET_ERR) {
+                redis_cluster_node_lost(cc, n, errstr, failed);
+                continue;
             }
-            len = read_longlong(p);
-            re = &reply->element[i];
-            clear_reply(re);
-            if (len < 0) {
-                re->type = REDIS_REPLY_NIL;
-            } else {
-reread3:
-                if ((p = read_line(r, &l)) == NULL || len != l) {
-                if (continue_read_data(r)) goto reread3;
-                    redis_reader_set_error(r, REDIS_ERR_PROTOCOL, "protocol error, parse failed");
-                    return RET_ERR;
-                }
-                if (re->str == NULL) {
-                    re->str = cdsnewlen(p, len);
-                } else {
-                    re->str = cdscopylen(re->str, p, len);
-                }
-                if (re->str == NULL) {
-                    redis_reader_set_error(r, REDIS_ERR_OMM, "malloc memory error, errno=%d, errmsg=%s", 
-                            __errno__, __errmsg__);
+            while (n->whead < n->nwait && n->r->pos < n->r->len &&
+                    (reply = redis_get_reply(n->r)) != NULL) {
+                if ((i = n->wait[n->whead++]) == -1) continue;
+                /* may add a node and move cc->node */
+                ret = redis_cluster_handle_reply(cc, i, reply);
+                n = &cc->node[cc->pfdnode[k]];
+                if (ret == RET_ERR) {
+                    if (errstr) strcpy(errstr, "malloc failed");
                     return RET_ERR;
                 }
-                re->type = REDIS_REPLY_STRING;
-                re->len = len;
             }
+            if (n->r->err)
+                redis_cluster_node_lost(cc, n, errstr, failed);
+            else if (n->whead == n->nwait)
+                n->whead = n->nwait = 0;
         }
     }
-    return RET_OK;
 }
 
-static redis_reply *redis_parse_message(redis_reader *r, redis_reply *reply) {
-    char *p;
-
-    if (r->pos >= r->len) {
-            redis_reader_set_error(r, REDIS_ERR_EOF, "no data"); 
-        return NULL;
-    }
-    if ((p = read_bytes(r,1)) != NULL) {
-        if (reply == NULL) {
-            if ((r->reply = reply = create_reply()) == NULL) {
-                redis_reader_set_error(r, REDIS_ERR_OMM, "malloc memory error, errno=%d, errmsg=%s", 
-                        __errno__, __errmsg__);
-                return NULL;
+/* Send the batch: the commands of each node go out as one pipeline, the
+ * pipelines of all nodes at the same time. Redirected commands are sent
+ * again up to REDIS_CLUSTER_MAX_REDIRECT times, after that their MOVED or
+ * ASK error is the reply. Returns RET_ERR when some command got no reply;
+ * the replies are then taken with redis_cluster_get_reply() in order. */
+int redis_cluster_exec(redis_cluster *cc, char *errstr) {
+    int round, i, sent, failed = 0;
+
+    cc->executed = 1;
+    for (i = 0; i < cc->nnode; i++)
+        cc->node[i].down = 0;
+    if (cc->refresh && !cc->standalone && redis_cluster_load_slots(cc, NULL) == RET_OK)
+        cc->refresh = 0;
+    for (round = 0; round <= REDIS_CLUSTER_MAX_REDIRECT; round++) {
+        for (i = 0, sent = 0; i < cc->ncmd; i++) {
+            if (!cc->cmd[i].pending) continue;
+            if (redis_cluster_dispatch(cc, i, errstr) == RET_ERR) {
+                cc->cmd[i].pending = 0;
+                free(cc->cmd[i].reply);
+                cc->cmd[i].reply = NULL;
+                failed++;
+                continue;
             }
-        } else {
-            clear_reply(reply);
+            sent++;
         }
-        
-        switch (p[0]) {
-            case '-': 
-                reply->type = REDIS_REPLY_ERROR;
-                break;
-            case '+':
-                reply->type = REDIS_REPLY_STATUS;
-                break;
-            case ':':
-                reply->type = REDIS_REPLY_INTEGER;
-                break;
-            case '$':
-                reply->type = REDIS_REPLY_STRING;
-                break;
-            case '*':
-                reply->type = REDIS_REPLY_ARRAY;
-                break;
-            default:
-                redis_reader_set_error(r, REDIS_ERR_PROTOCOL, "protocol error, unkown type");
-                return NULL;
+        if (sent == 0)
+            break;
+        if (redis_cluster_run(cc, errstr, &failed) == RET_ERR) {
+            /* nothing the connections say can be trusted anymore */
+            for (i = 0; i < cc->nnode; i++)
+                redis_cluster_node_close(&cc->node[i]);
+            return RET_ERR;
         }
-    } else {
+    }
+    return failed ? RET_ERR : RET_OK;
+}
+
+/* How long a batch waits without any node reading or writing before the
+ * nodes still busy are given up on, 0 to wait for ever. */
+void redis_cluster_set_timeout(redis_cluster *cc, int milliseconds) {
+    cc->timeout = milliseconds > 0 ? milliseconds : 0;
+}
+
+/* The next reply of the executed batch, NULL for a command that got none
+ * or past the end. It belongs to the cluster until the next batch. */
+redis_reply *redis_cluster_get_reply(redis_cluster *cc) {
+    if (!cc->executed || cc->next >= cc->ncmd)
         return NULL;
-    }        
-  
+    return cc->cmd[cc->next++].reply;
+}
+
+/* Run a single command, see redis_cluster_exec(). */
+redis_reply *redis_cluster_command(redis_cluster *cc, const char *format, ...) {
+    va_list ap;
     int ret;
-    switch (reply->type) {
-        case REDIS_REPLY_ERROR:
-        case REDIS_REPLY_STATUS:
-        case REDIS_REPLY_INTEGER:
-            ret = process_line_item(r, reply);
-            break;
-        case REDIS_REPLY_STRING:
-            ret = process_bulk_item(r, reply);
-            break;
-        case REDIS_REPLY_ARRAY:
-            ret = process_multi_bulk_item(r, reply);
-            break;
-        default:
-            ret = RET_ERR;
-    }
-    
-    if (ret == RET_ERR) {
-        clear_reply(reply);
+
+    va_start(ap, format);
+    ret = redis_cluster_v_append_command(cc, format, ap);
+    va_end(ap);
+    if (ret == RET_ERR)
         return NULL;
+    redis_cluster_exec(cc, NULL);
+    return redis_cluster_get_reply(cc);
+}
+
+/* A point of the hash ring, REDIS_SHARD_VNODES of them per node. */
+typedef struct redis_shard_point {
+    unsigned int hash;
+    int node;
+} redis_shard_point;
+
+/* Keys spread over standalone nodes, ketama style: a node owns the ring
+ * from the point before each of its own ones, so adding a node takes keys
+ * only from the others' ranges it cuts in, about 1/N of them. */
+struct redis_shard {
+    redis_cluster *cc;              /* the nodes and their pipelines */
+    redis_shard_point *ring;        /* sorted by hash */
+    int npoint;
+};
+
+/* FNV-1a, with murmur3's finalizer for the poorly mixed last bytes. */
+static unsigned int redis_shard_hash(const char *key, size_t len) {
+    unsigned int h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 16777619u;
     }
-    return reply;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
 }
 
-redis_reply *redis_get_reply(redis_reader *r) {
-    if (r == NULL) return NULL;
-    if (r->err) r->err = r->errstr[0] = 0;
-    if (!r->readcount) {
-        if (redis_buffer_read(r->c, r, 0) == RET_ERR)
-            return NULL;
-        r->readcount++;
+static int redis_shard_point_cmp(const void *a, const void *b) {
+    unsigned int x = ((const redis_shard_point *)a)->hash;
+    unsigned int y = ((const redis_shard_point *)b)->hash;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Put a node on the ring. Its points depend on its address only, so they
+ * are the same whatever other nodes there are. */
+static int redis_shard_add_points(redis_shard *sh, int node) {
+    redis_cluster_node *n = &sh->cc->node[node];
+    redis_shard_point *ring;
+    char buf[96];
+    int i, len;
+
+    if ((ring = realloc(sh->ring, sizeof(redis_shard_point)*(sh->npoint+REDIS_SHARD_VNODES))) == NULL)
+        return RET_ERR;
+    sh->ring = ring;
+    for (i = 0; i < REDIS_SHARD_VNODES; i++) {
+        len = snprintf(buf, sizeof(buf), "%s:%d-%d", n->ip, n->port, i);
+        ring[sh->npoint].hash = redis_shard_hash(buf, len);
+        ring[sh->npoint].node = node;
+        sh->npoint++;
     }
-    return redis_parse_message(r, r->reply);
+    qsort(ring, sh->npoint, sizeof(redis_shard_point), redis_shard_point_cmp);
+    return RET_OK;
 }
 
-static int redis_async_auth(char *errstr, redis_async_context *ac, char *pass) {
-    int ret;
-    redis_reply *reply;
-    redis_context *c = ac->c;
-    redis_reader *r = ac->r;
+/* Shard keys over the standalone nodes in addrs, a comma separated list of
+ * ip:port. The nodes are connected to when a command first goes there. */
+redis_shard *redis_shard_connect(char *errstr, char *addrs, char *pass) {
+    redis_shard *sh;
+    int i;
 
-    redis_append_command(c, "auth %s", pass);
-    ret = redis_exec_command(c, r);
-    if (ret == -1) {
-        if (errstr && c->err) strcpy(errstr, c->errstr);
-        return 0;
+    if ((sh = calloc(1, sizeof(redis_shard))) == NULL) {
+        strcpy(errstr, "malloc failed");
+        return NULL;
     }
-    reply = redis_get_reply(r);
-    if (reply == NULL) {
-        if (errstr && r->err) strcpy(errstr, r->errstr);
-        return 0;
+    if ((sh->cc = redis_cluster_create(errstr, addrs, pass)) == NULL) {
+        free(sh);
+        return NULL;
     }
-    if (reply->type == REDIS_REPLY_STATUS && reply->len && strcmp(reply->str, "OK") == 0) {
-        //auth ok           
-    } else {
-        if (errstr) strcpy(errstr, "redis auth failed"); 
-        return 0;
+    sh->cc->standalone = 1;
+    for (i = 0; i < sh->cc->nnode; i++) {
+        if (redis_shard_add_points(sh, i) == RET_ERR) {
+            strcpy(errstr, "malloc failed");
+            redis_shard_free(sh);
+            return NULL;
+        }
     }
-    return 1;
+    return sh;
 }
 
-redis_async_context* redis_async_connect(char *errstr, char *ip, int port, char *pass) {
-    redis_async_context *ac;    
+/* Add a node; the keys it now owns are not moved over. */
+int redis_shard_add_node(redis_shard *sh, char *errstr, char *ip, int port) {
+    int nnode = sh->cc->nnode, node;
 
-    ac = malloc(sizeof(redis_async_context));
-    ac->el = cel_create_event_loop(10);
-    ac->r = redis_create_reader(); 
-    ac->c = redis_connect_with_timeout(ip, port, 5*1000); 
-    if (!ac || !ac->r || !ac->c || !ac->el) {
-        strcpy(errstr, "malloc failed");
-        goto err;
+    if ((node = redis_cluster_node_index(sh->cc, ip, port)) == -1) {
+        if (errstr) strcpy(errstr, "malloc failed");
+        return RET_ERR;
     }
-    if (ac->c->err) {
-        strcpy(errstr, ac->c->errstr);
-        goto err;
+    if (node < nnode) {
+        if (errstr) strcpy(errstr, "node exists");
+        return RET_ERR;
     }
-    if (pass) {
-        if (!redis_async_auth(errstr, ac, pass))
-            goto err;
-        strcpy(ac->passwd, pass);
-    } else {
-        ac->passwd[0] = 0;
+    if (redis_shard_add_points(sh, node) == RET_ERR) {
+        if (errstr) strcpy(errstr, "malloc failed");
+        sh->cc->nnode--;
+        return RET_ERR;
     }
-    ac->port = port;
-    strcpy(ac->ip, ip);
-    ac->status = 1;
-    return ac;
+    return RET_OK;
+}
 
-err:
-    redis_async_free(ac);
-    return NULL;
+void redis_shard_free(redis_shard *sh) {
+    if (!sh) return;
+    redis_cluster_free(sh->cc);
+    free(sh->ring);
+    free(sh);
 }
 
-void redis_async_free(redis_async_context *ac) {
-    if (!ac) return;
-    if (ac->r) redis_free_reader(ac->r);
-    if (ac->c) redis_free(ac->c);    
-    if (ac->el) cel_delete_event_loop(ac->el);
-    free(ac);
+/* The node of a key, in the order the nodes were given and added: the one
+ * owning the first point at or after the key's hash. */
+int redis_shard_locate(redis_shard *sh, const char *key, size_t len) {
+    unsigned int h = redis_shard_hash(key, len);
+    int lo = 0, hi = sh->npoint, mid;
+
+    while (lo < hi) {
+        mid = (lo+hi)/2;
+        if (sh->ring[mid].hash < h)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return sh->ring[lo == sh->npoint ? 0 : lo].node;
 }
 
-void redis_async_set_read_callback(redis_async_context *ac, redis_callback_function *fn) {
-    ac->fn_read = fn; 
+static int redis_shard_v_append_command(redis_shard *sh, const char *format, va_list ap) {
+    cds buf;
+    char *key;
+    size_t keylen;
+
+    if ((buf = redis_v_encode_command(format, ap)) == NULL)
+        return RET_ERR;
+    key = redis_command_key(buf, &keylen);
+    return redis_cluster_append_encoded(sh->cc, buf, key ? redis_shard_locate(sh, key, keylen) : 0);
 }
 
-void redis_async_set_reconnect_callback(redis_async_context *ac, redis_callback_function *fn) {
-    ac->fn_reconnect = fn; 
+/* Add a command to the batch, sent to the node of its first argument. */
+int redis_shard_append_command(redis_shard *sh, const char *format, ...) {
+    va_list ap;
+    int ret;
+
+    va_start(ap, format);
+    ret = redis_shard_v_append_command(sh, format, ap);
+    va_end(ap);
+    return ret;
 }
 
-static void redis_async_read_event(struct st_event_loop *el, int fd, void *clientdata, int mask) {
-    redis_async_context *ac = (redis_async_context *)clientdata;
+void redis_shard_set_timeout(redis_shard *sh, int milliseconds) {
+    redis_cluster_set_timeout(sh->cc, milliseconds);
+}
 
-    NOMORE(mask);
-    redis_clear_reader(ac->r);
-    if (redis_buffer_read(ac->c, ac->r, 0) == RET_ERR) {
-        if (ac->c->err == REDIS_ERR_EOF) {
-            ac->status = 0;
-            cel_del_file_event(el, fd, EL_READABLE);
-            //printf("err=%s\n", ac->c->errstr);
-        }
-    } else {
-        if (ac->fn_read) ac->fn_read(ac);
-    }
+/* Like redis_cluster_exec(), one pipeline per node, all at once. */
+int redis_shard_exec(redis_shard *sh, char *errstr) {
+    return redis_cluster_exec(sh->cc, errstr);
 }
 
-static int redis_async_reconnect(struct st_event_loop *el, int id, void *clientdata) {
-    redis_async_context *ac = (redis_async_context *)clientdata;
+redis_reply *redis_shard_get_reply(redis_shard *sh) {
+    return redis_cluster_get_reply(sh->cc);
+}
+
+redis_reply *redis_shard_command(redis_shard *sh, const char *format, ...) {
+    va_list ap;
     int ret;
 
-    NOMORE(id);
-    if (!ac->status) {
-        //printf("try connect redis\n");
-        if ((ret = redis_reconnect(ac->c, ac->ip, ac->port, 5000)) > 0) {
-            if (ac->passwd[0] && !redis_async_auth(NULL, ac, ac->passwd))
-                goto end;
-            if (ac->fn_reconnect) ac->fn_reconnect(ac);
-            redis_set_nonblock(ac->c);
-            ret = cel_add_file_event(el, ac->c->fd, EL_READABLE, redis_async_read_event, ac);
-            if (ret == EL_ERR) goto end;
-            ac->status = 1; 
-            //printf("redis reconnect success\n");
+    va_start(ap, format);
+    ret = redis_shard_v_append_command(sh, format, ap);
+    va_end(ap);
+    if (ret == RET_ERR)
+        return NULL;
+    redis_cluster_exec(sh->cc, NULL);
+    return redis_cluster_get_reply(sh->cc);
+}
+
+static cds redis_cat_bulk(cds buf, const char *s, size_t len) {
+    cds newbuf;
+    int n;
+
+    if ((newbuf = cdsmakeroom(buf, REDIS_HEADER_MAX+len+2)) == NULL) {
+        cdsfree(buf);
+        return NULL;
+    }
+    n = encode_header(newbuf+cdslen(newbuf), '$', len);
+    memcpy(newbuf+cdslen(newbuf)+n, s, len);
+    memcpy(newbuf+cdslen(newbuf)+n+len, "\r\n", 2);
+    cdsincrlen(newbuf, n+len+2);
+    return newbuf;
+}
+
+/* Run name once per node holding some of the keys, with that node's keys
+ * (each followed by its value when vals is given) in their given order.
+ * node[i] and pos[i] tell whose command key i went into and where, cmd[j]
+ * the command in the batch of node j, -1 for none. */
+static int redis_shard_scatter(redis_shard *sh, char *errstr, const char *name, int n,
+        const char **keys, const size_t *keylens, const char **vals, const size_t *vallens,
+        int *node, int *pos, int *cmd) {
+    redis_cluster *cc = sh->cc;
+    cds *buf = NULL;
+    char hdr[REDIS_HEADER_MAX];
+    int i, j, nnode = cc->nnode, argc, ret = RET_ERR;
+
+    /* a batch of its own, whatever was appended before is dropped */
+    redis_cluster_clear_batch(cc);
+    if ((buf = calloc(nnode, sizeof(cds))) == NULL)
+        goto oom;
+    for (j = 0; j < nnode; j++)
+        cmd[j] = 0;
+    for (i = 0; i < n; i++) {
+        node[i] = redis_shard_locate(sh, keys[i], keylens ? keylens[i] : strlen(keys[i]));
+        pos[i] = cmd[node[i]]++;
+    }
+    for (j = 0; j < nnode; j++) {
+        if (cmd[j] == 0) continue;
+        argc = 1+cmd[j]*(vals ? 2 : 1);
+        if ((buf[j] = cdsnewlen(hdr, encode_header(hdr, '*', argc))) == NULL ||
+                (buf[j] = redis_cat_bulk(buf[j], name, strlen(name))) == NULL)
+            goto oom;
+    }
+    for (i = 0; i < n; i++) {
+        j = node[i];
+        if ((buf[j] = redis_cat_bulk(buf[j], keys[i], keylens ? keylens[i] : strlen(keys[i]))) == NULL)
+            goto oom;
+        if (vals && (buf[j] = redis_cat_bulk(buf[j], vals[i], vallens ? vallens[i] : strlen(vals[i]))) == NULL)
+            goto oom;
+    }
+    for (j = 0; j < nnode; j++) {
+        cmd[j] = -1;
+        if (buf[j] == NULL) continue;
+        cmd[j] = cc->ncmd;
+        ret = redis_cluster_append_encoded(cc, buf[j], j);
+        buf[j] = NULL;
+        if (ret == RET_ERR)
+            goto oom;
+    }
+    free(buf);
+    return redis_cluster_exec(cc, errstr);
+
+oom:
+    if (errstr) strcpy(errstr, "malloc failed");
+    for (j = 0; buf && j < nnode; j++)
+        if (buf[j]) cdsfree(buf[j]);
+    free(buf);
+    redis_cluster_clear_batch(cc);
+    return RET_ERR;
+}
+
+/* The reply of command cmd of the batch, NULL with errstr set unless it
+ * is of the type wanted. */
+static redis_reply *redis_shard_gather(redis_shard *sh, char *errstr, int cmd, int type) {
+    redis_reply *reply = sh->cc->cmd[cmd].reply;
+
+    if (reply == NULL) {
+        return NULL;
+    } else if (reply->type == REDIS_REPLY_ERROR) {
+        if (errstr) snprintf(errstr, REDIS_ERRBUF_SIZE, "%s", reply->str);
+        return NULL;
+    } else if (reply->type != type) {
+        if (errstr) strcpy(errstr, "unexpected reply");
+        return NULL;
+    }
+    return reply;
+}
+
+static int *redis_shard_index(redis_shard *sh, char *errstr, int n) {
+    int *idx;
+
+    if ((idx = malloc(sizeof(int)*(2*n+sh->cc->nnode))) == NULL && errstr)
+        strcpy(errstr, "malloc failed");
+    return idx;
+}
+
+/* MGET over all shards, one pipeline per shard at the same time. The
+ * values come back as one array in the order of keys, which the caller
+ * frees with free(); NULL when a shard failed. keylens may be NULL for
+ * nul terminated keys. */
+redis_reply *redis_shard_mget(redis_shard *sh, char *errstr, int n, const char **keys, const size_t *keylens) {
+    redis_reply all, *reply, *copy = NULL;
+    int *idx, *node, *pos, *cmd, i;
+
+    if ((idx = redis_shard_index(sh, errstr, n)) == NULL)
+        return NULL;
+    node = idx;
+    pos = idx+n;
+    cmd = idx+2*n;
+    memset(&all, 0, sizeof(all));
+    all.type = REDIS_REPLY_ARRAY;
+    all.elements = n;
+    if (redis_shard_scatter(sh, errstr, "MGET", n, keys, keylens, NULL, NULL, node, pos, cmd) == RET_ERR)
+        goto end;
+    if ((all.element = malloc(sizeof(redis_reply)*(n ? n : 1))) == NULL) {
+        if (errstr) strcpy(errstr, "malloc failed");
+        goto end;
+    }
+    for (i = 0; i < n; i++) {
+        if ((reply = redis_shard_gather(sh, errstr, cmd[node[i]], REDIS_REPLY_ARRAY)) == NULL)
+            goto end;
+        if ((size_t)pos[i] >= reply->elements) {
+            if (errstr) strcpy(errstr, "unexpected reply");
+            goto end;
         }
+        all.element[i] = reply->element[pos[i]];
     }
+    if ((copy = redis_copy_reply(&all)) == NULL && errstr)
+        strcpy(errstr, "malloc failed");
 
 end:
-    return 3*1000;
+    free(all.element);
+    free(idx);
+    return copy;
 }
 
-void redis_async_run(redis_async_context *ac) {
-    int ret;
+/* MSET over all shards; each shard sets its keys atomically, but not all
+ * shards together. */
+int redis_shard_mset(redis_shard *sh, char *errstr, int n, const char **keys, const size_t *keylens,
+        const char **vals, const size_t *vallens) {
+    int *idx, j, ret = RET_ERR;
 
-    redis_set_nonblock(ac->c);
-    ret = cel_add_file_event(ac->el, ac->c->fd, EL_READABLE, redis_async_read_event, ac);
-    if (ret == EL_ERR) return;
-    ret = cel_add_timer_event(ac->el, 3*1000, redis_async_reconnect, ac);
-    if (ret == EL_ERR) return;
-    cel_main(ac->el);    
+    if ((idx = redis_shard_index(sh, errstr, n)) == NULL)
+        return RET_ERR;
+    if (redis_shard_scatter(sh, errstr, "MSET", n, keys, keylens, vals, vallens, idx, idx+n, idx+2*n) == RET_ERR)
+        goto end;
+    for (j = 0; j < sh->cc->nnode; j++) {
+        if (idx[2*n+j] != -1 && redis_shard_gather(sh, errstr, idx[2*n+j], REDIS_REPLY_STATUS) == NULL)
+            goto end;
+    }
+    ret = RET_OK;
+
+end:
+    free(idx);
+    return ret;
 }
 
+/* DEL over all shards, the number of keys removed or -1. */
+long long redis_shard_del(redis_shard *sh, char *errstr, int n, const char **keys, const size_t *keylens) {
+    redis_reply *reply;
+    long long removed = -1;
+    int *idx, j;
+
+    if ((idx = redis_shard_index(sh, errstr, n)) == NULL)
+        return -1;
+    if (redis_shard_scatter(sh, errstr, "DEL", n, keys, keylens, NULL, NULL, idx, idx+n, idx+2*n) == RET_ERR)
+        goto end;
+    removed = 0;
+    for (j = 0; j < sh->cc->nnode; j++) {
+        if (idx[2*n+j] == -1) continue;
+        if ((reply = redis_shard_gather(sh, errstr, idx[2*n+j], REDIS_REPLY_INTEGER)) == NULL) {
+            removed = -1;
+            break;
+        }
+        removed += reply->integer;
+    }
 
+end:
+    free(idx);
+    return removed;
+}
@@ -5,6 +5,10 @@
 
 #define REDIS_ERRBUF_SIZE 128
 #define REDIS_READER_MAX_BUF (1024*64)
+#define REDIS_READER_READ_SIZE (1024*16)
+#define REDIS_READER_MAX_READ (1024*1024)
+#define REDIS_READER_MAX_DEPTH 16
+#define REDIS_ARENA_BLOCK_SIZE (1024*4)
 
 /* redis error code */
 #define REDIS_ERR_IO 1
@@ -12,6 +16,7 @@
 #define REDIS_ERR_PROTOCOL 3
 #define REDIS_ERR_OMM 4
 #define REDIS_ERR_OTHER 5
+#define REDIS_ERR_FULL 6
 
 #define REDIS_REPLY_STRING 1
 #define REDIS_REPLY_ARRAY 2
@@ -22,6 +27,49 @@
 
 #define REDIS_BLOCK 0x1
 
+/* pending output flushed at once even with a flush delay */
+#define REDIS_FLUSH_BATCH (1024*64)
+
+/* reconnect backoff of an async context in ms, doubled per failed attempt
+ * and jittered; an attempt gets REDIS_CONNECT_TIMEOUT to connect and auth */
+#define REDIS_RECONNECT_MIN 100
+#define REDIS_RECONNECT_MAX (30*1000)
+#define REDIS_CONNECT_TIMEOUT (5*1000)
+
+/* where a reconnect attempt is, see redis_async_context.connecting */
+#define REDIS_CONN_IDLE 0
+#define REDIS_CONN_CONNECT 1
+#define REDIS_CONN_AUTH 2
+
+/* argv arguments at least this large are written from the caller's memory */
+#define REDIS_WRITEV_MIN_ARG (1024*16)
+#define REDIS_MAX_IOV 64
+
+/* hash slots of a redis cluster, and how often a command follows a MOVED
+ * or ASK redirect before its error is taken as the reply */
+#define REDIS_CLUSTER_SLOTS 16384
+#define REDIS_CLUSTER_MAX_REDIRECT 5
+/* ms a cluster or shard batch waits for any node by default */
+#define REDIS_CLUSTER_TIMEOUT (5*1000)
+
+/* points of a node on the hash ring of a redis_shard */
+#define REDIS_SHARD_VNODES 160
+
+/* CRLF search kernels, see redis_set_simd() */
+#define REDIS_SIMD_NONE 0
+#define REDIS_SIMD_SSE2 1
+#define REDIS_SIMD_AVX2 2
+
+/* redis reader flags */
+#define REDIS_READER_ZEROCOPY 0x1
+
+/* caller buffer written out between obuf[pos-1] and obuf[pos] */
+typedef struct redis_obuf_ref {
+    size_t pos;
+    const char *data;
+    size_t len;
+} redis_obuf_ref;
+
 typedef struct redis_context {
     int err;
     char errstr[REDIS_ERRBUF_SIZE];
@@ -29,18 +77,53 @@ typedef struct redis_context {
     int flags;	
     int pipe;
     char *obuf;
+    redis_obuf_ref *refs;
+    int nref;
+    int maxref;
+    size_t wpos;            /* output already written, resumed from there */
+    size_t hwm;             /* pending output refusing new commands, 0 for none */
 } redis_context;
 
+/* one step of a compiled command, see redis_compile_command() */
+typedef struct redis_template_op {
+    int type;
+    int conv;               /* conversion character of a slot */
+    int mod;                /* length modifier of a slot */
+    size_t off;             /* bytes in data: constant RESP, literal or spec */
+    size_t len;
+} redis_template_op;
+
+typedef struct redis_template {
+    int argc;
+    int nop;
+    int maxop;
+    redis_template_op *op;
+    char *data;
+} redis_template;
+
 typedef struct redis_reply {
     int type;
     long long integer;
     int len;
     char *str;
     size_t elements;
-    size_t total;           /* total elements */
     struct redis_reply *element;	
 } redis_reply;
 
+/* one level of the reply tree the reader is currently filling */
+typedef struct redis_read_task {
+    redis_reply *reply;
+    size_t idx;             /* next element to parse */
+} redis_read_task;
+
+/* bump allocator owning every reply tree built by a reader */
+typedef struct redis_arena_block {
+    struct redis_arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+} redis_arena_block;
+
 typedef struct redis_reader {
     int err;
     char errstr[REDIS_ERRBUF_SIZE];
@@ -48,13 +131,30 @@ typedef struct redis_reader {
     size_t pos;
     size_t len;
     size_t maxbuf;    
+    size_t readsize;        /* adaptive size of the next read */
     size_t readcount;
+    int flags;
+    redis_arena_block *arena;
+    int ridx;               /* top of the task stack, -1 between replies */
+    size_t rstart;          /* offset in buf of the reply being parsed */
+    long bulklen;           /* payload length of a pending bulk, -1 if none */
+    redis_read_task task[REDIS_READER_MAX_DEPTH];
     redis_reply *reply;
     redis_context *c;
 } redis_reader;
 
 struct redis_async_context;
+struct st_el_hook;
+struct st_event_loop;
 typedef void (redis_callback_function)(struct redis_async_context *ac);
+/* reply is NULL when the connection was lost before it arrived */
+typedef void (redis_reply_callback)(struct redis_async_context *ac, redis_reply *reply, void *privdata);
+
+typedef struct redis_async_callback {
+    redis_reply_callback *fn;
+    void *privdata;
+} redis_async_callback;
+
 typedef struct redis_async_context {
     int err;
     char *errstr; 
@@ -62,22 +162,47 @@ typedef struct redis_async_context {
     redis_reader *r;
     char ip[64];
     int port;
+    char path[128];             /* unix socket, empty for tcp */
     char passwd[512];
     redis_callback_function *fn_read;
     redis_callback_function *fn_reconnect;
     void *el;
+    int own_el;                 /* el was created for this context */
     int status;
+    redis_async_callback *cb;   /* ring of callbacks waiting for a reply */
+    int cbhead;
+    int cbcount;
+    int cbsize;
+    struct st_el_hook *flush;   /* writes the commands of a loop iteration at once */
+    int flush_delay;            /* ms a small batch may wait, 0 for none */
+    int flush_timer;            /* -1 when not armed */
+    int reconnect_timer;        /* -1 while connected */
+    int connecting;             /* REDIS_CONN_*, an attempt in progress */
+    int connect_timer;          /* -1 unless an attempt is in progress */
+    int backoff;                /* ms the next attempt may wait at most */
+    unsigned int seed;          /* jitter of the backoff */
 } redis_async_context;
 
 redis_context *redis_connect(char *ip, int port);
 redis_context *redis_connect_with_timeout(char *ip, int port, size_t timeout);
+redis_context *redis_connect_unix(char *path);
+redis_context *redis_connect_unix_with_timeout(char *path, size_t timeout);
 void redis_free(redis_context *c);
 redis_reader *redis_create_reader(void);
 void redis_free_reader(redis_reader *r);
+void redis_reader_set_zerocopy(redis_reader *r, int on);
+int redis_reader_feed(redis_reader *r, const char *buf, size_t len);
+int redis_set_simd(int level);
 int redis_set_timeout(redis_context *c, size_t timeout);
 int redis_set_nonblock(redis_context *c);
+void redis_set_write_hwm(redis_context *c, size_t hwm);
+size_t redis_write_pending(redis_context *c);
 
 int redis_append_command(redis_context *c, const char *cmd, ...);
+int redis_append_command_argv(redis_context *c, int argc, const char **argv, const size_t *argvlen);
+redis_template *redis_compile_command(const char *format);
+int redis_append_template(redis_context *c, const redis_template *tpl, ...);
+void redis_free_template(redis_template *tpl);
 int redis_exec_command(redis_context *c, redis_reader *r);
 
 int redis_get_return_number(redis_reader *r);
@@ -85,13 +210,78 @@ redis_reply *redis_get_reply(redis_reader *r);
 
 /* redis async */
 #define redis_async_append_command(ac, cmd) redis_append_command(ac->c, cmd)
-#define redis_async_exec_command(ac) redis_exec_command(ac->c, ac->r)
 #define redis_async_get_reply(ac) redis_get_reply(ac->r)
 redis_async_context* redis_async_connect(char *err, char *ip, int port, char *pass);
+redis_async_context* redis_async_connect_unix(char *err, char *path, char *pass);
 void redis_async_free(redis_async_context *ac);
+int redis_async_exec_command(redis_async_context *ac);
+void redis_async_set_flush_delay(redis_async_context *ac, int milliseconds);
+int redis_async_command(redis_async_context *ac, redis_reply_callback *fn, void *privdata, const char *format, ...);
 void redis_async_set_reconnect_callback(redis_async_context *ac, redis_callback_function *fn);
 void redis_async_set_read_callback(redis_async_context *ac, redis_callback_function *fn);
+int redis_async_attach(redis_async_context *ac, struct st_event_loop *el);
 void redis_async_run(redis_async_context *ac);
+
+redis_reply *redis_copy_reply(const redis_reply *reply);
+
+/* redis engine: I/O threads each driving a loop of async connections */
+typedef struct redis_engine redis_engine;
+typedef struct redis_future redis_future;
+redis_engine *redis_engine_create(char *errstr, int nthread, int nconn, char *ip, int port, char *pass);
+void redis_engine_free(redis_engine *e);
+int redis_engine_command(redis_engine *e, redis_reply_callback *fn, void *privdata, const char *format, ...);
+redis_future *redis_engine_command_future(redis_engine *e, const char *format, ...);
+redis_reply *redis_future_wait(redis_future *f);
+void redis_future_free(redis_future *f);
+
+/* redis pool: blocking connections shared by threads */
+typedef struct redis_pool redis_pool;
+typedef struct redis_pool_conn {
+    redis_context *c;
+    redis_reader *r;
+} redis_pool_conn;
+redis_pool *redis_pool_create(char *errstr, char *ip, int port, char *pass, int min, int max);
+redis_pool *redis_pool_create_unix(char *errstr, char *path, char *pass, int min, int max);
+void redis_pool_free(redis_pool *p);
+redis_pool_conn *redis_pool_get(redis_pool *p, char *errstr);
+void redis_pool_put(redis_pool *p, redis_pool_conn *conn);
+void redis_pool_trim(redis_pool *p);
+
+/* redis mux: one connection pipelining the commands of many threads */
+typedef struct redis_mux redis_mux;
+redis_mux *redis_mux_connect(char *errstr, char *ip, int port, char *pass);
+redis_mux *redis_mux_connect_unix(char *errstr, char *path, char *pass);
+void redis_mux_free(redis_mux *m);
+redis_future *redis_mux_command_future(redis_mux *m, const char *format, ...);
+redis_reply *redis_mux_command(redis_mux *m, const char *format, ...);
+int redis_mux_error(redis_mux *m, char *errstr);
+
+/* redis cluster: commands routed to the node owning their hash slot */
+typedef struct redis_cluster redis_cluster;
+redis_cluster *redis_cluster_connect(char *errstr, char *addrs, char *pass);
+void redis_cluster_free(redis_cluster *cc);
+int redis_cluster_keyslot(const char *key, size_t len);
+int redis_cluster_append_command(redis_cluster *cc, const char *format, ...);
+int redis_cluster_exec(redis_cluster *cc, char *errstr);
+void redis_cluster_set_timeout(redis_cluster *cc, int milliseconds);
+redis_reply *redis_cluster_get_reply(redis_cluster *cc);
+redis_reply *redis_cluster_command(redis_cluster *cc, const char *format, ...);
+
+/* redis shard: keys spread over standalone nodes by consistent hashing */
+typedef struct redis_shard redis_shard;
+redis_shard *redis_shard_connect(char *errstr, char *addrs, char *pass);
+int redis_shard_add_node(redis_shard *sh, char *errstr, char *ip, int port);
+void redis_shard_free(redis_shard *sh);
+int redis_shard_locate(redis_shard *sh, const char *key, size_t len);
+int redis_shard_append_command(redis_shard *sh, const char *format, ...);
+int redis_shard_exec(redis_shard *sh, char *errstr);
+void redis_shard_set_timeout(redis_shard *sh, int milliseconds);
+redis_reply *redis_shard_get_reply(redis_shard *sh);
+redis_reply *redis_shard_command(redis_shard *sh, const char *format, ...);
+redis_reply *redis_shard_mget(redis_shard *sh, char *errstr, int n, const char **keys, const size_t *keylens);
+int redis_shard_mset(redis_shard *sh, char *errstr, int n, const char **keys, const size_t *keylens,
+        const char **vals, const size_t *vallens);
+long long redis_shard_del(redis_shard *sh, char *errstr, int n, const char **keys, const size_t *keylens);
     
 
 #endif /*__LIBREDIS_H__*/